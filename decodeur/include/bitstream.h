@@ -11,6 +11,13 @@ struct bitstream;
 /* Open the filename file as bitstream */
 extern struct bitstream *create_bitstream(const char *filename);
 
+/*
+ * Open size bytes of memory as bitstream, data must outlive the stream.
+ * The given stream is reused when not NULL.
+ */
+extern struct bitstream *open_memory_bitstream(struct bitstream *stream,
+                                               const uint8_t *data, uint32_t size);
+
 /* Returns true if eof is reached */
 extern bool end_of_bitstream(struct bitstream *stream);
 
@@ -24,9 +31,44 @@ extern uint8_t read_bitstream(struct bitstream *stream, uint8_t nb_bits,
 /* Read in the stream until the value "byte" is found or the end of file */
 extern bool skip_bitstream_until(struct bitstream *stream, uint8_t byte);
 
+/*
+ * Skips byte stuffed data until the next marker, left unread.
+ * Returns the marker's code, or 0 if the end of file is reached.
+ */
+extern uint8_t skip_bitstream_to_marker(struct bitstream *stream);
+
+/* Returns the position of the next unread byte */
+extern uint32_t pos_bitstream(struct bitstream *stream);
+
+/*
+ * Returns the position of the next unread bit of byte stuffed data,
+ * a stuffed 0x00 byte still to be skipped being counted as read
+ */
+extern uint32_t bit_pos_bitstream(struct bitstream *stream);
+
+/* Seek the stream to a specific position */
+extern void seek_bitstream(struct bitstream *stream, uint32_t pos);
+
+/*
+ * Loads all bytes from the current position to the end of file
+ * into *data, of *capacity bytes, only reallocated when it must grow,
+ * without moving the stream. Returns the loaded size (0 on error).
+ */
+extern uint32_t load_bitstream(struct bitstream *stream, uint8_t **data, uint32_t *capacity);
+
 /* Close the stream and free all memory */
 extern void free_bitstream(struct bitstream *stream);
 
+/*
+ * Sizes an array of nb memory bitstreams (one per worker thread),
+ * growing the *streams array of *nb_streams streams when required.
+ * Returns false on allocation failure.
+ */
+extern bool reserve_bitstreams(struct bitstream ***streams, uint32_t *nb_streams, uint32_t nb);
+
+/* Frees an array of *nb_streams bitstreams */
+extern void free_bitstreams(struct bitstream ***streams, uint32_t *nb_streams);
+
 
 #endif
 
@@ -21,6 +21,12 @@
               "\n"\
               "Options list :\n"\
               "    -o <output_file> : Output TIFF path\n"\
+              "    -t <threads>     : Number of decoding threads (default : all cores)\n"\
+              "    -s <scale>       : Reduced size decoding : 1/2, 1/4 or 1/8\n"\
+              "    -crop <x,y,w,h>  : Only decode this region (in output pixels)\n"\
+              "    -p               : Write a preview after each scan of progressive\n"\
+              "                       or multiple scan files\n"\
+              "                       (<output>.<scan>.tiff)\n"\
               "    -h               : Display this help\n"
 
 
@@ -4,16 +4,21 @@
 #include <stdint.h>
 
 
-/* Convert Y / Cb / Cr MCUs to RGB MCUs */
+/*
+ * Convert Y / Cb / Cr MCUs to RGB MCUs,
+ * made of block_dim x block_dim pixel blocks
+ */
 extern void YCbCr_to_ARGB(uint8_t  *mcu_YCbCr[3], uint32_t *mcu_RGB,
-                uint32_t nb_blocks_h, uint32_t nb_blocks_v);
+                uint32_t nb_blocks_h, uint32_t nb_blocks_v,
+                uint8_t block_dim);
 
 /*
  * Convert Y MCUs to RGB MCUs
  * Used for grayscale images
  */
 extern void Y_to_ARGB(uint8_t *mcu_Y, uint32_t *mcu_RGB,
-                uint32_t nb_blocks_h, uint32_t nb_blocks_v);
+                uint32_t nb_blocks_h, uint32_t nb_blocks_v,
+                uint8_t block_dim);
 
 
 #endif
@@ -11,10 +11,11 @@ struct huff_table;
 
 
 /*
- * Loads a Huffman table from the input stream.
+ * Loads a Huffman table from the input stream,
+ * into table if not NULL (otherwise allocated).
  */
-extern struct huff_table *load_huffman_table(
-                struct bitstream *stream, uint16_t *nb_byte_read);
+extern struct huff_table *load_huffman_table(struct bitstream *stream,
+                struct huff_table *table, uint16_t *nb_byte_read);
 
 /*
  * Reads a Huffman value from the input stream.
@@ -23,7 +24,7 @@ extern int8_t next_huffman_value(struct huff_table *table,
                 struct bitstream *stream);
 
 /*
- * Recursively free a Huffman table.
+ * Frees a Huffman table and all its nodes.
  */
 extern void free_huffman_table(struct huff_table *table);
 
@@ -9,4 +9,10 @@
  */
 extern void idct_block(int32_t in[64], uint8_t out[64]);
 
+/*
+ * Computes a reduced inverse DCT : the dim x dim output
+ * block (dim = 4, 2 or 1) is the block downscaled 8 / dim times
+ */
+extern void idct_block_scaled(int32_t in[64], uint8_t *out, uint8_t dim);
+
 #endif
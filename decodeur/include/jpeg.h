@@ -4,6 +4,8 @@
 
 #include "common.h"
 #include "bitstream.h"
+#include "workspace.h"
+#include "pipeline.h"
 
 #define MAX_COMPS 3
 #define MAX_HTABLES 4
@@ -24,6 +26,8 @@ enum jpeg_section {
         COM  = 0xFE,
         DQT  = 0xDB,
         SOF0 = 0xC0,
+        SOF2 = 0xC2,
+        SOF3 = 0xC3,
         DHT  = 0xC4,
         SOS  = 0xDA,
         EOI  = 0xD9,
@@ -31,9 +35,16 @@ enum jpeg_section {
         TEM  = 0x01,
         DNL  = 0xDC,
         DHP  = 0xDE,
-        EXP  = 0xDF
+        EXP  = 0xDF,
+        DRI  = 0xDD,
+
+        /* RST0 to RST7, cycled between restart intervals */
+        RST0 = 0xD0
 };
 
+/* Number of distinct restart markers */
+#define NB_RST 8
+
 /* JPEG status check */
 enum jpeg_status {
         DHT_OK  = 1,
@@ -42,16 +53,39 @@ enum jpeg_status {
         ALL_OK  = 7
 };
 
+/* Exact entropy decoding state at an MCU start, and speculatively decoded scan part */
+struct mcu_state;
+struct scan_chunk;
+
+/* Image region, in decoded pixels */
+struct region {
+        uint32_t x, y;
+        uint32_t width, height;
+};
+
 /* Command line options */
 struct options {
         char *input;
         char *output;
+
+        /* Number of decoding threads */
+        uint32_t nb_threads;
+
+        /* Write a preview after each scan of progressive or multiple scan files */
+        bool previews;
+
+        /* Reduction factor of the decoded image : 1, 2, 4 or 8 */
+        uint8_t scale;
+
+        /* Region of interest to decode (empty : whole image) */
+        struct region crop;
 };
 
 /* Component informations */
 struct comp {
 
         /* SOF0 data */
+        uint8_t id;
         uint8_t nb_blocks_h;
         uint8_t nb_blocks_v;
         uint8_t i_q;
@@ -64,6 +98,20 @@ struct comp {
         int32_t last_DC;
 };
 
+/* Current scan informations */
+struct scan {
+
+        /* Components of the scan, in coding order */
+        uint8_t nb_comps;
+        uint8_t comps[MAX_COMPS];
+
+        /* Spectral selection : first and last zig-zag coefficients */
+        uint8_t start, end;
+
+        /* Successive approximation : previous and current low bits */
+        uint8_t high, low;
+};
+
 /* JPEG informations */
 struct jpeg_data {
 
@@ -81,14 +129,70 @@ struct jpeg_data {
         /* Color index order */
         uint8_t comp_order[MAX_COMPS];
 
+        /* SOF2 frame, coded by several refining scans */
+        bool progressive;
+
+        /*
+         * SOF3 frame, coded by predicting each sample from its neighbours
+         * (the scan's start is the predictor, its low bit the point transform)
+         */
+        bool lossless;
+
+        /* Current scan */
+        struct scan scan;
+
         /* Huffman tables */
         struct huff_table *htables[2][MAX_HTABLES];
 
+        /* Previous images' Huffman tables, reloaded by the next DHT sections */
+        struct huff_table *spare_htables[2][MAX_HTABLES];
+
         /* Quantification tables */
         uint8_t qtables[MAX_QTABLES][BLOCK_SIZE];
         
         /* JPEG status check */
         uint8_t state;
+
+        /* Number of MCUs per restart interval (0 : no restart) */
+        uint16_t restart_interval;
+
+        /* Number of decoding threads */
+        uint32_t nb_threads;
+
+        /* Write a preview after each scan of progressive or multiple scan files */
+        bool previews;
+
+        /* Reduction factor of the decoded image : 1, 2, 4 or 8 */
+        uint8_t scale;
+
+        /* Region of interest to decode (empty : whole image) */
+        struct region crop;
+
+        /* Aligned MCU decoding buffers, one per thread */
+        struct workspace *workspaces;
+        uint32_t nb_workspaces;
+
+        /* Memory bitstreams reading the loaded scan, one per thread */
+        struct bitstream **streams;
+        uint32_t nb_streams;
+
+        /*
+         * Scan loaded to decode restart intervals or locate rows
+         * speculatively, with the intervals' start and end offsets,
+         * each row's start state and the speculative scan chunks.
+         * Capacities are in bytes, nb_chunks counts the allocated chunks.
+         */
+        uint8_t *scan_data;
+        uint32_t scan_capacity;
+        uint32_t *offsets;
+        uint32_t offsets_capacity;
+        struct mcu_state *row_states;
+        uint32_t row_states_capacity;
+        struct scan_chunk *chunks;
+        uint32_t nb_chunks;
+
+        /* Pipeline worker threads (NULL : started for each run) */
+        struct thread_pool *pool;
 };
 
 
@@ -103,6 +207,15 @@ extern void read_header(struct bitstream *stream, struct jpeg_data *jpeg, bool *
 /* Extract, decode jpeg data and write image data to tiff file */
 extern void process_image(struct bitstream *stream, struct jpeg_data *jpeg, bool *error);
 
+/*
+ * Creates a jpeg_data structure, whose Huffman tables,
+ * workspaces, scan buffers and threads are kept from one image to another
+ */
+extern struct jpeg_data *create_jpeg_data(void);
+
+/* Clears any image specific data, keeping allocated memory */
+extern void reset_jpeg_data(struct jpeg_data *jpeg);
+
 /* Free jpeg_data structure */
 extern void free_jpeg_data(struct jpeg_data *jpeg);
 
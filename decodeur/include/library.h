@@ -33,6 +33,13 @@ extern bool is_valid_ext(char *path);
  */
 extern bool skip_bitstream(struct bitstream *stream, uint32_t nb_bytes);
 
+/*
+ * Ensures a buffer holds at least size bytes.
+ * The buffer is only reallocated when it must grow,
+ * and freed on allocation failure (NULL is then returned).
+ */
+extern void *reserve_buffer(void *buffer, uint32_t *capacity, uint32_t size);
+
 /*
  * Parses arguments given to the program and puts them in *options
  */
@@ -0,0 +1,22 @@
+/* Projet C - Sujet JPEG */
+#ifndef __LOSSLESS_H__
+#define __LOSSLESS_H__
+
+#include "common.h"
+#include "jpeg.h"
+
+
+/* Sample precision of lossless frames, in bits */
+#define LOSSLESS_PRECISION 8
+
+/*
+ * Decodes a lossless (SOF3) scan line by line, each sample being
+ * predicted from its already decoded neighbours, and writes the
+ * region's lines to the jpeg->path TIFF file.
+ * Reduced decoding keeps one sample out of scale.
+ */
+extern void decode_lossless(struct bitstream *stream, struct jpeg_data *jpeg,
+                            const struct region *region, bool *error);
+
+
+#endif
@@ -34,4 +34,20 @@ extern void write_tiff_file (struct tiff_file_desc *tfd,
                                 uint8_t nb_blocks_h,
                                 uint8_t nb_blocks_v);
 
+/* Ecrit nb_lines lignes de l'image à partir de la ligne first_line,
+ * depuis les pixels ARGB rgb dont les lignes successives sont
+ * espacées de stride pixels. */
+extern void write_tiff_lines(struct tiff_file_desc *tfd,
+                             uint32_t first_line,
+                             uint32_t nb_lines,
+                             const uint32_t *rgb,
+                             uint32_t stride);
+
+/* Ecrit la bande d'indice strip à partir des pixels ARGB rgb, dont
+ * les lignes successives sont espacées de stride pixels. */
+extern void write_tiff_strip(struct tiff_file_desc *tfd,
+                             uint32_t strip,
+                             const uint32_t *rgb,
+                             uint32_t stride);
+
 #endif
@@ -5,11 +5,15 @@
 #include <stdint.h>
 
 
-/* Upsamples any input component's blocks */
+/*
+ * Upsamples any input component's blocks
+ * of block_dim x block_dim pixels
+ */
 extern void upsampler(uint8_t *in,
                 uint8_t nb_blocks_in_h, uint8_t nb_blocks_in_v,
                 uint8_t *out,
-                uint8_t nb_blocks_out_h, uint8_t nb_blocks_out_v);
+                uint8_t nb_blocks_out_h, uint8_t nb_blocks_out_v,
+                uint8_t block_dim);
 
 
 #endif
@@ -0,0 +1,70 @@
+/* Projet C - Sujet JPEG */
+#ifndef __WORKSPACE_H__
+#define __WORKSPACE_H__
+
+#include "common.h"
+
+
+/* Alignment of every workspace plane (one cache line) */
+#define WORKSPACE_ALIGN 64
+
+
+/*
+ * MCU decoding workspace :
+ * every plane is 64-byte aligned and padded
+ * to a whole number of cache lines.
+ */
+struct workspace {
+
+        /* Whole allocation, and its usable size */
+        void *memory;
+        size_t capacity;
+
+        /* Dimensions (in blocks) the planes are sized for */
+        uint8_t mcu_h_dim, mcu_v_dim;
+
+        /* Coefficient blocks (unpacked, dequantized) */
+        int32_t *block;
+        int32_t *iqzz;
+
+        /* IDCT output blocks of one component */
+        uint8_t *idct;
+
+        /* Upsampled Y, Cb and Cr MCU planes */
+        uint8_t *YCbCr[3];
+
+        /* ARGB MCU */
+        uint32_t *RGB;
+};
+
+
+/*
+ * Sizes a workspace for MCUs of mcu_h_dim x mcu_v_dim blocks.
+ * Memory is only reallocated when growing.
+ * Returns false on allocation failure.
+ */
+extern bool reserve_workspace(struct workspace *ws,
+                              uint8_t mcu_h_dim, uint8_t mcu_v_dim);
+
+/* Frees a workspace's memory */
+extern void free_workspace(struct workspace *ws);
+
+/*
+ * Sizes nb workspaces (one per worker thread), growing
+ * the *ws array of *nb_ws workspaces when required.
+ * Returns false on allocation failure.
+ */
+extern bool reserve_workspaces(struct workspace **ws, uint32_t *nb_ws, uint32_t nb,
+                               uint8_t mcu_h_dim, uint8_t mcu_v_dim);
+
+/* Frees an array of *nb_ws workspaces */
+extern void free_workspaces(struct workspace **ws, uint32_t *nb_ws);
+
+/* Allocates size bytes aligned on WORKSPACE_ALIGN */
+extern void *aligned_malloc(size_t size);
+
+/* Frees memory allocated by aligned_malloc */
+extern void aligned_free(void *memory);
+
+
+#endif
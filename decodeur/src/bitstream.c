@@ -10,9 +10,14 @@
  */
 struct bitstream {
 
-        /* Currently opened file */
+        /* Currently opened file (NULL : memory bitstream) */
         FILE *file;
 
+        /* Memory data read instead of a file, its size and next byte's position */
+        const uint8_t *data;
+        uint32_t size;
+        uint32_t pos;
+
         /* Current byte */
         uint8_t byte;
 
@@ -45,6 +50,7 @@ struct bitstream *create_bitstream(const char *filename)
 
                         if (stream != NULL) {
                                 stream->file = file;
+                                stream->data = NULL;
                                 stream->byte = 0;
                                 stream->index = 0;
                                 stream->buffer_size = 0;
@@ -58,6 +64,43 @@ struct bitstream *create_bitstream(const char *filename)
         return stream;
 }
 
+/*
+ * Open size bytes of memory as bitstream, data must outlive the stream.
+ * The given stream is reused when not NULL.
+ */
+struct bitstream *open_memory_bitstream(struct bitstream *stream,
+                                        const uint8_t *data, uint32_t size)
+{
+        if (data == NULL || size == 0)
+                return NULL;
+
+        if (stream == NULL)
+                stream = calloc(1, sizeof(struct bitstream));
+
+        /* Initialize the stream */
+        if (stream != NULL) {
+                if (stream->file != NULL)
+                        fclose(stream->file);
+
+                stream->file = NULL;
+                stream->data = data;
+                stream->size = size;
+                stream->pos = 0;
+                stream->byte = 0;
+                stream->index = 0;
+                stream->buffer_size = 0;
+                stream->buf_idx = BUFFER_SIZE;
+        }
+
+        return stream;
+}
+
+/* Returns true if the stream reads a file or memory */
+static inline bool is_open(struct bitstream *stream)
+{
+        return stream != NULL && (stream->file != NULL || stream->data != NULL);
+}
+
 /* Returns true if eof is reached */
 bool end_of_bitstream(struct bitstream *stream)
 {
@@ -67,9 +110,30 @@ bool end_of_bitstream(struct bitstream *stream)
                 end = feof(stream->file) ? true : false;
         }
 
+        else if (is_open(stream))
+                end = stream->pos >= stream->size
+                      && stream->buf_idx >= stream->buffer_size;
+
         return end;
 }
 
+/* Reads up to BUFFER_SIZE bytes from the file or memory into the buffer */
+static inline size_t fill_buffer(struct bitstream *stream)
+{
+        if (stream->file != NULL)
+                return fread(stream->buffer, 1, BUFFER_SIZE, stream->file);
+
+        size_t size = stream->size - stream->pos;
+
+        if (size > BUFFER_SIZE)
+                size = BUFFER_SIZE;
+
+        memcpy(stream->buffer, &stream->data[stream->pos], size);
+        stream->pos += size;
+
+        return size;
+}
+
 /* Read the next byte in the stream */
 uint8_t next_byte(struct bitstream *stream, bool *error)
 {
@@ -78,7 +142,7 @@ uint8_t next_byte(struct bitstream *stream, bool *error)
         
         /* Reads BUFFER_SIZE bytes in the stream */
         if (stream->buf_idx >= stream->buffer_size) {
-                ret = fread(stream->buffer, 1, BUFFER_SIZE, stream->file);
+                ret = fill_buffer(stream);
 
                 if (ret > 0) {
                         stream->buffer_size = ret;
@@ -143,7 +207,7 @@ uint8_t read_bitstream(struct bitstream *stream,
         uint16_t nb_bit_read = 0;
         uint32_t out = 0;
 
-        if (stream == NULL || stream->file == NULL || dest == NULL || !nb_bits)
+        if (!is_open(stream) || dest == NULL || !nb_bits)
                 return 0;
 
         /* 
@@ -199,7 +263,7 @@ uint8_t read_bitstream(struct bitstream *stream,
 /* Read in the stream until the value "byte" is found or the end of file */
 bool skip_bitstream_until(struct bitstream *stream, uint8_t byte)
 {
-        if (stream != NULL && stream->file != NULL) {
+        if (is_open(stream)) {
 
                 /* The current byte is our goal */
                 if (stream->index == 8 && stream->byte == byte)
@@ -229,6 +293,184 @@ bool skip_bitstream_until(struct bitstream *stream, uint8_t byte)
         return false;
 }
 
+/*
+ * Skips byte stuffed data until the next marker, left unread.
+ * Returns the marker's code, or 0 if the end of file is reached.
+ */
+uint8_t skip_bitstream_to_marker(struct bitstream *stream)
+{
+        bool error = false;
+        uint8_t byte, marker = 0;
+
+        if (!is_open(stream))
+                return 0;
+
+        /* The remaining bits of the current byte are skipped */
+        if (stream->index == 8)
+                byte = stream->byte;
+        else
+                byte = next_byte(stream, &error);
+
+        while (!error && marker == 0) {
+
+                /* A 0xFF byte not followed by a stuffed 0x00 byte */
+                if (byte == 0xFF) {
+                        byte = next_byte(stream, &error);
+
+                        if (byte != 0x00 && byte != 0xFF && !error)
+                                marker = byte;
+                }
+                else
+                        byte = next_byte(stream, &error);
+        }
+
+        /* Leave the whole marker unread */
+        if (marker != 0) {
+                stream->buf_idx--;
+                stream->byte = 0xFF;
+                stream->index = 8;
+        }
+        else
+                stream->index = 0;
+
+        return marker;
+}
+
+/* Returns the position of the next unread byte */
+uint32_t pos_bitstream(struct bitstream *stream)
+{
+        uint32_t pos = 0;
+
+        if (is_open(stream)) {
+                pos = (stream->file != NULL) ? ftell(stream->file) : stream->pos;
+
+                /* Bytes read ahead in the buffer are not consumed yet */
+                if (stream->buf_idx < stream->buffer_size)
+                        pos -= stream->buffer_size - stream->buf_idx;
+
+                /* Neither is a whole pending byte */
+                if (stream->index == 8)
+                        pos--;
+        }
+
+        return pos;
+}
+
+/*
+ * Returns the position of the next unread bit of byte stuffed data,
+ * a stuffed 0x00 byte still to be skipped being counted as read
+ */
+uint32_t bit_pos_bitstream(struct bitstream *stream)
+{
+        if (stream == NULL)
+                return 0;
+
+        uint32_t pos = 8 * pos_bitstream(stream);
+
+        /* Unread bits of the current byte */
+        if (stream->index < 8)
+                pos -= stream->index;
+
+        /* A 0xFF byte is always followed by a stuffed 0x00 byte */
+        if (stream->index == 0 && stream->byte == 0xFF)
+                pos += 8;
+
+        return pos;
+}
+
+/* Seek the stream to a specific position */
+void seek_bitstream(struct bitstream *stream, uint32_t pos)
+{
+        if (!is_open(stream))
+                return;
+
+        stream->byte = 0;
+        stream->index = 0;
+        stream->buffer_size = 0;
+        stream->buf_idx = BUFFER_SIZE;
+
+        if (stream->file != NULL)
+                fseek(stream->file, pos, SEEK_SET);
+        else
+                stream->pos = (pos < stream->size) ? pos : stream->size;
+}
+
+/*
+ * Loads all bytes from the current position to the end of file
+ * into *data, of *capacity bytes, only reallocated when it must grow,
+ * without moving the stream. Returns the loaded size (0 on error).
+ */
+uint32_t load_bitstream(struct bitstream *stream, uint8_t **data, uint32_t *capacity)
+{
+        uint32_t size;
+
+        if (stream == NULL || stream->file == NULL || data == NULL || capacity == NULL)
+                return 0;
+
+        const uint32_t pos = pos_bitstream(stream);
+
+        fseek(stream->file, 0, SEEK_END);
+        size = ftell(stream->file) - pos;
+
+        seek_bitstream(stream, pos);
+
+        /* The previous content is not kept */
+        if (size > *capacity) {
+                SAFE_FREE(*data);
+                *data = malloc(size);
+                *capacity = (*data != NULL) ? size : 0;
+        }
+
+        if (*data == NULL || fread(*data, 1, size, stream->file) != size)
+                size = 0;
+
+        seek_bitstream(stream, pos);
+
+        return size;
+}
+
+/*
+ * Sizes an array of nb memory bitstreams (one per worker thread),
+ * growing the *streams array of *nb_streams streams when required.
+ * Returns false on allocation failure.
+ */
+bool reserve_bitstreams(struct bitstream ***streams, uint32_t *nb_streams, uint32_t nb)
+{
+        if (streams == NULL || nb_streams == NULL)
+                return false;
+
+        if (nb > *nb_streams) {
+                struct bitstream **array = realloc(*streams, nb * sizeof(struct bitstream*));
+
+                if (array == NULL)
+                        return false;
+
+                *streams = array;
+
+                for (; *nb_streams < nb; (*nb_streams)++) {
+                        array[*nb_streams] = calloc(1, sizeof(struct bitstream));
+
+                        if (array[*nb_streams] == NULL)
+                                return false;
+                }
+        }
+
+        return true;
+}
+
+/* Frees an array of *nb_streams bitstreams */
+void free_bitstreams(struct bitstream ***streams, uint32_t *nb_streams)
+{
+        if (streams == NULL || nb_streams == NULL)
+                return;
+
+        for (uint32_t i = 0; i < *nb_streams; i++)
+                free_bitstream((*streams)[i]);
+
+        SAFE_FREE(*streams);
+        *nb_streams = 0;
+}
+
 /* Close the stream and free all memory */
 void free_bitstream(struct bitstream *stream)
 {
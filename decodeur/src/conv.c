@@ -3,11 +3,15 @@
 #include "common.h"
 #include "library.h"
 
-/* Convert Y / Cb / Cr MCUs to RGB MCUs */
+/*
+ * Convert Y / Cb / Cr MCUs to RGB MCUs,
+ * made of block_dim x block_dim pixel blocks
+ */
 void YCbCr_to_ARGB(uint8_t  *mcu_YCbCr[3], uint32_t *mcu_RGB,
-                uint32_t nb_blocks_h, uint32_t nb_blocks_v)
+                uint32_t nb_blocks_h, uint32_t nb_blocks_v,
+                uint8_t block_dim)
 {
-        const uint32_t NB_PIXELS = BLOCK_SIZE * nb_blocks_h * nb_blocks_v;
+        const uint32_t NB_PIXELS = block_dim * block_dim * nb_blocks_h * nb_blocks_v;
 
         uint8_t *Y = mcu_YCbCr[0];
         uint8_t *Cb = mcu_YCbCr[1];
@@ -45,9 +49,10 @@ void YCbCr_to_ARGB(uint8_t  *mcu_YCbCr[3], uint32_t *mcu_RGB,
  * Used for grayscale images
  */
 void Y_to_ARGB(uint8_t *mcu_Y, uint32_t *mcu_RGB,
-                uint32_t nb_blocks_h, uint32_t nb_blocks_v)
+                uint32_t nb_blocks_h, uint32_t nb_blocks_v,
+                uint8_t block_dim)
 {
-        const uint32_t NB_PIXELS = BLOCK_SIZE * nb_blocks_h * nb_blocks_v;
+        const uint32_t NB_PIXELS = block_dim * block_dim * nb_blocks_h * nb_blocks_v;
 
         uint8_t gray;
 
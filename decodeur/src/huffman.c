@@ -3,12 +3,25 @@
 #include "common.h"
 
 
+/*
+ * Maximum number of nodes in a Huffman table :
+ * at most 256 leaves, as many internal nodes
+ * and one incomplete node per code size
+ */
+#define MAX_NODES (2 * 0x100 + 0x20)
+
+/*
+ * Node index meaning "no child".
+ * The root (index 0) is never a child.
+ */
+#define NO_NODE 0
+
 /*
  * Internal node structure
  */
 struct node {
-        struct huff_table *left;
-        struct huff_table *right;
+        uint16_t left;
+        uint16_t right;
 };
 
 /*
@@ -22,9 +35,9 @@ enum node_type {
 };
 
 /*
- * Huffman table node structure
+ * Huffman tree node structure
  */
-struct huff_table {
+struct huff_node {
         enum node_type type;
 
         union {
@@ -33,49 +46,66 @@ struct huff_table {
         } u;
 };
 
+/*
+ * Huffman table structure :
+ * all the tree nodes are stored in one arena,
+ * the root being the first node.
+ */
+struct huff_table {
+
+        /* Number of used nodes */
+        uint16_t nb_nodes;
+
+        /* Node arena */
+        struct huff_node nodes[MAX_NODES];
+};
+
 
 /*
- * Creates a Huffman table node
+ * Creates a Huffman table node in the table's arena
  * according to the "type" argument.
+ * Returns its index, or NO_NODE when the arena is full.
  */
-struct huff_table* create_node(enum node_type type, int8_t val)
+static uint16_t create_node(struct huff_table *table, enum node_type type, int8_t val)
 {
-        struct huff_table *node = malloc(sizeof(struct huff_table));
+        if (table->nb_nodes >= MAX_NODES)
+                return NO_NODE;
 
-        if (node != NULL) {
-                node->type = type;
+        uint16_t index = table->nb_nodes++;
+        struct huff_node *node = &table->nodes[index];
 
-                if (type == NODE) {
-                        node->u.node.left = NULL;
-                        node->u.node.right = NULL;
-                }
-                else
-                        node->u.val = val;
+        node->type = type;
+
+        if (type == NODE) {
+                node->u.node.left = NO_NODE;
+                node->u.node.right = NO_NODE;
         }
+        else
+                node->u.val = val;
 
-        return node;
+        return index;
 }
 
 /*
  * Recursively adds a Huffman value to a Huffman tree.
  */
-int8_t add_huffman_code(int8_t value, uint8_t code_size, struct huff_table *parent)
+static int8_t add_huffman_code(struct huff_table *table, int8_t value,
+                               uint8_t code_size, uint16_t parent)
 {
         int8_t error = 0;
 
         /*
          * If we attempt to insert
-         * a value on a leaf or a NULL pointer,
-         * return an error.
+         * a value on a leaf, return an error.
          */
-        if (parent == NULL || parent->type == LEAF)
+        if (table->nodes[parent].type == LEAF)
                 error = 1;
 
         else {
-                struct huff_table **left, **right;
+                uint16_t *left, *right;
 
-                left = &parent->u.node.left;
-                right = &parent->u.node.right;
+                left = &table->nodes[parent].u.node.left;
+                right = &table->nodes[parent].u.node.right;
 
 
                 /*
@@ -83,11 +113,11 @@ int8_t add_huffman_code(int8_t value, uint8_t code_size, struct huff_table *pare
                  * add it as a new leaf.
                  */
                 if (code_size == 0) {
-                        if (*left == NULL)
-                                *left = create_node(LEAF, value);
+                        if (*left == NO_NODE)
+                                *left = create_node(table, LEAF, value);
 
-                        else if (*right == NULL)
-                                *right = create_node(LEAF, value);
+                        else if (*right == NO_NODE)
+                                *right = create_node(table, LEAF, value);
 
                         else
                                 error = -1;
@@ -98,16 +128,23 @@ int8_t add_huffman_code(int8_t value, uint8_t code_size, struct huff_table *pare
                  * create non-existant internal nodes
                  */
                 else {
-                        if (*left == NULL)
-                                *left = create_node(NODE, 0);
+                        if (*left == NO_NODE)
+                                *left = create_node(table, NODE, 0);
 
-                        error = add_huffman_code(value, code_size - 1, *left);
+                        /* Full arena */
+                        if (*left == NO_NODE)
+                                return -1;
+
+                        error = add_huffman_code(table, value, code_size - 1, *left);
 
                         if (error) {
-                                if (*right == NULL)
-                                        *right = create_node(NODE, 0);
+                                if (*right == NO_NODE)
+                                        *right = create_node(table, NODE, 0);
+
+                                if (*right == NO_NODE)
+                                        return -1;
 
-                                error = add_huffman_code(value, code_size - 1, *right);
+                                error = add_huffman_code(table, value, code_size - 1, *right);
                         }
                 }
         }
@@ -116,16 +153,16 @@ int8_t add_huffman_code(int8_t value, uint8_t code_size, struct huff_table *pare
 }
 
 /*
- * Loads a Huffman table from the input stream.
+ * Loads a Huffman table from the input stream,
+ * into table if not NULL (otherwise allocated).
  */
-struct huff_table *load_huffman_table(
-                struct bitstream *stream, uint16_t *nb_byte_read)
+struct huff_table *load_huffman_table(struct bitstream *stream,
+                struct huff_table *table, uint16_t *nb_byte_read)
 {
         uint8_t code_sizes[16];
         uint16_t nb_codes = 0;
         int32_t size_read = 0;
         uint32_t dest;
-        struct huff_table *table = NULL;
 
         if (nb_byte_read == NULL)
                 return NULL;
@@ -146,10 +183,15 @@ struct huff_table *load_huffman_table(
                 return NULL;
 
         else {
-                /* Allocate the Huffman tree */
-                table = calloc(1, sizeof(struct huff_table));
+                /* Allocate the whole Huffman tree at once */
+                if (table == NULL)
+                        table = malloc(sizeof(struct huff_table));
+
                 if (table == NULL)
                         return NULL;
+
+                table->nb_nodes = 0;
+                create_node(table, NODE, 0);
         }
 
         /*
@@ -159,7 +201,7 @@ struct huff_table *load_huffman_table(
         for (uint8_t i = 0; i < sizeof(code_sizes); ++i) {
                 for (uint8_t j = 0; j < code_sizes[i]; ++j) {
                         size_read += read_bitstream(stream, 8, &dest, false);
-                        add_huffman_code(dest & 0xFF, i, table);
+                        add_huffman_code(table, dest & 0xFF, i, 0);
                 }
         }
 
@@ -176,68 +218,67 @@ int8_t next_huffman_value(struct huff_table *table,
                 struct bitstream *stream)
 {
         int8_t bit;
-        int8_t result = 0;
+        uint16_t index = 0;
         uint32_t dest;
 
+        if (table == NULL)
+                return 0;
+
+        const struct huff_node *nodes = table->nodes;
+
         /* Advance in the Huffman tree
          * according to each read stream bit
          * until a leaf is found */
-        while (table && table->type == NODE) {
+        while (nodes[index].type == NODE) {
                 read_bitstream(stream, 1, &dest, true);
                 bit = dest & 1;
 
                 /* Go right if it's a 1 */
                 if (bit)
-                        table = table->u.node.right;
+                        index = nodes[index].u.node.right;
 
                 /* Go left if it's a 0 */
                 else
-                        table = table->u.node.left;
-        }
+                        index = nodes[index].u.node.left;
 
-        if (table != NULL)
-                result = table->u.val;
+                /* Invalid code */
+                if (index == NO_NODE)
+                        return 0;
+        }
 
-        return result;
+        return nodes[index].u.val;
 }
 
 /*
- * Recursively free a Huffman table.
+ * Frees a Huffman table and all its nodes.
  */
 void free_huffman_table(struct huff_table *table)
 {
-        if (table != NULL) {
-
-                /* If it's an internal node, free it recursively */
-                if (table->type == NODE) {
-                        free_huffman_table(table->u.node.left);
-                        free_huffman_table(table->u.node.right);
-                }
-
-                SAFE_FREE(table);
-        }
+        SAFE_FREE(table);
 }
 
 /*
  * Recursive dot export procedure.
  */
-void huffman_export_rec(FILE *file, struct huff_table *table, uint32_t *index)
+void huffman_export_rec(FILE *file, struct huff_table *table,
+                        uint16_t node, uint32_t *index)
 {
-        if (table != NULL && index) {
+        if (node != NO_NODE && index) {
                 uint32_t cur = *index + 1;
+                struct huff_node *current = &table->nodes[node];
 
                 *index = cur;
 
                 fprintf(file, " -- %u", cur);
 
-                if (table->type == LEAF) {
+                if (current->type == LEAF) {
                         fprintf(file, "    %u [label=\"S : C => %2X\"]\n",
-                                cur, (uint8_t)table->u.val);
+                                cur, (uint8_t)current->u.val);
                 } else {
-                        huffman_export_rec(file, table->u.node.left, index);
+                        huffman_export_rec(file, table, current->u.node.left, index);
                         fprintf(file, "    %u [label=\"C\"]\n", cur);
                         fprintf(file, "    %u", cur);
-                        huffman_export_rec(file, table->u.node.right, index);
+                        huffman_export_rec(file, table, current->u.node.right, index);
                 }
         } else {
                 fprintf(file, "\n");
@@ -257,23 +298,26 @@ void huffman_export(char *dest, struct huff_table *table)
         file = fopen(dest, "w");
 
         if (table != NULL && file != NULL) {
+                struct huff_node *root = &table->nodes[0];
+
                 fprintf(file, "\ngraph {\n");
 
-                if (table->type == LEAF) {
+                if (root->type == LEAF) {
                         fprintf(file, "    %u [label=\"%i\"]\n",
-                                cur, table->u.val);
+                                cur, root->u.val);
                 } else {
                         fprintf(file, "    %u \n", cur);
                         fprintf(file, "    %u [label=\"ε\"]\n", cur);
+
+                        fprintf(file, "    %u", cur);
+                        huffman_export_rec(file, table, root->u.node.left, &index);
+                        fprintf(file, "    %u", cur);
+                        huffman_export_rec(file, table, root->u.node.right, &index);
                 }
 
-                fprintf(file, "    %u", cur);
-                huffman_export_rec(file, table->u.node.left, &index);
-                fprintf(file, "    %u", cur);
-                huffman_export_rec(file, table->u.node.right, &index);
                 fprintf(file, "}\n\n");
+        }
 
+        if (file != NULL)
                 fclose(file);
-        }
 }
-
@@ -8,10 +8,24 @@
 #include "conv.h"
 #include "upsampler.h"
 #include "library.h"
+#include "pipeline.h"
+#include "lossless.h"
 
 /* Compute how many MCUs are required to cover a given dimension */
 static inline uint16_t mcu_per_dim(uint8_t mcu, uint16_t dim);
 
+/* Computes the MCU dimensions, in blocks */
+static void mcu_dims(struct jpeg_data *jpeg, uint8_t *mcu_h_dim, uint8_t *mcu_v_dim);
+
+/* Computes how many blocks of a component cover an image dimension */
+static inline uint32_t blocks_per_dim(uint8_t nb_blocks, uint8_t mcu_dim, uint16_t dim);
+
+/* Computes an image dimension once reduced by the scale factor */
+static inline uint32_t scaled_dim(uint16_t dim, uint8_t scale);
+
+/* Computes the region to decode, returns false if it is outside the image */
+static bool find_region(struct jpeg_data *jpeg, struct region *region);
+
 
 /* Read a jpeg section */
 uint8_t read_section(struct bitstream *stream, enum jpeg_section section,
@@ -123,8 +137,13 @@ uint8_t read_section(struct bitstream *stream, enum jpeg_section section,
                 break;
 
         case SOF0:
+        case SOF2:
+        case SOF3:
                 if (jpeg != NULL) {
                         uint8_t accuracy;
+
+                        jpeg->progressive = (marker == SOF2);
+                        jpeg->lossless = (marker == SOF3);
                         read_byte(stream, &accuracy);
 
                         if (accuracy != 8) {
@@ -146,30 +165,39 @@ uint8_t read_section(struct bitstream *stream, enum jpeg_section section,
                         else {
                                 /* Read all component informations */
                                 for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
-                                        uint8_t i_c, i_q;
+                                        uint8_t id, i_c, i_q;
                                         uint8_t h_sampling_factor;
                                         uint8_t v_sampling_factor;
 
-                                        *error |= read_byte(stream, &i_c);
+                                        *error |= read_byte(stream, &id);
+                                        i_c = id;
 
                                         /*
                                          * Component index must range
-                                         * in 1 - 3 or 0 - 2
+                                         * in 1 - 3 or 0 - 2, lossless
+                                         * RGB components being 'R', 'G', 'B'
                                          */
-                                        if (i_c > 3)
+                                        if (jpeg->lossless && i_c > 3)
+                                                i_c = i;
+
+                                        else if (i_c > 3)
                                                 *error = true;
 
                                         /*
                                          * When indexes range in 1 - 3,
                                          * convert them to 0 - 2
                                          */
-                                        if (i_c != i && i_c > 0)
+                                        else if (i_c != i && i_c > 0)
                                                 --i_c;
 
                                         *error |= read_byte(stream, &byte);
                                         h_sampling_factor = byte >> 4;
                                         v_sampling_factor = byte & 0xF;
 
+                                        /* Lossless samples are only supported unsubsampled */
+                                        if (jpeg->lossless && byte != 0x11)
+                                                *error = true;
+
                                         *error |= read_byte(stream, &i_q);
 
                                         if (i_q >= MAX_QTABLES)
@@ -177,13 +205,21 @@ uint8_t read_section(struct bitstream *stream, enum jpeg_section section,
 
                                         /* Initialize component informations */
                                         if (!*error) {
+                                                jpeg->comps[i_c].id = id;
                                                 jpeg->comps[i_c].nb_blocks_h = h_sampling_factor;
                                                 jpeg->comps[i_c].nb_blocks_v = v_sampling_factor;
                                                 jpeg->comps[i_c].i_q = i_q;
                                         }
 
+                                        /* Blocks are stored by component order */
+                                        jpeg->comp_order[i] = i;
+
                                         /* Update jpeg status */
                                         jpeg->state |= SOF0_OK;
+
+                                        /* Lossless frames need no quantification table */
+                                        if (jpeg->lossless)
+                                                jpeg->state |= DQT_OK;
                                 }
                         }
                 } else
@@ -218,21 +254,32 @@ uint8_t read_section(struct bitstream *stream, enum jpeg_section section,
                                 if (unused || i_h > 3 || type > 1)
                                         *error = true;
 
+                                if (*error)
+                                        break;
+
                                 /* Read one Huffman Table */
                                 uint16_t nb_byte_read;
                                 struct huff_table *table;
+                                struct huff_table **dest = &jpeg->htables[type][i_h];
+                                struct huff_table **spare = &jpeg->spare_htables[type][i_h];
+
+                                /*
+                                 * Progressive files redefine tables between scans :
+                                 * tables are reloaded in place, the first definition
+                                 * reusing the previous image's table if any
+                                 */
+                                if (*dest == NULL) {
+                                        *dest = *spare;
+                                        *spare = NULL;
+                                }
 
-                                table = load_huffman_table(stream, &nb_byte_read);
+                                table = load_huffman_table(stream, *dest, &nb_byte_read);
 
                                 if (nb_byte_read == (uint16_t)-1 || table == NULL)
                                         *error = true;
 
-
-                                if (!*error)
-                                        jpeg->htables[type][i_h] = table;
-
                                 else
-                                        free_huffman_table(table);
+                                        *dest = table;
 
 
                                 unread -= nb_byte_read;
@@ -248,32 +295,44 @@ uint8_t read_section(struct bitstream *stream, enum jpeg_section section,
         /* Start Of Scan */
         case SOS:
                 if (jpeg != NULL) {
+                        struct scan *scan = &jpeg->scan;
                         uint8_t nb_comps, i_c;
 
                         read_byte(stream, &nb_comps);
 
                         /* 
-                         * Check that the number of component is 
-                         * the same as in the SOF Section
+                         * Check that the scan only holds
+                         * components of the SOF Section
                          */
-                        if (nb_comps != jpeg->nb_comps) {
+                        if (nb_comps == 0 || nb_comps > jpeg->nb_comps) {
                                 *error = true;
                                 return SOS;
                         }
 
+                        scan->nb_comps = nb_comps;
+
                         /* Read component informations */
                         for (uint8_t i = 0; i < nb_comps; i++) {
                                 read_byte(stream, &byte);
 
+                                /* Find the component declared in SOF */
+                                for (i_c = 0; i_c < jpeg->nb_comps; i_c++)
+                                        if (jpeg->comps[i_c].id == byte)
+                                                break;
+
+                                if (i_c == jpeg->nb_comps) {
+                                        *error = true;
+                                        return SOS;
+                                }
+
+                                scan->comps[i] = i_c;
+
                                 /*
-                                 * When indexes range in 1 - 3,
-                                 * convert them to 0 - 2
+                                 * Blocks of single scan baseline
+                                 * files are stored in scan order
                                  */
-                                i_c = byte;
-                                if(i_c != i)
-                                        --i_c;
-
-                                jpeg->comp_order[i] = i_c;
+                                if (!jpeg->progressive && nb_comps == jpeg->nb_comps)
+                                        jpeg->comp_order[i] = i_c;
 
 
                                 /* Read Huffman table indexes */
@@ -281,12 +340,53 @@ uint8_t read_section(struct bitstream *stream, enum jpeg_section section,
 
                                 jpeg->comps[i_c].i_dc = byte >> 4;
                                 jpeg->comps[i_c].i_ac = byte & 0xF;
+
+                                if (jpeg->comps[i_c].i_dc >= MAX_HTABLES
+                                    || jpeg->comps[i_c].i_ac >= MAX_HTABLES)
+                                        *error = true;
                         }
 
-                        /* Skip unused SOS data */
-                        read_byte(stream, &byte);
-                        read_byte(stream, &byte);
-                        read_byte(stream, &byte);
+                        /* Read spectral selection and successive approximation */
+                        read_byte(stream, &scan->start);
+                        read_byte(stream, &scan->end);
+                        *error |= read_byte(stream, &byte);
+
+                        scan->high = byte >> 4;
+                        scan->low = byte & 0xF;
+
+                        /*
+                         * DC and AC coefficients are never mixed,
+                         * and AC scans only hold one component
+                         */
+                        if (jpeg->progressive
+                            && (scan->start > scan->end || scan->end >= BLOCK_SIZE
+                                || (scan->start == 0 && scan->end != 0)
+                                || (scan->start > 0 && nb_comps != 1)
+                                || scan->low > 13
+                                || (scan->high && scan->high != scan->low + 1)))
+                                *error = true;
+
+                        /*
+                         * Lossless scans : a predictor from 1 to 7 and
+                         * a point transform, all components interleaved
+                         */
+                        if (jpeg->lossless
+                            && (scan->start < 1 || scan->start > 7 || scan->end != 0
+                                || scan->high != 0 || scan->low >= 8
+                                || nb_comps != jpeg->nb_comps))
+                                *error = true;
+                } else
+                        *error = true;
+
+                break;
+
+        /* Define Restart Interval */
+        case DRI:
+                if (jpeg != NULL) {
+                        *error |= read_short_BE(stream, &jpeg->restart_interval);
+                        unread -= sizeof(jpeg->restart_interval);
+
+                        skip_bitstream(stream, unread);
                 } else
                         *error = true;
 
@@ -322,121 +422,1189 @@ void read_header(struct bitstream *stream, struct jpeg_data *jpeg, bool *error)
         }
 }
 
-/* Extract, decode jpeg data and write image data to tiff file */
-void process_image(struct bitstream *stream, struct jpeg_data *jpeg, bool *error)
+/* Smallest scan chunk worth decoding speculatively, in bytes */
+#define MIN_CHUNK_SIZE 0x1000
+
+/*
+ * Entropy decoding state at an MCU start
+ */
+struct mcu_state {
+
+        /* Position of the MCU's first bit in the scan */
+        uint32_t bit_pos;
+
+        /* DC prediction of each component */
+        int32_t DC[MAX_COMPS];
+};
+
+/*
+ * MCU row decoding state,
+ * shared by all the pipeline stages
+ */
+struct row_decoder {
+
+        struct jpeg_data *jpeg;
+        struct bitstream *stream;
+        struct tiff_file_desc *file;
+
+        /* MCU dimensions, in blocks and in (possibly reduced) pixels */
+        uint8_t mcu_h_dim, mcu_v_dim;
+        uint8_t mcu_h, mcu_v;
+
+        /* Decoded block dimension : 8 divided by the scale factor */
+        uint8_t block_dim;
+
+        /* Number of MCUs per row, and of blocks per MCU */
+        uint32_t nb_mcu_h;
+        uint32_t nb_mcu_blocks;
+
+        /* Index of each component's first block in an MCU */
+        uint8_t first_block[MAX_COMPS];
+
+        /* Number of pixels per line of a decoded row */
+        uint32_t stride;
+
+        /* Decoded region, with the MCU rows and columns covering it */
+        struct region region;
+        uint32_t first_row, end_row;
+        uint32_t first_mcu, end_mcu;
+
+        /* Last DC value of each component */
+        int32_t last_DC[MAX_COMPS];
+
+        /*
+         * Unpacked blocks of the whole image when restart
+         * intervals or multiple scans were decoded beforehand,
+         * NULL otherwise
+         */
+        int32_t *blocks;
+
+        /*
+         * Entropy coded scan and exact state at each row start
+         * when rows are located speculatively, NULL otherwise
+         */
+        uint8_t *scan;
+        uint32_t scan_size;
+        struct mcu_state *row_states;
+};
+
+/*
+ * One MCU row going through the pipeline
+ */
+struct row_slot {
+
+        /* Unpacked blocks of each MCU, in scan order */
+        int32_t *blocks;
+
+        /* ARGB pixels of the whole row */
+        uint32_t *RGB;
+};
+
+
+/* Entropy decodes nb_mcus MCUs, predicting DC values from last_DC */
+static void unpack_mcus(struct bitstream *stream, struct jpeg_data *jpeg,
+                        int32_t last_DC[MAX_COMPS], uint32_t nb_mcus, int32_t *block)
 {
-        if (stream == NULL || *error || jpeg == NULL || jpeg->state != ALL_OK) {
-                *error = true;
+        uint8_t i_c, i_dc, i_ac, nb_blocks;
+
+        for (uint32_t m = 0; m < nb_mcus; m++) {
+
+                /* Retrieve each component */
+                for (uint8_t j = 0; j < jpeg->nb_comps; j++) {
+
+                        /* Retrieve component informations */
+                        i_c = jpeg->comp_order[j];
+                        i_dc = jpeg->comps[i_c].i_dc;
+                        i_ac = jpeg->comps[i_c].i_ac;
+                        nb_blocks = jpeg->comps[i_c].nb_blocks_h
+                                  * jpeg->comps[i_c].nb_blocks_v;
+
+                        /* Retrieve each block from the JPEG file */
+                        for (uint8_t n = 0; n < nb_blocks; n++) {
+                                unpack_block(stream, jpeg->htables[0][i_dc], &last_DC[i_c],
+                                             jpeg->htables[1][i_ac], block);
+
+                                block += BLOCK_SIZE;
+                        }
+                }
+        }
+}
+
+/*
+ * Opens the scan as bitstream at a given bit position, reusing stream,
+ * origin receiving the position of the stream's first bit
+ */
+static struct bitstream *open_scan(struct bitstream *stream, const uint8_t *scan,
+                                   uint32_t size, uint32_t bit_pos, uint32_t *origin)
+{
+        const uint32_t byte = bit_pos / 8;
+        uint32_t dest;
+
+        if (byte >= size)
+                return NULL;
+
+        stream = open_memory_bitstream(stream, &scan[byte], size - byte);
+
+        /* Skip the first bits of the byte */
+        if (stream != NULL && bit_pos % 8)
+                read_bitstream(stream, bit_pos % 8, &dest, true);
+
+        *origin = 8 * byte;
+
+        return stream;
+}
+
+/* Entropy decodes one MCU row from its exact start state */
+static void unpack_row(struct row_decoder *decoder, uint32_t row, int32_t *blocks,
+                       uint32_t worker)
+{
+        struct mcu_state state = decoder->row_states[row];
+        uint32_t origin;
+
+        struct bitstream *stream = open_scan(decoder->jpeg->streams[worker],
+                                             decoder->scan, decoder->scan_size,
+                                             state.bit_pos, &origin);
+
+        if (stream != NULL)
+                unpack_mcus(stream, decoder->jpeg, state.DC, decoder->nb_mcu_h, blocks);
+
+        else
+                memset(blocks, 0, decoder->nb_mcu_h * decoder->nb_mcu_blocks
+                                  * BLOCK_SIZE * sizeof(int32_t));
+}
+
+/* Entropy decodes one MCU row (serial stage) */
+static bool load_row(void *data, uint32_t row, void *slot)
+{
+        struct row_decoder *decoder = data;
+        struct row_slot *current = slot;
+
+        UNUSED(row);
+
+        unpack_mcus(decoder->stream, decoder->jpeg, decoder->last_DC,
+                    decoder->nb_mcu_h, current->blocks);
+
+        return true;
+}
+
+/*
+ * Converts one MCU row's blocks to ARGB pixels (parallel stage) :
+ * iqzz, IDCT, upsampling and color conversion.
+ */
+static void process_row(void *data, uint32_t row, void *slot, uint32_t worker)
+{
+        struct row_decoder *decoder = data;
+        struct row_slot *current = slot;
+        struct jpeg_data *jpeg = decoder->jpeg;
+        struct workspace *ws = &jpeg->workspaces[worker];
+
+        uint8_t i_c, i_q, nb_blocks_h, nb_blocks_v, nb_blocks;
+        const int32_t *block = current->blocks;
+
+        const uint8_t mcu_h_dim = decoder->mcu_h_dim;
+        const uint8_t mcu_v_dim = decoder->mcu_v_dim;
+        const uint8_t block_dim = decoder->block_dim;
+        const uint8_t block_pixels = block_dim * block_dim;
+
+        /* Rows above the region are only entropy decoded, if needed */
+        if (row < decoder->first_row)
                 return;
+
+        /* Blocks of restart intervals or multiple scans are already unpacked */
+        if (decoder->blocks != NULL)
+                block = &decoder->blocks[row * decoder->nb_mcu_h
+                                         * decoder->nb_mcu_blocks * BLOCK_SIZE];
+
+        /* Rows located speculatively are unpacked here, in parallel */
+        else if (decoder->row_states != NULL)
+                unpack_row(decoder, row, current->blocks, worker);
+
+        /* Only the MCUs covering the region are reconstructed */
+        block += decoder->first_mcu * decoder->nb_mcu_blocks * BLOCK_SIZE;
+
+        for (uint32_t m = decoder->first_mcu; m < decoder->end_mcu; m++) {
+
+                /* Convert each component */
+                for (uint8_t j = 0; j < jpeg->nb_comps; j++) {
+
+                        /* Retrieve component informations */
+                        i_c = jpeg->comp_order[j];
+                        i_q = jpeg->comps[i_c].i_q;
+                        nb_blocks_h = jpeg->comps[i_c].nb_blocks_h;
+                        nb_blocks_v = jpeg->comps[i_c].nb_blocks_v;
+                        nb_blocks = nb_blocks_h * nb_blocks_v;
+
+                        /* Convert raw data to Y, Cb or Cr MCU data */
+                        for (uint8_t n = 0; n < nb_blocks; n++) {
+
+                                /* At 1/8 scale, each block is its mean : no IDCT */
+                                if (block_dim == 1) {
+                                        const double mean = block[0] * jpeg->qtables[i_q][0]
+                                                          / (double)BLOCK_DIM + 128.;
+
+                                        ws->idct[n] = TRUNCATE(mean);
+
+                                } else {
+                                        iqzz_block((int32_t*)block, ws->iqzz,
+                                                   (uint8_t*)&jpeg->qtables[i_q]);
+
+                                        if (block_dim == BLOCK_DIM)
+                                                idct_block(ws->iqzz, &ws->idct[n * BLOCK_SIZE]);
+                                        else
+                                                idct_block_scaled(ws->iqzz,
+                                                                  &ws->idct[n * block_pixels],
+                                                                  block_dim);
+                                }
+
+                                block += BLOCK_SIZE;
+                        }
+
+                        /* Upsample current MCUs */
+                        upsampler(ws->idct, nb_blocks_h, nb_blocks_v,
+                                  ws->YCbCr[i_c], mcu_h_dim, mcu_v_dim, block_dim);
+                }
+
+                /* Convert YCbCr to RGB for color images */
+                if (jpeg->nb_comps == 3)
+                        YCbCr_to_ARGB(ws->YCbCr, ws->RGB, mcu_h_dim, mcu_v_dim, block_dim);
+
+                /* Convert Y to RGB for grayscale images */
+                else
+                        Y_to_ARGB(ws->YCbCr[0], ws->RGB, mcu_h_dim, mcu_v_dim, block_dim);
+
+                /* Place the MCU in the row */
+                uint32_t *dest = &current->RGB[m * decoder->mcu_h];
+
+                for (uint8_t y = 0; y < decoder->mcu_v; y++)
+                        memcpy(&dest[y * decoder->stride], &ws->RGB[y * decoder->mcu_h],
+                               decoder->mcu_h * sizeof(uint32_t));
         }
+}
 
-        struct tiff_file_desc *file = NULL;
-        uint8_t i_c;
-        uint8_t mcu_h = BLOCK_DIM;
-        uint8_t mcu_v = BLOCK_DIM;
-        uint8_t mcu_h_dim = 1;
-        uint8_t mcu_v_dim = 1;
+/* Writes the region's lines of one decoded MCU row to the TIFF file (serial stage) */
+static void store_row(void *data, uint32_t row, void *slot)
+{
+        struct row_decoder *decoder = data;
+        struct row_slot *current = slot;
+        const struct region *region = &decoder->region;
 
-        /* Extract the MCU size */
-        for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
-                i_c = jpeg->comp_order[i];
+        const uint32_t top = row * decoder->mcu_v;
+        uint32_t first = top, end = top + decoder->mcu_v;
+
+        if (row < decoder->first_row)
+                return;
+
+        if (first < region->y)
+                first = region->y;
+
+        if (end > region->y + region->height)
+                end = region->y + region->height;
+
+        write_tiff_lines(decoder->file, first - region->y, end - first,
+                         &current->RGB[(first - top) * decoder->stride + region->x],
+                         decoder->stride);
+}
+
+/*
+ * Restart intervals decoding state,
+ * shared by all the pipeline stages
+ */
+struct interval_decoder {
+
+        struct row_decoder *rows;
+
+        /* Entropy coded data, up to the end of file */
+        const uint8_t *data;
+
+        /* Start and end offsets of each interval in data */
+        uint32_t *starts, *ends;
+
+        /* Number of MCUs in the image */
+        uint32_t nb_mcu;
+
+        /* Indicates that an interval could not be decoded */
+        bool error;
+};
+
+/*
+ * Returns the offset of the next marker in entropy coded data
+ * from offset i, or size if there is none
+ */
+static uint32_t next_marker(const uint8_t *data, uint32_t size, uint32_t i)
+{
+        for (; i + 1 < size; i++) {
+
+                if (data[i] != SECTION_HEAD)
+                        continue;
+
+                /* Stuffed 0xFF byte */
+                if (data[i + 1] == 0x00) {
+                        i++;
+                        continue;
+                }
+
+                /* Fill byte, the marker follows */
+                if (data[i + 1] == SECTION_HEAD)
+                        continue;
 
-                mcu_h_dim *= jpeg->comps[i_c].nb_blocks_h;
-                mcu_v_dim *= jpeg->comps[i_c].nb_blocks_v;
+                return i;
         }
 
-        mcu_h *= mcu_h_dim;
-        mcu_v *= mcu_v_dim;
+        return size;
+}
 
-        /* Compute the number of horizontal and vertical MCUs */
-        uint32_t nb_mcu_h = mcu_per_dim(mcu_h, jpeg->width);
-        uint32_t nb_mcu_v = mcu_per_dim(mcu_v, jpeg->height);
-        
-        /* Number of MCUs */
-        uint32_t nb_mcu = nb_mcu_h * nb_mcu_v;
-
-
-        /* Write TIFF header */
-        file = init_tiff_file(jpeg->path, jpeg->width, jpeg->height, mcu_v);
-
-        if (file != NULL) {
-                uint8_t nb_blocks_h, nb_blocks_v, nb_blocks;
-                uint8_t i_dc, i_ac, i_q;
-                int32_t *last_DC;
-
-                int32_t block[BLOCK_SIZE];
-                int32_t iqzz[BLOCK_SIZE];
-                uint8_t *upsampled;
-
-                uint32_t mcu_RGB[mcu_h * mcu_v];
-                uint8_t data_YCbCr[3][mcu_h * mcu_v];
-                uint8_t *mcu_YCbCr[3] = {
-                        (uint8_t*)&data_YCbCr[0],
-                        (uint8_t*)&data_YCbCr[1],
-                        (uint8_t*)&data_YCbCr[2]
+/*
+ * Locates all nb_intervals restart intervals
+ * in the entropy coded data following the stream's position.
+ * Returns the end of scan's offset in data, or 0 on error.
+ */
+static uint32_t find_intervals(struct interval_decoder *decoder, uint32_t nb_intervals,
+                               uint32_t size)
+{
+        const uint8_t *data = decoder->data;
+        uint32_t k = 0;
+        uint32_t i = next_marker(data, size, 0);
+        uint8_t marker;
+
+        decoder->starts[0] = 0;
+
+        while (i < size) {
+                marker = data[i + 1];
+
+                /* Any other marker than RSTn ends the scan */
+                if (marker < RST0 || marker >= RST0 + NB_RST) {
+                        decoder->ends[k] = i;
+
+                        return k + 1 == nb_intervals ? i : 0;
+                }
+
+                /* One more restart interval */
+                if (++k == nb_intervals)
+                        return 0;
+
+                decoder->ends[k - 1] = i;
+                decoder->starts[k] = i + 2;
+
+                i = next_marker(data, size, i + 2);
+        }
+
+        return 0;
+}
+
+/* Entropy decodes one restart interval (parallel stage) */
+static void process_interval(void *data, uint32_t interval, void *slot, uint32_t worker)
+{
+        struct interval_decoder *decoder = data;
+        struct row_decoder *rows = decoder->rows;
+        struct jpeg_data *jpeg = rows->jpeg;
+        bool *error = slot;
+
+        const uint32_t first_mcu = interval * jpeg->restart_interval;
+        uint32_t nb_mcus = decoder->nb_mcu - first_mcu;
+
+        /* DC predictions restart from 0 in each interval */
+        int32_t last_DC[MAX_COMPS] = { 0 };
+
+        if (nb_mcus > jpeg->restart_interval)
+                nb_mcus = jpeg->restart_interval;
+
+        /* Intervals above the region are not needed */
+        *error = false;
+
+        if (first_mcu + nb_mcus <= rows->first_row * rows->nb_mcu_h)
+                return;
+
+        struct bitstream *stream = open_memory_bitstream(
+                        jpeg->streams[worker],
+                        &decoder->data[decoder->starts[interval]],
+                        decoder->ends[interval] - decoder->starts[interval]);
+
+        *error = stream == NULL;
+
+        if (stream != NULL)
+                unpack_mcus(stream, jpeg, last_DC, nb_mcus,
+                            &rows->blocks[first_mcu * rows->nb_mcu_blocks * BLOCK_SIZE]);
+}
+
+/* Collects each restart interval's status (serial stage) */
+static void store_interval(void *data, uint32_t interval, void *slot)
+{
+        struct interval_decoder *decoder = data;
+        bool *error = slot;
+
+        UNUSED(interval);
+
+        decoder->error |= *error;
+}
+
+/*
+ * Entropy decodes all restart intervals in parallel,
+ * into rows->blocks, then moves the stream after the scan
+ */
+static void unpack_intervals(struct bitstream *stream, struct row_decoder *rows,
+                             uint32_t nb_mcu, uint32_t nb_threads, bool *error)
+{
+        struct jpeg_data *jpeg = rows->jpeg;
+        struct interval_decoder decoder;
+
+        const uint32_t scan_pos = pos_bitstream(stream);
+        const uint32_t nb_intervals = (nb_mcu + jpeg->restart_interval - 1)
+                                    / jpeg->restart_interval;
+        uint32_t end = 0;
+
+        decoder.rows = rows;
+        decoder.nb_mcu = nb_mcu;
+        decoder.error = false;
+
+        /* Load the whole scan and locate its RSTn markers */
+        const uint32_t size = load_bitstream(stream, &jpeg->scan_data, &jpeg->scan_capacity);
+
+        jpeg->offsets = reserve_buffer(jpeg->offsets, &jpeg->offsets_capacity,
+                                       2 * nb_intervals * sizeof(uint32_t));
+
+        decoder.data = jpeg->scan_data;
+        decoder.starts = jpeg->offsets;
+        decoder.ends = &decoder.starts[nb_intervals];
+
+        if (size > 0 && decoder.starts != NULL)
+                end = find_intervals(&decoder, nb_intervals, size);
+
+        if (end == 0) {
+                printf("ERROR : invalid restart markers\n");
+                *error = true;
+
+        } else {
+                const uint32_t nb_slots = pipeline_nb_slots(nb_threads);
+                const struct pipeline_stages stages = {
+                        NULL, process_interval, store_interval
                 };
 
-                uint8_t idct[mcu_h_dim * mcu_v_dim][BLOCK_SIZE];
+                bool status[nb_slots];
+                void *slots[nb_slots];
 
+                for (uint32_t i = 0; i < nb_slots; i++)
+                        slots[i] = &status[i];
 
-                /* Decode and write all MCUs */
-                for (uint32_t i = 0; i < nb_mcu; i++) {
+                /* Decode all restart intervals, up to the region's last row */
+                const uint32_t nb_needed = (rows->end_row * rows->nb_mcu_h
+                                            + jpeg->restart_interval - 1)
+                                         / jpeg->restart_interval;
 
-                        /* Retrieve each component */
-                        for (uint8_t j = 0; j < jpeg->nb_comps; j++) {
-                                
-                                /* Retrieve component informations */
-                                i_c = jpeg->comp_order[j];
-                                i_q = jpeg->comps[i_c].i_q;
-                                i_dc = jpeg->comps[i_c].i_dc;
-                                i_ac = jpeg->comps[i_c].i_ac;
-                                nb_blocks_h = jpeg->comps[i_c].nb_blocks_h;
-                                nb_blocks_v = jpeg->comps[i_c].nb_blocks_v;
-                                nb_blocks = nb_blocks_h * nb_blocks_v;
-                                last_DC = &jpeg->comps[i_c].last_DC;
+                if (!run_pipeline(jpeg->pool, &stages, &decoder, slots,
+                                  nb_needed < nb_intervals ? nb_needed : nb_intervals,
+                                  nb_threads)
+                    || decoder.error)
+                        *error = true;
 
-                                /* Retrieve MCUs from the JPEG file */
-                                for (uint8_t n = 0; n < nb_blocks; n++) {
+                /* Continue reading after the scan */
+                seek_bitstream(stream, scan_pos + end);
+        }
+}
 
-                                        /* Retrieve one block from the JPEG file */
-                                        unpack_block(stream, jpeg->htables[0][i_dc], 
-                                                     last_DC, jpeg->htables[1][i_ac], block);
+/*
+ * Scan chunk, decoded speculatively from its start
+ * as if an MCU started there
+ */
+struct scan_chunk {
 
-                                        /* Convert raw data to Y, Cb or Cr MCU data */
-                                        iqzz_block(block, iqzz, (uint8_t*)&jpeg->qtables[i_q]);
-                                        idct_block(iqzz, (uint8_t*)&idct[n]);
-                                }
+        /* Chunk limits in the scan, in bits */
+        uint32_t start, end;
+
+        /*
+         * State at each MCU start met by the speculative decoder,
+         * up to the first one after the chunk end.
+         * DC predictions are relative to the chunk start.
+         */
+        struct mcu_state *states;
+        uint32_t nb_states;
+        uint32_t capacity;
+};
+
+/*
+ * Speculative decoding state,
+ * shared by all the pipeline stages
+ */
+struct speculative_decoder {
+
+        struct row_decoder *rows;
+
+        struct scan_chunk *chunks;
+        uint32_t nb_chunks;
+
+        /* Number of MCUs in the image */
+        uint32_t nb_mcu;
+};
+
+/* Appends an MCU start state to a chunk, returns false on allocation failure */
+static bool push_state(struct scan_chunk *chunk, uint32_t bit_pos,
+                       const int32_t DC[MAX_COMPS])
+{
+        if (chunk->nb_states == chunk->capacity) {
+                const uint32_t capacity = 2 * chunk->capacity + 0x100;
+                struct mcu_state *states = realloc(chunk->states,
+                                                   capacity * sizeof(struct mcu_state));
+
+                if (states == NULL)
+                        return false;
+
+                chunk->states = states;
+                chunk->capacity = capacity;
+        }
+
+        struct mcu_state *state = &chunk->states[chunk->nb_states++];
+
+        state->bit_pos = bit_pos;
+        memcpy(state->DC, DC, sizeof(state->DC));
+
+        return true;
+}
+
+/*
+ * Decodes one scan chunk, guessing that an MCU starts
+ * at its first bit, and records the state at each MCU start
+ * until the chunk end is passed (parallel stage).
+ * Huffman codes quickly synchronize with the real MCU chain.
+ */
+static void walk_chunk(void *data, uint32_t index, void *slot, uint32_t worker)
+{
+        struct speculative_decoder *spec = data;
+        struct row_decoder *rows = spec->rows;
+        struct scan_chunk *chunk = &spec->chunks[index];
+
+        int32_t last_DC[MAX_COMPS] = { 0 };
+        uint32_t origin, pos;
+
+        /* The slot's MCU row receives the discarded blocks */
+        int32_t *blocks = ((struct row_slot*)slot)->blocks;
+        struct bitstream *stream = open_scan(rows->jpeg->streams[worker], rows->scan,
+                                             rows->scan_size, chunk->start, &origin);
+
+        if (stream != NULL) {
+                do {
+                        pos = origin + bit_pos_bitstream(stream);
+
+                        if (!push_state(chunk, pos, last_DC) || pos >= chunk->end)
+                                break;
+
+                        unpack_mcus(stream, rows->jpeg, last_DC, 1, blocks);
+
+                /* Stop at the end of data */
+                } while (origin + bit_pos_bitstream(stream) > pos
+                         && chunk->nb_states <= spec->nb_mcu);
+        }
+}
+
+/*
+ * Follows the exact MCU chain from the scan start (serial) :
+ * where a chunk's speculative decoder met the same MCU start,
+ * its next state is used as is, the MCU is decoded again otherwise.
+ * Stores each MCU row's start state, returns false on error.
+ * Blocks decoded again are discarded into blocks.
+ */
+static bool sync_chunks(struct speculative_decoder *spec, int32_t *blocks)
+{
+        struct row_decoder *rows = spec->rows;
+        struct mcu_state state = { 0, { 0 } };
+        struct bitstream *stream = NULL;
+        uint32_t origin = 0;
+        uint32_t k = 0, i = 0;
+        bool success = true;
+
+        for (uint32_t mcu = 0; mcu < spec->nb_mcu; mcu++) {
+
+                /* Store each row's start */
+                if (mcu % rows->nb_mcu_h == 0)
+                        rows->row_states[mcu / rows->nb_mcu_h] = state;
+
+                /* Move to the chunk holding the current MCU start */
+                while (k + 1 < spec->nb_chunks && state.bit_pos >= spec->chunks[k + 1].start) {
+                        k++;
+                        i = 0;
+                }
+
+                const struct scan_chunk *chunk = &spec->chunks[k];
+
+                while (i < chunk->nb_states && chunk->states[i].bit_pos < state.bit_pos)
+                        i++;
+
+                /* The speculative decoder is in sync : follow it */
+                if (i + 1 < chunk->nb_states && chunk->states[i].bit_pos == state.bit_pos) {
+
+                        for (uint8_t c = 0; c < MAX_COMPS; c++)
+                                state.DC[c] += chunk->states[i + 1].DC[c] - chunk->states[i].DC[c];
+
+                        state.bit_pos = chunk->states[++i].bit_pos;
+
+                        /* The next MCU decoded again must be sought */
+                        stream = NULL;
+                }
+
+                /* Otherwise decode the MCU again from its exact start */
+                else {
+                        if (stream == NULL)
+                                stream = open_scan(rows->jpeg->streams[0], rows->scan,
+                                                   rows->scan_size, state.bit_pos, &origin);
 
-                                /* Upsample current MCUs */
-                                upsampled = mcu_YCbCr[i_c];
-                                upsampler((uint8_t*)idct, nb_blocks_h, nb_blocks_v,
-                                          upsampled, mcu_h_dim, mcu_v_dim);
+                        if (stream == NULL) {
+                                success = false;
+                                break;
                         }
 
-                        /* Convert YCbCr to RGB for color images */
-                        if (jpeg->nb_comps == 3)
-                                YCbCr_to_ARGB(mcu_YCbCr, mcu_RGB, mcu_h_dim, mcu_v_dim);
+                        unpack_mcus(stream, rows->jpeg, state.DC, 1, blocks);
+                        state.bit_pos = origin + bit_pos_bitstream(stream);
+                }
+        }
 
-                        /* Convert Y to RGB for grayscale images */
-                        else if (jpeg->nb_comps == 1)
-                                Y_to_ARGB(mcu_YCbCr[0], mcu_RGB, mcu_h_dim, mcu_v_dim);
+        return success;
+}
 
-                        else
+/*
+ * Sizes nb scan chunks, whose MCU states are kept
+ * from one scan to another, and empties them
+ */
+static struct scan_chunk *reserve_chunks(struct jpeg_data *jpeg, uint32_t nb)
+{
+        if (nb > jpeg->nb_chunks) {
+                struct scan_chunk *chunks = realloc(jpeg->chunks,
+                                                    nb * sizeof(struct scan_chunk));
+
+                if (chunks == NULL)
+                        return NULL;
+
+                memset(&chunks[jpeg->nb_chunks], 0,
+                       (nb - jpeg->nb_chunks) * sizeof(struct scan_chunk));
+
+                jpeg->chunks = chunks;
+                jpeg->nb_chunks = nb;
+        }
+
+        for (uint32_t k = 0; k < nb; k++)
+                jpeg->chunks[k].nb_states = 0;
+
+        return jpeg->chunks;
+}
+
+/*
+ * Locates each MCU row's start in a scan without restart markers :
+ * the scan is split into chunks decoded speculatively in parallel,
+ * then synchronized, so that rows can be entropy decoded in parallel.
+ * The pipeline's MCU row slots receive discarded blocks.
+ * Returns false if rows must be decoded serially instead.
+ */
+static bool speculate_rows(struct bitstream *stream, struct row_decoder *rows,
+                           uint32_t nb_mcu_v, uint32_t nb_threads, void **slots)
+{
+        struct jpeg_data *jpeg = rows->jpeg;
+        struct speculative_decoder spec;
+        uint32_t end;
+        bool success = false;
+
+        const uint32_t scan_pos = pos_bitstream(stream);
+        const uint32_t size = load_bitstream(stream, &jpeg->scan_data, &jpeg->scan_capacity);
+
+        if (size == 0)
+                return false;
+
+        rows->scan = jpeg->scan_data;
+
+        /* The scan must end with a marker other than RSTn */
+        end = next_marker(rows->scan, size, 0);
+
+        if (end < size && (rows->scan[end + 1] < RST0 || rows->scan[end + 1] >= RST0 + NB_RST)) {
+                spec.rows = rows;
+                spec.nb_mcu = rows->nb_mcu_h * nb_mcu_v;
+                spec.nb_chunks = end / MIN_CHUNK_SIZE;
+
+                if (spec.nb_chunks > nb_threads)
+                        spec.nb_chunks = nb_threads;
+        } else
+                spec.nb_chunks = 0;
+
+        if (spec.nb_chunks > 1) {
+                spec.chunks = reserve_chunks(jpeg, spec.nb_chunks);
+                jpeg->row_states = reserve_buffer(jpeg->row_states, &jpeg->row_states_capacity,
+                                                  nb_mcu_v * sizeof(struct mcu_state));
+                rows->row_states = jpeg->row_states;
+                rows->scan_size = end;
+
+                if (spec.chunks != NULL && rows->row_states != NULL) {
+                        const struct pipeline_stages stages = { NULL, walk_chunk, NULL };
+
+                        /* Byte aligned chunks, never starting on a stuffed 0x00 byte */
+                        for (uint32_t k = 0; k < spec.nb_chunks; k++) {
+                                uint32_t start = k * (end / spec.nb_chunks);
+
+                                if (k > 0 && rows->scan[start - 1] == SECTION_HEAD)
+                                        start++;
+
+                                spec.chunks[k].start = 8 * start;
+
+                                if (k > 0)
+                                        spec.chunks[k - 1].end = 8 * start;
+                        }
+
+                        spec.chunks[spec.nb_chunks - 1].end = 8 * end;
+
+                        success = run_pipeline(jpeg->pool, &stages, &spec, slots,
+                                               spec.nb_chunks, nb_threads)
+                                  && sync_chunks(&spec, ((struct row_slot*)slots[0])->blocks);
+                }
+        }
+
+        /* Continue reading after the scan */
+        if (success)
+                seek_bitstream(stream, scan_pos + end);
+
+        else {
+                rows->scan = NULL;
+                rows->row_states = NULL;
+        }
+
+        return success;
+}
+
+/*
+ * Returns the whole image unpacked block of component i_c
+ * at (x, y), in blocks of this component
+ */
+static int32_t *coeffs_block(struct row_decoder *decoder, uint8_t i_c,
+                             uint32_t x, uint32_t y)
+{
+        const struct comp *comp = &decoder->jpeg->comps[i_c];
+
+        const uint32_t mcu = (y / comp->nb_blocks_v) * decoder->nb_mcu_h
+                           + x / comp->nb_blocks_h;
+        const uint32_t n = decoder->first_block[i_c]
+                         + (y % comp->nb_blocks_v) * comp->nb_blocks_h
+                         + x % comp->nb_blocks_h;
+
+        return &decoder->blocks[(mcu * decoder->nb_mcu_blocks + n) * BLOCK_SIZE];
+}
+
+/* Entropy decodes the bits of a block coded by the current scan */
+static void unpack_coeffs(struct bitstream *stream, struct jpeg_data *jpeg, uint8_t i_c,
+                          int32_t *pred_DC, uint32_t *eobrun, int32_t *block)
+{
+        const struct scan *scan = &jpeg->scan;
+        struct huff_table *table_DC = jpeg->htables[0][jpeg->comps[i_c].i_dc];
+        struct huff_table *table_AC = jpeg->htables[1][jpeg->comps[i_c].i_ac];
+
+        /* Baseline scans code whole blocks */
+        if (!jpeg->progressive)
+                unpack_block(stream, table_DC, pred_DC, table_AC, block);
+
+        else if (scan->start == 0) {
+                if (scan->high == 0)
+                        unpack_DC_first(stream, table_DC, pred_DC, scan->low, block);
+                else
+                        unpack_DC_refine(stream, scan->low, block);
+        }
+        else if (scan->high == 0)
+                unpack_AC_first(stream, table_AC, scan->start, scan->end,
+                                scan->low, eobrun, block);
+        else
+                unpack_AC_refine(stream, table_AC, scan->start, scan->end,
+                                 scan->low, eobrun, block);
+}
+
+/*
+ * Entropy decodes one scan of a multiple scans frame,
+ * completing or refining the unpacked blocks of the whole image
+ */
+static void unpack_scan(struct bitstream *stream, struct row_decoder *decoder,
+                        uint32_t nb_mcu_v, bool *error)
+{
+        struct jpeg_data *jpeg = decoder->jpeg;
+        const struct scan *scan = &jpeg->scan;
+
+        int32_t last_DC[MAX_COMPS] = { 0 };
+        uint32_t eobrun = 0;
+        uint8_t i_c = scan->comps[0];
+        uint8_t marker;
+
+        /* Interleaved scans code whole MCUs */
+        uint32_t nb_units_h = decoder->nb_mcu_h;
+        uint32_t nb_units_v = nb_mcu_v;
+
+        /*
+         * Other scans code single blocks of their component,
+         * except the ones only padding the last MCUs
+         */
+        if (scan->nb_comps == 1) {
+                nb_units_h = blocks_per_dim(jpeg->comps[i_c].nb_blocks_h,
+                                            decoder->mcu_h_dim, jpeg->width);
+                nb_units_v = blocks_per_dim(jpeg->comps[i_c].nb_blocks_v,
+                                            decoder->mcu_v_dim, jpeg->height);
+        }
+
+        for (uint32_t unit = 0; unit < nb_units_h * nb_units_v; unit++) {
+                const uint32_t x = unit % nb_units_h;
+                const uint32_t y = unit / nb_units_h;
+
+                /* Predictions and EOB runs are reset at each RSTn marker */
+                if (jpeg->restart_interval > 0 && unit > 0
+                    && unit % jpeg->restart_interval == 0) {
+                        marker = skip_bitstream_to_marker(stream);
+
+                        if (marker < RST0 || marker >= RST0 + NB_RST) {
                                 *error = true;
+                                return;
+                        }
+
+                        skip_bitstream(stream, 2);
+
+                        memset(last_DC, 0, sizeof(last_DC));
+                        eobrun = 0;
+                }
 
-                        /* Write each RGB MCU */
-                        write_tiff_file(file, mcu_RGB, mcu_h_dim, mcu_v_dim);
+                if (scan->nb_comps == 1) {
+                        unpack_coeffs(stream, jpeg, i_c, &last_DC[i_c], &eobrun,
+                                      coeffs_block(decoder, i_c, x, y));
+                        continue;
                 }
 
-                close_tiff_file(file);
+                /* Retrieve each block of each component of the MCU */
+                for (uint8_t j = 0; j < scan->nb_comps; j++) {
+                        const uint8_t nb_blocks_h = jpeg->comps[scan->comps[j]].nb_blocks_h;
+                        const uint8_t nb_blocks_v = jpeg->comps[scan->comps[j]].nb_blocks_v;
+
+                        i_c = scan->comps[j];
+
+                        for (uint8_t n = 0; n < nb_blocks_h * nb_blocks_v; n++)
+                                unpack_coeffs(stream, jpeg, i_c, &last_DC[i_c], &eobrun,
+                                              coeffs_block(decoder, i_c,
+                                                           x * nb_blocks_h + n % nb_blocks_h,
+                                                           y * nb_blocks_v + n / nb_blocks_h));
+                }
+        }
+}
+
+/*
+ * Reconstructs the MCU rows of the region through
+ * the pipeline and writes them to the path TIFF file
+ */
+static void write_image(struct row_decoder *decoder, const struct pipeline_stages *stages,
+                        void **slots, const char *path, uint32_t nb_threads, bool *error)
+{
+        /* Write TIFF header, at the region's size */
+        decoder->file = init_tiff_file(path, decoder->region.width, decoder->region.height,
+                                       decoder->mcu_v);
+
+        if (decoder->file != NULL) {
+
+                /* Decode and write all MCU rows up to the region's last one */
+                if (!run_pipeline(decoder->jpeg->pool, stages, decoder, slots, decoder->end_row, nb_threads))
+                        *error = true;
+
+                close_tiff_file(decoder->file);
+                decoder->file = NULL;
 
         } else
                 *error = true;
+}
+
+/*
+ * Generates the path of the preview written after a scan :
+ * the output path with the scan number before its extension
+ */
+static char *create_preview_name(const char *path, uint32_t scan)
+{
+        const char *dot = strrchr(path, '.');
+
+        /* A dot in a directory name is no extension */
+        if (dot != NULL && strchr(dot, '/') != NULL)
+                dot = NULL;
+
+        const char *ext = (dot != NULL) ? dot : "";
+        const int len_cpy = (dot != NULL) ? (int)(dot - path) : (int)strlen(path);
+        const size_t size = len_cpy + 1 + 10 + strlen(ext) + 1;
+
+        char *name = malloc(size);
+
+        if (name != NULL)
+                snprintf(name, size, "%.*s.%" PRIu32 "%s", len_cpy, path, scan, ext);
+
+        return name;
+}
+
+/*
+ * Entropy decodes all the scans of a progressive or multiple
+ * scans baseline frame into the whole image blocks.
+ * When requested, a preview is written after each scan
+ * but the last one : once a baseline luma scan is decoded,
+ * missing chroma blocks make it a grayscale image.
+ */
+static void unpack_scans(struct bitstream *stream, struct row_decoder *decoder,
+                               const struct pipeline_stages *stages, void **slots,
+                               uint32_t nb_mcu_v, uint32_t nb_threads, bool *error)
+{
+        struct jpeg_data *jpeg = decoder->jpeg;
+        uint8_t marker = SOS;
+
+        for (uint32_t scan = 1; marker == SOS && !*error; scan++) {
+
+                unpack_scan(stream, decoder, nb_mcu_v, error);
+
+                /* Read all sections until the next scan or EOI */
+                marker = ANY;
+
+                while (!*error && marker != SOS) {
+                        const uint8_t next = skip_bitstream_to_marker(stream);
+
+                        if (next == EOI)
+                                break;
+
+                        if (next == 0)
+                                *error = true;
+                        else
+                                marker = read_section(stream, ANY, jpeg, error);
+                }
+
+                /* Show the image refined so far */
+                if (marker == SOS && jpeg->previews && !*error) {
+                        char *path = create_preview_name(jpeg->path, scan);
+
+                        if (path != NULL)
+                                write_image(decoder, stages, slots, path,
+                                            nb_threads, error);
+                        else
+                                *error = true;
+
+                        SAFE_FREE(path);
+                }
+        }
+}
+
+/* Skips the rest of a scan, leaving the marker ending it unread */
+static void skip_scan(struct bitstream *stream)
+{
+        uint8_t marker;
+
+        do {
+                marker = skip_bitstream_to_marker(stream);
+
+                if (marker >= RST0 && marker < RST0 + NB_RST)
+                        skip_bitstream(stream, 2);
+
+        } while (marker >= RST0 && marker < RST0 + NB_RST);
+}
+
+/* Extract, decode jpeg data and write image data to tiff file */
+void process_image(struct bitstream *stream, struct jpeg_data *jpeg, bool *error)
+{
+        if (stream == NULL || *error || jpeg == NULL || jpeg->state != ALL_OK
+            || (jpeg->nb_comps != 1 && jpeg->nb_comps != 3)) {
+                *error = true;
+                return;
+        }
+
+        struct row_decoder decoder;
+        uint32_t nb_threads = jpeg->nb_threads;
+
+        if (nb_threads == 0)
+                nb_threads = 1;
+
+        decoder.jpeg = jpeg;
+        decoder.stream = stream;
+
+        /* Extract the MCU size */
+        mcu_dims(jpeg, &decoder.mcu_h_dim, &decoder.mcu_v_dim);
+
+        /* Compute the number of horizontal and vertical MCUs */
+        decoder.nb_mcu_h = mcu_per_dim(BLOCK_DIM * decoder.mcu_h_dim, jpeg->width);
+        uint32_t nb_mcu_v = mcu_per_dim(BLOCK_DIM * decoder.mcu_v_dim, jpeg->height);
+
+        /* Reduced decoding shrinks every block, hence every MCU */
+        if (jpeg->scale == 0)
+                jpeg->scale = 1;
+
+        decoder.block_dim = BLOCK_DIM / jpeg->scale;
+        decoder.mcu_h = decoder.block_dim * decoder.mcu_h_dim;
+        decoder.mcu_v = decoder.block_dim * decoder.mcu_v_dim;
+
+        /* Compute the region to decode, the whole image by default */
+        if (!find_region(jpeg, &decoder.region)) {
+                printf("ERROR : the crop region is outside the image\n");
+                *error = true;
+                return;
+        }
+
+        /* Lossless frames are predicted and written line by line */
+        if (jpeg->lossless) {
+                decode_lossless(stream, jpeg, &decoder.region, error);
+
+                /* Lines below the region were not even decoded */
+                if (!*error)
+                        skip_scan(stream);
+
+                skip_bitstream_until(stream, SECTION_HEAD);
+                return;
+        }
+
+        decoder.first_row = decoder.region.y / decoder.mcu_v;
+        decoder.end_row = mcu_per_dim(decoder.mcu_v,
+                                      decoder.region.y + decoder.region.height);
+        decoder.first_mcu = decoder.region.x / decoder.mcu_h;
+        decoder.end_mcu = mcu_per_dim(decoder.mcu_h,
+                                      decoder.region.x + decoder.region.width);
+
+        decoder.stride = decoder.nb_mcu_h * decoder.mcu_h;
+        decoder.nb_mcu_blocks = 0;
+        decoder.blocks = NULL;
+        decoder.scan = NULL;
+        decoder.row_states = NULL;
+
+        memset(decoder.last_DC, 0, sizeof(decoder.last_DC));
+
+        for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
+                const uint8_t i_c = jpeg->comp_order[i];
+
+                decoder.first_block[i_c] = decoder.nb_mcu_blocks;
+                decoder.nb_mcu_blocks += jpeg->comps[i_c].nb_blocks_h
+                                       * jpeg->comps[i_c].nb_blocks_v;
+        }
+
+
+        /* Size one workspace per worker once for the whole frame */
+        if (!reserve_workspaces(&jpeg->workspaces, &jpeg->nb_workspaces, nb_threads,
+                                decoder.mcu_h_dim, decoder.mcu_v_dim)
+            || !reserve_bitstreams(&jpeg->streams, &jpeg->nb_streams, nb_threads)) {
+                *error = true;
+                return;
+        }
+
+        /* Allocate the pipeline's MCU rows */
+        const uint32_t nb_slots = pipeline_nb_slots(nb_threads);
+        const size_t blocks_size = decoder.nb_mcu_h * decoder.nb_mcu_blocks
+                                 * BLOCK_SIZE * sizeof(int32_t);
+        const size_t RGB_size = decoder.stride * decoder.mcu_v * sizeof(uint32_t);
+
+        struct row_slot rows[nb_slots];
+        void *slots[nb_slots];
+        uint8_t *memory = aligned_malloc(nb_slots * (blocks_size + RGB_size));
+
+        if (memory == NULL) {
+                *error = true;
+                return;
+        }
+
+        for (uint32_t i = 0; i < nb_slots; i++) {
+                rows[i].blocks = (int32_t*)&memory[i * (blocks_size + RGB_size)];
+                rows[i].RGB = (uint32_t*)&memory[i * (blocks_size + RGB_size) + blocks_size];
+                slots[i] = &rows[i];
+        }
+
+        struct pipeline_stages stages = { load_row, process_row, store_row };
+
+        /*
+         * Progressive scans, or baseline scans holding only some
+         * of the components, fill the blocks of the whole image :
+         * rows are only reconstructed once all scans are decoded
+         */
+        if (jpeg->progressive || jpeg->scan.nb_comps < jpeg->nb_comps) {
+                decoder.blocks = aligned_malloc(nb_mcu_v * blocks_size);
+                stages.load = NULL;
+
+                if (decoder.blocks != NULL) {
+                        memset(decoder.blocks, 0, nb_mcu_v * blocks_size);
+
+                        unpack_scans(stream, &decoder, &stages, slots,
+                                     nb_mcu_v, nb_threads, error);
+                } else
+                        *error = true;
+        }
+
+        /*
+         * Restart intervals are independent : unpack them all
+         * in parallel first, rows then only need reconstruction
+         */
+        else if (jpeg->restart_interval > 0) {
+                decoder.blocks = aligned_malloc(nb_mcu_v * blocks_size);
+
+                if (decoder.blocks != NULL)
+                        unpack_intervals(stream, &decoder, decoder.nb_mcu_h * nb_mcu_v,
+                                         nb_threads, error);
+                else
+                        *error = true;
+
+                stages.load = NULL;
+        }
+
+        /*
+         * Without restart markers, rows are entropy decoded
+         * in parallel once their starts are located
+         */
+        else if (nb_threads > 1 && speculate_rows(stream, &decoder, decoder.end_row,
+                                                  nb_threads, slots))
+                stages.load = NULL;
+
+
+        /* Decode and write all MCU rows */
+        if (!*error)
+                write_image(&decoder, &stages, slots, jpeg->path, nb_threads, error);
+
+        /* Rows below the region were not even entropy decoded */
+        if (!*error && stages.load != NULL && decoder.end_row < nb_mcu_v)
+                skip_scan(stream);
+
+        aligned_free(decoder.blocks);
+        aligned_free(memory);
 
         /* Skip unused data until the next section */
         skip_bitstream_until(stream, SECTION_HEAD);
 }
 
+/*
+ * Creates a jpeg_data structure, whose Huffman tables,
+ * workspaces, scan buffers and threads are kept from one image to another
+ */
+struct jpeg_data *create_jpeg_data(void)
+{
+        struct jpeg_data *jpeg = calloc(1, sizeof(struct jpeg_data));
+
+        if (jpeg == NULL)
+                return NULL;
+
+        jpeg->pool = create_thread_pool();
+
+        if (jpeg->pool == NULL)
+                SAFE_FREE(jpeg);
+
+        return jpeg;
+}
+
+/* Clears any image specific data, keeping allocated memory */
+void reset_jpeg_data(struct jpeg_data *jpeg)
+{
+        if (jpeg == NULL)
+                return;
+
+        struct jpeg_data kept = *jpeg;
+
+        memset(jpeg, 0, sizeof(struct jpeg_data));
+
+        /* Huffman tables are reloaded in place by the next DHT sections */
+        for (uint8_t i = 0; i < 2; i++)
+                for (uint8_t j = 0; j < MAX_HTABLES; j++)
+                        jpeg->spare_htables[i][j] = (kept.htables[i][j] != NULL)
+                                                  ? kept.htables[i][j]
+                                                  : kept.spare_htables[i][j];
+
+        jpeg->workspaces = kept.workspaces;
+        jpeg->nb_workspaces = kept.nb_workspaces;
+        jpeg->streams = kept.streams;
+        jpeg->nb_streams = kept.nb_streams;
+        jpeg->scan_data = kept.scan_data;
+        jpeg->scan_capacity = kept.scan_capacity;
+        jpeg->offsets = kept.offsets;
+        jpeg->offsets_capacity = kept.offsets_capacity;
+        jpeg->row_states = kept.row_states;
+        jpeg->row_states_capacity = kept.row_states_capacity;
+        jpeg->chunks = kept.chunks;
+        jpeg->nb_chunks = kept.nb_chunks;
+        jpeg->pool = kept.pool;
+}
+
 /* Free jpeg_data structure */
 void free_jpeg_data(struct jpeg_data *jpeg)
 {
@@ -444,8 +1612,45 @@ void free_jpeg_data(struct jpeg_data *jpeg)
                 return;
 
         for (uint8_t i = 0; i < 2; i++)
-                for (uint8_t j = 0; j < MAX_HTABLES; j++)
+                for (uint8_t j = 0; j < MAX_HTABLES; j++) {
                         free_huffman_table(jpeg->htables[i][j]);
+                        free_huffman_table(jpeg->spare_htables[i][j]);
+                        jpeg->htables[i][j] = NULL;
+                        jpeg->spare_htables[i][j] = NULL;
+                }
+
+        free_workspaces(&jpeg->workspaces, &jpeg->nb_workspaces);
+        free_bitstreams(&jpeg->streams, &jpeg->nb_streams);
+
+        SAFE_FREE(jpeg->scan_data);
+        SAFE_FREE(jpeg->offsets);
+        SAFE_FREE(jpeg->row_states);
+        jpeg->scan_capacity = 0;
+        jpeg->offsets_capacity = 0;
+        jpeg->row_states_capacity = 0;
+
+        for (uint32_t k = 0; k < jpeg->nb_chunks; k++)
+                SAFE_FREE(jpeg->chunks[k].states);
+
+        SAFE_FREE(jpeg->chunks);
+        jpeg->nb_chunks = 0;
+
+        free_thread_pool(jpeg->pool);
+        jpeg->pool = NULL;
+}
+
+/* Computes the MCU dimensions, in blocks */
+static void mcu_dims(struct jpeg_data *jpeg, uint8_t *mcu_h_dim, uint8_t *mcu_v_dim)
+{
+        *mcu_h_dim = 1;
+        *mcu_v_dim = 1;
+
+        for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
+                uint8_t i_c = jpeg->comp_order[i];
+
+                *mcu_h_dim *= jpeg->comps[i_c].nb_blocks_h;
+                *mcu_v_dim *= jpeg->comps[i_c].nb_blocks_v;
+        }
 }
 
 /* Compute how many MCUs are required to cover a given dimension */
@@ -456,4 +1661,45 @@ static inline uint16_t mcu_per_dim(uint8_t mcu, uint16_t dim)
         return (dim % mcu) ? ++nb : nb;
 }
 
+/* Computes how many blocks of a component cover an image dimension */
+static inline uint32_t blocks_per_dim(uint8_t nb_blocks, uint8_t mcu_dim, uint16_t dim)
+{
+        const uint32_t comp_dim = (dim * nb_blocks + mcu_dim - 1) / mcu_dim;
 
+        return (comp_dim + BLOCK_DIM - 1) / BLOCK_DIM;
+}
+
+/* Computes an image dimension once reduced by the scale factor */
+static inline uint32_t scaled_dim(uint16_t dim, uint8_t scale)
+{
+        return (dim + scale - 1) / scale;
+}
+
+/* Computes the region to decode, returns false if it is outside the image */
+static bool find_region(struct jpeg_data *jpeg, struct region *region)
+{
+        const uint32_t width = scaled_dim(jpeg->width, jpeg->scale);
+        const uint32_t height = scaled_dim(jpeg->height, jpeg->scale);
+
+        *region = jpeg->crop;
+
+        /* No crop : the whole image */
+        if (region->width == 0 || region->height == 0) {
+                region->x = 0;
+                region->y = 0;
+                region->width = width;
+                region->height = height;
+        }
+
+        if (region->x >= width || region->y >= height)
+                return false;
+
+        /* Clip the region to the image */
+        if (region->width > width - region->x)
+                region->width = width - region->x;
+
+        if (region->height > height - region->y)
+                region->height = height - region->y;
+
+        return true;
+}
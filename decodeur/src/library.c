@@ -1,5 +1,6 @@
 
 #include "library.h"
+#include "pipeline.h"
 #include <unistd.h>
 #include <getopt.h>
 
@@ -103,6 +104,31 @@ bool skip_bitstream(struct bitstream *stream, uint32_t nb_bytes)
         return error;
 }
 
+/*
+ * Ensures a buffer holds at least size bytes.
+ * The buffer is only reallocated when it must grow,
+ * and freed on allocation failure (NULL is then returned).
+ */
+void *reserve_buffer(void *buffer, uint32_t *capacity, uint32_t size)
+{
+        if (capacity == NULL)
+                return NULL;
+
+        if (buffer == NULL || *capacity < size) {
+                void *bigger = realloc(buffer, size);
+
+                if (bigger == NULL) {
+                        SAFE_FREE(buffer);
+                        *capacity = 0;
+                } else
+                        *capacity = size;
+
+                buffer = bigger;
+        }
+
+        return buffer;
+}
+
 /*
  * Generates the tiff destination file path
  */
@@ -142,6 +168,68 @@ static char *create_tiff_name(char *path)
         return name;
 }
 
+/*
+ * Removes the name long option from argv, so that getopt
+ * only parses short options. When value is not NULL,
+ * the option's value follows it (NULL if missing).
+ * Returns true if the option was found.
+ */
+static bool extract_option(int *argc, char **argv, const char *name, char **value)
+{
+        for (int i = 1; i < *argc; i++) {
+
+                if (strcmp(argv[i], name) != 0)
+                        continue;
+
+                int nb_args = 1;
+
+                if (value != NULL) {
+                        *value = (i + 1 < *argc) ? argv[i + 1] : NULL;
+
+                        if (*value != NULL)
+                                nb_args++;
+                }
+
+                /* Shift the next arguments */
+                for (int j = i; j + nb_args <= *argc; j++)
+                        argv[j] = argv[j + nb_args];
+
+                *argc -= nb_args;
+
+                return true;
+        }
+
+        return false;
+}
+
+/*
+ * Parses a "x,y,width,height" region into *region.
+ * Returns true on error.
+ */
+static bool parse_region(char *text, struct region *region)
+{
+        uint32_t values[4];
+        char *next = text;
+
+        for (uint8_t i = 0; i < 4; i++) {
+                char *start = next;
+                unsigned long val = strtoul(start, &next, 10);
+
+                if (next == start || val > UINT32_MAX || *next != (i < 3 ? ',' : 0))
+                        return true;
+
+                values[i] = val;
+                next++;
+        }
+
+        region->x = values[0];
+        region->y = values[1];
+        region->width = values[2];
+        region->height = values[3];
+
+        return region->width == 0 || region->height == 0;
+}
+
 /*
  * Parses arguments given to the program and puts them in *options
  */
@@ -151,21 +239,45 @@ bool parse_args(int argc, char **argv, struct options *options)
 
         char *input = NULL;
         char *output = NULL;
+        char *threads = NULL;
+        char *scale = NULL;
+        char *crop = NULL;
 
 
         int opt;
 
+        options->previews = false;
+        options->scale = 1;
+        memset(&options->crop, 0, sizeof(options->crop));
+
+        /* Region of interest detection */
+        if (extract_option(&argc, argv, "-crop", &crop)
+            && (crop == NULL || parse_region(crop, &options->crop)))
+                error = true;
+
         /* Disable default warnings */
         opterr = 0;
 
         /* Parse all arguments */
-        while ( (opt = getopt(argc, argv, "o:h")) != -1) {
+        while ( (opt = getopt(argc, argv, "o:t:s:ph")) != -1) {
 
                 switch (opt) {
                         case 'o':
                                 output = optarg;
                                 break;
 
+                        case 't':
+                                threads = optarg;
+                                break;
+
+                        case 's':
+                                scale = optarg;
+                                break;
+
+                        case 'p':
+                                options->previews = true;
+                                break;
+
                         case 'h':
                                 error = true;
                                 break;
@@ -182,6 +294,33 @@ bool parse_args(int argc, char **argv, struct options *options)
         if (input == NULL)
                 error = true;
 
+        /* Number of threads detection */
+        options->nb_threads = default_nb_threads();
+
+        if (threads != NULL) {
+                char *end = NULL;
+                long nb = strtol(threads, &end, 10);
+
+                if (end == threads || *end != 0 || nb < 1)
+                        error = true;
+                else
+                        options->nb_threads = nb;
+        }
+
+        /* Reduced size detection : 1/1, 1/2, 1/4 or 1/8 */
+        if (scale != NULL) {
+                if (strcmp(scale, "1/1") == 0)
+                        options->scale = 1;
+                else if (strcmp(scale, "1/2") == 0)
+                        options->scale = 2;
+                else if (strcmp(scale, "1/4") == 0)
+                        options->scale = 4;
+                else if (strcmp(scale, "1/8") == 0)
+                        options->scale = 8;
+                else
+                        error = true;
+        }
+
         /* Show the help on error */
         if (error)
                 printf(USAGE, argv[0]);
@@ -131,4 +131,45 @@ void idct_block(int32_t in[64], uint8_t out[64])
         }
 }
 
+/*
+ * Computes a reduced inverse DCT : the dim x dim output
+ * block (dim = 4, 2 or 1) is the block downscaled 8 / dim times.
+ * Only the dim x dim lowest frequencies are used, through
+ * a dim-point inverse DCT keeping the 8-point normalization.
+ */
+void idct_block_scaled(int32_t in[64], uint8_t *out, uint8_t dim)
+{
+        double cosines[BLOCK_SIZE];
+        double matrix[BLOCK_SIZE];
+        double sum;
+
+        /* Basis functions of the dim-point inverse DCT */
+        for (uint8_t x = 0; x < dim; ++x)
+                for (uint8_t u = 0; u < dim; ++u)
+                        cosines[x*dim + u] = ((u == 0) ? M_SQRT1_2 : 1) / 2
+                                           * cos(((2*x + 1) * u * M_PI) / (2*dim));
+
+        /* Transform the low frequency lines */
+        for (uint8_t l = 0; l < dim; ++l) {
+                for (uint8_t y = 0; y < dim; ++y) {
+                        sum = 0;
+
+                        for (uint8_t u = 0; u < dim; ++u)
+                                sum += cosines[y*dim + u] * in[l*BLOCK_DIM + u];
 
+                        matrix[l*dim + y] = sum;
+                }
+        }
+
+        /* Then the resulting columns */
+        for (uint8_t x = 0; x < dim; ++x) {
+                for (uint8_t y = 0; y < dim; ++y) {
+                        sum = 128.;
+
+                        for (uint8_t l = 0; l < dim; ++l)
+                                sum += cosines[x*dim + l] * matrix[l*dim + y];
+
+                        out[x*dim + y] = TRUNCATE(sum);
+                }
+        }
+}
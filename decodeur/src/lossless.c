@@ -0,0 +1,186 @@
+
+#include "lossless.h"
+#include "unpack.h"
+#include "conv.h"
+#include "tiff.h"
+#include "library.h"
+
+
+/* Indicates if lossless components are RGB ones, named 'R', 'G' and 'B' */
+static inline bool is_RGB_frame(const struct jpeg_data *jpeg)
+{
+        return jpeg->nb_comps == 3 && jpeg->comps[0].id == 'R'
+               && jpeg->comps[1].id == 'G' && jpeg->comps[2].id == 'B';
+}
+
+/*
+ * Predicts sample x of a line from its left, above and above left
+ * neighbours. The first line (prev NULL) is predicted from the left
+ * samples, and the first column from the above ones.
+ */
+static inline int32_t predict_sample(uint8_t predictor, uint8_t shift,
+                                     const uint16_t *line, const uint16_t *prev, uint32_t x)
+{
+        if (prev == NULL)
+                return (x > 0) ? line[x - 1] : 1 << (LOSSLESS_PRECISION - shift - 1);
+
+        if (x == 0)
+                return prev[0];
+
+        const int32_t a = line[x - 1];
+        const int32_t b = prev[x];
+        const int32_t c = prev[x - 1];
+
+        switch (predictor) {
+        case 1:
+                return a;
+        case 2:
+                return b;
+        case 3:
+                return c;
+        case 4:
+                return a + b - c;
+        case 5:
+                return a + ((b - c) >> 1);
+        case 6:
+                return b + ((a - c) >> 1);
+        default:
+                return (a + b) >> 1;
+        }
+}
+
+/*
+ * Converts one line of decoded samples to ARGB pixels,
+ * undoing the point transform
+ */
+static void line_to_ARGB(const struct jpeg_data *jpeg, const uint16_t *line,
+                         uint8_t *planes, uint32_t *pixels)
+{
+        const uint32_t width = jpeg->width;
+        const uint8_t shift = jpeg->scan.low;
+
+        for (uint32_t i = 0; i < jpeg->nb_comps * width; i++)
+                planes[i] = line[i] << shift;
+
+        if (is_RGB_frame(jpeg)) {
+                for (uint32_t x = 0; x < width; x++)
+                        pixels[x] = planes[x] << 16 | planes[width + x] << 8
+                                  | planes[2 * width + x];
+        }
+
+        else if (jpeg->nb_comps == 3) {
+                uint8_t *YCbCr[3] = { planes, &planes[width], &planes[2 * width] };
+
+                YCbCr_to_ARGB(YCbCr, pixels, width, 1, 1);
+        }
+
+        else
+                Y_to_ARGB(planes, pixels, width, 1, 1);
+}
+
+/*
+ * Decodes a lossless (SOF3) scan line by line, each sample being
+ * predicted from its already decoded neighbours, and writes the
+ * region's lines to the jpeg->path TIFF file.
+ * Reduced decoding keeps one sample out of scale.
+ */
+void decode_lossless(struct bitstream *stream, struct jpeg_data *jpeg,
+                     const struct region *region, bool *error)
+{
+        if (stream == NULL || jpeg == NULL || region == NULL || *error)
+                return;
+
+        const struct scan *scan = &jpeg->scan;
+        const uint32_t width = jpeg->width;
+        const uint32_t nb_samples = jpeg->nb_comps * width;
+        const uint8_t scale = jpeg->scale;
+
+        /* Last line to decode, the others being skipped */
+        const uint32_t end = (region->y + region->height - 1) * scale + 1;
+
+        for (uint8_t i = 0; i < scan->nb_comps; i++)
+                if (jpeg->htables[0][jpeg->comps[scan->comps[i]].i_dc] == NULL)
+                        *error = true;
+
+        /* Restart intervals always start a new line */
+        if (jpeg->restart_interval % width != 0) {
+                printf("ERROR : lossless restart intervals must hold whole lines\n");
+                *error = true;
+        }
+
+        if (*error)
+                return;
+
+
+        /* Current and previous lines of samples */
+        uint16_t *samples = malloc(2 * nb_samples * sizeof(uint16_t));
+        uint8_t *planes = malloc(nb_samples);
+        uint32_t *pixels = malloc(width * sizeof(uint32_t));
+        uint32_t *region_line = malloc(region->width * sizeof(uint32_t));
+
+        struct tiff_file_desc *file = init_tiff_file(jpeg->path, region->width,
+                                                     region->height, BLOCK_DIM);
+
+        if (samples == NULL || planes == NULL || pixels == NULL
+            || region_line == NULL || file == NULL)
+                *error = true;
+
+        uint16_t *line = samples;
+        uint16_t *prev = &samples[nb_samples];
+        bool first = true;
+
+        for (uint32_t y = 0; y < end && !*error; y++) {
+
+                /* Each restart interval is predicted as the first line */
+                if (jpeg->restart_interval > 0 && y > 0
+                    && (y * width) % jpeg->restart_interval == 0) {
+                        const uint8_t marker = skip_bitstream_to_marker(stream);
+
+                        if (marker < RST0 || marker >= RST0 + NB_RST) {
+                                *error = true;
+                                break;
+                        }
+
+                        skip_bitstream(stream, 2);
+                        first = true;
+                }
+
+                /* Decode the interleaved samples of each component */
+                for (uint32_t x = 0; x < width; x++) {
+                        for (uint8_t i = 0; i < scan->nb_comps; i++) {
+                                const uint8_t i_c = scan->comps[i];
+                                uint16_t *comp_line = &line[i_c * width];
+
+                                comp_line[x] = predict_sample(scan->start, scan->low, comp_line,
+                                                              first ? NULL : &prev[i_c * width], x)
+                                             + unpack_difference(stream,
+                                                        jpeg->htables[0][jpeg->comps[i_c].i_dc]);
+                        }
+                }
+
+                first = false;
+
+                /* Write the region's lines */
+                if (y % scale == 0 && y / scale >= region->y) {
+                        line_to_ARGB(jpeg, line, planes, pixels);
+
+                        for (uint32_t x = 0; x < region->width; x++)
+                                region_line[x] = pixels[(region->x + x) * scale];
+
+                        write_tiff_lines(file, y / scale - region->y, 1,
+                                         region_line, region->width);
+                }
+
+                uint16_t *tmp = line;
+                line = prev;
+                prev = tmp;
+        }
+
+        if (file != NULL)
+                close_tiff_file(file);
+
+        SAFE_FREE(samples);
+        SAFE_FREE(planes);
+        SAFE_FREE(pixels);
+        SAFE_FREE(region_line);
+}
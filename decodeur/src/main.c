@@ -15,28 +15,34 @@ int main(int argc, char **argv)
                 return EXIT_FAILURE;
 
 
+        /* Decoding data, whose tables, buffers and threads are reusable */
+        struct jpeg_data *jpeg = create_jpeg_data();
+
         /* Open the input file */
         struct bitstream *stream = create_bitstream(options.input);
 
-        if (stream != NULL) {
+        if (stream != NULL && jpeg != NULL) {
 
                 bool error = false; 
                 uint8_t marker;
 
 
-                /* Initialize the jpeg structure with 0s */
-                struct jpeg_data jpeg;
-                memset(&jpeg, 0, sizeof(struct jpeg_data));
+                /* Clear any previous image data */
+                reset_jpeg_data(jpeg);
 
                 /* Specify the output tiff path */
-                jpeg.path = options.output;
+                jpeg->path = options.output;
+                jpeg->nb_threads = options.nb_threads;
+                jpeg->previews = options.previews;
+                jpeg->scale = options.scale;
+                jpeg->crop = options.crop;
 
 
                 /* Read JPEG header data */
-                read_header(stream, &jpeg, &error);
+                read_header(stream, jpeg, &error);
 
                 /* Extract then write image data to tiff file */
-                process_image(stream, &jpeg, &error);
+                process_image(stream, jpeg, &error);
 
 
                 /* EOI check */
@@ -51,15 +57,19 @@ int main(int argc, char **argv)
                 } else
                         printf("ERROR : unsupported JPEG format\n");
 
+        } else if (stream == NULL)
+                printf("ERROR : Invalid input JPEG path\n");
+
+        else
+                printf("ERROR : unable to allocate the decoding data\n");
 
-                /* Close input JPEG file */
-                free_bitstream(stream);
 
-                /* Free any allocated JPEG data */
-                free_jpeg_data(&jpeg);
+        /* Close input JPEG file */
+        free_bitstream(stream);
 
-        } else
-                printf("ERROR : Invalid input JPEG path\n");
+        /* Free any allocated JPEG data */
+        free_jpeg_data(jpeg);
+        SAFE_FREE(jpeg);
 
 
         SAFE_FREE(options.output);
@@ -477,3 +477,57 @@ void write_tiff_file (struct tiff_file_desc *tfd,
         }
 }
 
+
+/* Ecrit nb_lines lignes de l'image à partir de la ligne first_line,
+ * depuis les pixels ARGB rgb dont les lignes successives sont
+ * espacées de stride pixels. */
+void write_tiff_lines(struct tiff_file_desc *tfd,
+                      uint32_t first_line,
+                      uint32_t nb_lines,
+                      const uint32_t *rgb,
+                      uint32_t stride)
+{
+        if (tfd == NULL || tfd->file == NULL || first_line >= tfd->height)
+                return;
+
+
+        uint8_t *buf = tfd->write_buf;
+        uint32_t pixel, k;
+
+        if (nb_lines > tfd->height - first_line)
+                nb_lines = tfd->height - first_line;
+
+
+        /* Les bandes se suivent dans le fichier */
+        fseek(tfd->file, tfd->strip_offsets[0] + first_line * tfd->row_size, SEEK_SET);
+
+        /* Write each line */
+        for (uint32_t i = 0; i < nb_lines; i++) {
+
+                k = 0;
+
+                for (uint32_t j = 0; j < tfd->width; j++) {
+                        pixel = rgb[i * stride + j];
+
+                        buf[k++] = RED(pixel);
+                        buf[k++] = GREEN(pixel);
+                        buf[k++] = BLUE(pixel);
+                }
+
+                fwrite(buf, 1, tfd->row_size, tfd->file);
+        }
+}
+
+/* Ecrit la bande d'indice strip à partir des pixels ARGB rgb, dont
+ * les lignes successives sont espacées de stride pixels. */
+void write_tiff_strip(struct tiff_file_desc *tfd,
+                      uint32_t strip,
+                      const uint32_t *rgb,
+                      uint32_t stride)
+{
+        if (tfd == NULL || tfd->file == NULL || strip >= tfd->nb_strips)
+                return;
+
+        write_tiff_lines(tfd, strip * tfd->rows_per_strip, tfd->rows_per_strip,
+                         rgb, stride);
+}
@@ -53,7 +53,26 @@ static int16_t read_magnitude(struct bitstream *stream, uint8_t class)
 }
 
 /*
- * Reads and unpacks an 8x8 JPEG data block from stream
+ * Reads a lossless prediction difference :
+ * magnitude class 16 (32768) has no additional bits
+ */
+int32_t unpack_difference(struct bitstream *stream, struct huff_table *table)
+{
+        const uint8_t class = next_huffman_value(table, stream);
+
+        if (class == 16)
+                return 32768;
+
+        /* Invalid class */
+        if (class > 16)
+                return 0;
+
+        return read_magnitude(stream, class);
+}
+
+/*
+ * Reads and unpacks an 8x8 JPEG data block from stream.
+ * Zero runs overflowing the block (invalid data) are cut.
  */
 void unpack_block(struct bitstream *stream,
                 struct huff_table *table_DC, int32_t *pred_DC,
@@ -93,10 +112,9 @@ void unpack_block(struct bitstream *stream,
 
                 /* Next 16 AC coefficients are 0 */
                 case ZRL:
-                        for (uint8_t i = 0; i < 16; i++)
-                                bloc[n + i] = 0;
+                        for (uint8_t i = 0; i < 16 && n < BLOCK_SIZE; i++)
+                                bloc[n++] = 0;
 
-                        n += 16;
                         break;
 
                 /* All remaining AC coefficients are 0 */
@@ -111,14 +129,192 @@ void unpack_block(struct bitstream *stream,
                         zeros = huffman_value >> 4;
 
                         /* Set 0 AC values */
-                        for (uint8_t i = 0; i < zeros; i++)
-                                bloc[n + i] = 0;
+                        for (uint8_t i = 0; i < zeros && n < BLOCK_SIZE; i++)
+                                bloc[n++] = 0;
+
+                        /* Read the next non-zero AC value as magnitude */
+                        if (n < BLOCK_SIZE)
+                                bloc[n++] = read_magnitude(stream, class);
+                }
+        }
+}
+
+
+/*
+ * Reads the first bits of a DC coefficient
+ * (progressive DC first scan)
+ */
+void unpack_DC_first(struct bitstream *stream, struct huff_table *table_DC,
+                int32_t *pred_DC, uint8_t low, int32_t bloc[64])
+{
+        uint8_t class;
+
+        if (table_DC == NULL || pred_DC == NULL)
+                return;
+
+        class = next_huffman_value(table_DC, stream);
+
+        /* Predictions are made on the shifted values */
+        *pred_DC += read_magnitude(stream, class);
+
+        bloc[0] = *pred_DC * (1 << low);
+}
+
+/*
+ * Reads the next bit of a DC coefficient
+ * (progressive DC refinement scan)
+ */
+void unpack_DC_refine(struct bitstream *stream, uint8_t low, int32_t bloc[64])
+{
+        uint32_t dest = 0;
+
+        read_bitstream(stream, 1, &dest, true);
+
+        if (dest & 1)
+                bloc[0] |= 1 << low;
+}
+
+/*
+ * Reads the length of an End Of Band run
+ * which starts with the current block
+ */
+static uint32_t read_eobrun(struct bitstream *stream, uint8_t nb_bits)
+{
+        uint32_t eobrun = 1 << nb_bits;
+        uint32_t dest;
+
+        if (nb_bits > 0 && read_bitstream(stream, nb_bits, &dest, true) == nb_bits)
+                eobrun += dest;
+
+        return eobrun;
+}
+
+/*
+ * Reads the first bits of the start to end AC coefficients
+ * (progressive AC first scan)
+ */
+void unpack_AC_first(struct bitstream *stream, struct huff_table *table_AC,
+                uint8_t start, uint8_t end, uint8_t low,
+                uint32_t *eobrun, int32_t bloc[64])
+{
+        uint8_t class, zeros, huffman_value;
+        int16_t value;
+
+        if (table_AC == NULL || eobrun == NULL)
+                return;
+
+        /* The band of this block is empty */
+        if (*eobrun > 0) {
+                (*eobrun)--;
+                return;
+        }
+
+        for (uint8_t n = start; n <= end; n++) {
+                huffman_value = next_huffman_value(table_AC, stream);
+
+                class = huffman_value & 0xF;
+                zeros = huffman_value >> 4;
 
+                /* Skip the zero run then read the non-zero value */
+                if (class > 0) {
                         n += zeros;
+                        value = read_magnitude(stream, class);
 
-                        /* Read the next non-zero AC value as magnitude */
-                        bloc[n++] = read_magnitude(stream, class);
+                        if (n <= end)
+                                bloc[n] = value * (1 << low);
+                }
+
+                /* ZRL : next 16 AC coefficients are 0 */
+                else if (zeros == 15)
+                        n += 15;
+
+                /* EOBn : the band ends in this block and the next ones */
+                else {
+                        *eobrun = read_eobrun(stream, zeros) - 1;
+                        break;
                 }
         }
 }
 
+/*
+ * Reads the next bit of an AC coefficient already non-zero,
+ * a set bit being added to its magnitude
+ */
+static void refine_AC(struct bitstream *stream, int32_t *coeff, int32_t bit)
+{
+        uint32_t dest = 0;
+
+        read_bitstream(stream, 1, &dest, true);
+
+        if ((dest & 1) && (*coeff & bit) == 0)
+                *coeff += (*coeff >= 0) ? bit : -bit;
+}
+
+/*
+ * Reads the next bit of the start to end AC coefficients
+ * (progressive AC refinement scan)
+ */
+void unpack_AC_refine(struct bitstream *stream, struct huff_table *table_AC,
+                uint8_t start, uint8_t end, uint8_t low,
+                uint32_t *eobrun, int32_t bloc[64])
+{
+        const int32_t bit = 1 << low;
+
+        uint8_t class, zeros, huffman_value;
+        uint8_t n = start;
+        uint32_t dest;
+        int32_t value;
+
+        if (table_AC == NULL || eobrun == NULL)
+                return;
+
+        while (*eobrun == 0 && n <= end) {
+                huffman_value = next_huffman_value(table_AC, stream);
+
+                class = huffman_value & 0xF;
+                zeros = huffman_value >> 4;
+                value = 0;
+
+                /* New coefficient of magnitude 1, followed by its sign */
+                if (class > 0) {
+                        dest = 0;
+                        read_bitstream(stream, 1, &dest, true);
+
+                        value = (dest & 1) ? bit : -bit;
+                }
+
+                /* EOBn, ZRL being a run of 16 zeros */
+                else if (zeros != 15) {
+                        *eobrun = read_eobrun(stream, zeros);
+                        break;
+                }
+
+                /*
+                 * Refine the non-zero coefficients met
+                 * until the zero run is skipped
+                 */
+                for (; n <= end; n++) {
+                        if (bloc[n] != 0)
+                                refine_AC(stream, &bloc[n], bit);
+
+                        else if (zeros-- == 0)
+                                break;
+                }
+
+                if (n <= end) {
+                        if (value != 0)
+                                bloc[n] = value;
+
+                        n++;
+                }
+        }
+
+        /* The band ends : only refine the remaining non-zero coefficients */
+        if (*eobrun > 0) {
+                for (; n <= end; n++)
+                        if (bloc[n] != 0)
+                                refine_AC(stream, &bloc[n], bit);
+
+                (*eobrun)--;
+        }
+}
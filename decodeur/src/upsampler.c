@@ -6,10 +6,10 @@
 /* Upsamples a pixel */
 static inline void upsample_pixel(uint8_t *in, uint32_t in_pos,
                     uint8_t *out, uint32_t out_index, uint16_t nb_blocks_out_h,
-                    uint8_t nb_blocks_h, uint8_t nb_blocks_v)
+                    uint8_t nb_blocks_h, uint8_t nb_blocks_v, uint8_t block_dim)
 {
         /* Upsampled pixel-line size */
-        const uint32_t LINE = BLOCK_DIM * nb_blocks_out_h;
+        const uint32_t LINE = block_dim * nb_blocks_out_h;
 
         /* 
          * Copies the downsampled pixel as many times as required to Upsample a pixel
@@ -23,48 +23,54 @@ static inline void upsample_pixel(uint8_t *in, uint32_t in_pos,
 /* Upsamples a whole block */
 static inline void upsample_block(uint8_t *in, uint32_t in_index,
                     uint8_t *out, uint32_t out_index, uint16_t nb_blocks_out_h,
-                    uint8_t nb_blocks_h, uint8_t nb_blocks_v)
+                    uint8_t nb_blocks_h, uint8_t nb_blocks_v, uint8_t block_dim)
 {
         /* Upsampled bloc-line size */
-        const uint32_t LINE = nb_blocks_v * BLOCK_DIM * nb_blocks_out_h;
+        const uint32_t LINE = nb_blocks_v * block_dim * nb_blocks_out_h;
         uint32_t in_pos, out_pos;
 
         /* Upsample each pixel in the bloc */
-        for (uint16_t j = 0; j < BLOCK_DIM; ++j) {
+        for (uint16_t j = 0; j < block_dim; ++j) {
 
                 in_pos = in_index;
                 out_pos = out_index;
 
-                for (uint16_t i = 0; i < BLOCK_DIM; ++i) {
+                for (uint16_t i = 0; i < block_dim; ++i) {
 
                         /* Upsample a pixel */
                         upsample_pixel(in, in_pos++, out, out_pos, nb_blocks_out_h,
-                                        nb_blocks_h, nb_blocks_v);
+                                        nb_blocks_h, nb_blocks_v, block_dim);
                         out_pos += nb_blocks_h;
                 }
 
-                in_index += BLOCK_DIM;
+                in_index += block_dim;
                 out_index += LINE;
         }
 }
 
-/* Upsamples any input component's blocks */
+/*
+ * Upsamples any input component's blocks
+ * of block_dim x block_dim pixels
+ */
 void upsampler(uint8_t *in,
                 uint8_t nb_blocks_in_h, uint8_t nb_blocks_in_v,
                 uint8_t *out,
-                uint8_t nb_blocks_out_h, uint8_t nb_blocks_out_v)
+                uint8_t nb_blocks_out_h, uint8_t nb_blocks_out_v,
+                uint8_t block_dim)
 {
+        const uint32_t BLOCK_PIXELS = block_dim * block_dim;
+
         const uint8_t nb_blocks_h = nb_blocks_out_h / nb_blocks_in_h;
         const uint8_t nb_blocks_v = nb_blocks_out_v / nb_blocks_in_v;
 
         /* Downsampled bloc-row size */
-        const uint32_t IN_LINE = BLOCK_SIZE * nb_blocks_in_h;
+        const uint32_t IN_LINE = BLOCK_PIXELS * nb_blocks_in_h;
 
         /* Upsampled bloc-row size */
-        const uint32_t OUT_LINE = nb_blocks_v * BLOCK_SIZE * nb_blocks_out_h;
+        const uint32_t OUT_LINE = nb_blocks_v * BLOCK_PIXELS * nb_blocks_out_h;
 
         /* Upsampled bloc increment */
-        const uint32_t H_SIZE = BLOCK_DIM * nb_blocks_h;
+        const uint32_t H_SIZE = block_dim * nb_blocks_h;
 
         uint32_t in_pos, in_index = 0;
         uint32_t out_pos, out_index = 0;
@@ -79,9 +85,9 @@ void upsampler(uint8_t *in,
                         
                         /* Upsample a bloc */
                         upsample_block(in, in_pos, out, out_pos, nb_blocks_out_h,
-                                        nb_blocks_h, nb_blocks_v);
+                                        nb_blocks_h, nb_blocks_v, block_dim);
 
-                        in_pos += BLOCK_SIZE;
+                        in_pos += BLOCK_PIXELS;
                         out_pos += H_SIZE;
                 }
 
@@ -31,6 +31,23 @@ struct bitstream;
 extern struct bitstream *create_bitstream(const char *filename, 
                                           enum stream_mode mode);
 
+/*
+ * Opens a write only bitstream into a growing memory buffer,
+ * owned by the stream and given by memory_bitstream_data.
+ * The given stream is reused when not NULL, keeping its buffer.
+ */
+extern struct bitstream *create_memory_bitstream(struct bitstream *stream);
+
+/*
+ * Opens size bytes of memory as read only bitstream, data must outlive the stream.
+ * The given stream is reused when not NULL.
+ */
+extern struct bitstream *open_memory_bitstream(struct bitstream *stream,
+                                               const uint8_t *data, uint32_t size);
+
+/* Returns the data written to a memory bitstream, and its size in *size */
+extern const uint8_t *memory_bitstream_data(struct bitstream *stream, uint32_t *size);
+
 /* Returns true if eof is reached */
 extern bool end_of_bitstream(struct bitstream *stream);
 
@@ -45,6 +62,12 @@ extern uint8_t read_bitstream(struct bitstream *stream,
 /* Read in the stream until the value "byte" is found or the end of file */
 extern bool skip_bitstream_until(struct bitstream *stream, uint8_t byte);
 
+/*
+ * Skips byte stuffed data until the next marker, left unread.
+ * Returns the marker's code, or 0 if the end of file is reached.
+ */
+extern uint8_t skip_bitstream_to_marker(struct bitstream *stream);
+
 /* Close the stream and free all memory */
 extern void free_bitstream(struct bitstream *stream);
 
@@ -55,6 +78,9 @@ extern int8_t write_bit(struct bitstream *stream, uint8_t bit,
 /* Write a byte into the stream */
 extern void write_byte(struct bitstream *stream, uint8_t byte);
 
+/* Write size raw bytes into the stream */
+extern void write_bytes(struct bitstream *stream, const void *data, size_t size);
+
 /* Write a short as big endian into the stream*/
 extern void write_short_BE(struct bitstream *stream, uint16_t val);
 
@@ -64,6 +90,23 @@ extern void seek_bitstream(struct bitstream *stream, uint32_t pos);
 /* Returns the current stream position */
 extern uint32_t pos_bitstream(struct bitstream *stream);
 
+/*
+ * Loads all bytes from the current position to the end of file
+ * into *data, of *capacity bytes, only reallocated when it must grow,
+ * without moving the stream. Returns the loaded size (0 on error).
+ */
+extern uint32_t load_bitstream(struct bitstream *stream, uint8_t **data, uint32_t *capacity);
+
+/*
+ * Sizes an array of nb memory bitstreams (one per pipeline slot or thread),
+ * growing the *streams array of *nb_streams streams when required.
+ * Returns false on allocation failure.
+ */
+extern bool reserve_bitstreams(struct bitstream ***streams, uint32_t *nb_streams, uint32_t nb);
+
+/* Frees an array of *nb_streams bitstreams */
+extern void free_bitstreams(struct bitstream ***streams, uint32_t *nb_streams);
+
 /*
  * Writes all remaining bits to the stream if necessary
  */
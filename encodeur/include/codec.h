@@ -0,0 +1,62 @@
+
+#ifndef __CODEC_H__
+#define __CODEC_H__
+
+#include "common.h"
+#include "encode.h"
+
+
+/*
+ * JPEG encoder context.
+ * Its buffers, tables and threads are kept from one image to another.
+ */
+struct jpeg_encoder;
+
+/*
+ * JPEG decoder context.
+ * Its buffers, tables and threads are kept from one image to another.
+ */
+struct jpeg_decoder;
+
+
+/* Creates an encoder context */
+extern struct jpeg_encoder *create_jpeg_encoder(void);
+
+/* Clears any image specific state, keeping allocated memory */
+extern void reset_jpeg_encoder(struct jpeg_encoder *encoder);
+
+/*
+ * Encodes options->input (TIFF or JPEG) as a JPEG file at options->output.
+ * Returns true on error.
+ */
+extern bool encode_jpeg(struct jpeg_encoder *encoder, const struct options *options);
+
+/*
+ * Estimates the size of options->input (TIFF or JPEG) encoded
+ * as a JPEG file, without computing Huffman tables or writing it.
+ * Returns true on error.
+ */
+extern bool estimate_jpeg_size(struct jpeg_encoder *encoder, const struct options *options,
+                               uint32_t *size);
+
+/* Frees an encoder context and all its memory */
+extern void free_jpeg_encoder(struct jpeg_encoder *encoder);
+
+
+/* Creates a decoder context */
+extern struct jpeg_decoder *create_jpeg_decoder(void);
+
+/* Clears any image specific state, keeping allocated memory */
+extern void reset_jpeg_decoder(struct jpeg_decoder *decoder);
+
+/*
+ * Decodes options->input (TIFF or JPEG) as a TIFF file at options->output.
+ * Returns true on error.
+ */
+extern bool decode_jpeg(struct jpeg_decoder *decoder, const struct options *options);
+
+/* Frees a decoder context and all its memory */
+extern void free_jpeg_decoder(struct jpeg_decoder *decoder);
+
+
+#endif
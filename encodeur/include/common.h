@@ -21,9 +21,25 @@
               "\n"\
               "Options list :\n"\
               "    -c <quality>  : Compression rate [0-25] (0 : lossless, 25 : highest)\n"\
+              "    --predictor <n> : Lossless predictor [1-7] (default : 4)\n"\
+              "    -q <quality>  : Use the standard tables at an IJG quality [1-100]\n"\
               "    -m <mcu_size> : Output MCU sizes, either 8x8 / 16x8 / 8x16 / 16x16\n"\
               "    -g            : Encode as a gray image\n"\
               "    -d            : Decode to TIFF instead of encoding\n"\
+              "    -crop <x,y,w,h> : Only decode this region (with -d),\n"\
+              "                      or losslessly crop a JPEG on MCU boundaries\n"\
+              "    -transform <t> : Losslessly transform a JPEG, t being one of\n"\
+              "                     flip_h, flip_v, transpose, transverse,\n"\
+              "                     rot90, rot180 or rot270\n"\
+              "    --optimize-only : Losslessly rewrite a JPEG with optimal Huffman tables\n"\
+              "    --requantize : Recompress a JPEG to the -c rate without decoding it\n"\
+              "    --half-size  : Downscale a JPEG by 2 without decoding it\n"\
+              "    -t <threads>  : Number of threads (default : all cores)\n"\
+              "    -r <mcus>     : Restart interval in MCUs (default : 0, none)\n"\
+              "    -p            : Encode as a progressive JPEG\n"\
+              "    --max-bytes <n> : Use the lowest compression rate fitting in n bytes\n"\
+              "    --estimate    : Only print the estimated output size (no -o needed)\n"\
+              "    --trellis     : Use rate-distortion optimized quantification\n"\
               "    -h            : Display this help\n"\
               "\n"\
               "Supported input images : TIFF, JPEG\n"
@@ -35,10 +51,36 @@
 
 #define DEFAULT_COMPRESSION 3
 
+/* Lossless (-c 0) predictor selection value */
+#define DEFAULT_PREDICTOR 4
+#define MAX_COMPRESSION 25
+
+/* Trellis quantification's weight of bits against squared errors */
+#define TRELLIS_LAMBDA 0.05
+
 #define DEFAULT_MCU_WIDTH BLOCK_DIM*2
 #define DEFAULT_MCU_HEIGHT BLOCK_DIM*2
 
 
+/* Image region, in pixels */
+struct region {
+        uint32_t x, y;
+        uint32_t width, height;
+};
+
+/* Lossless JPEG to JPEG transforms, applied to the quantified coefficients */
+enum transform {
+        TRANSFORM_NONE,
+        FLIP_H,
+        FLIP_V,
+        TRANSPOSE,
+        TRANSVERSE,
+        ROTATE_90,
+        ROTATE_180,
+        ROTATE_270
+};
+
+
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
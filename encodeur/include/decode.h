@@ -4,6 +4,8 @@
 
 #include "common.h"
 #include "bitstream.h"
+#include "workspace.h"
+#include "pipeline.h"
 #include "encode.h"
 
 #define MAX_COMPS 3
@@ -34,6 +36,8 @@ enum jpeg_section {
         COM  = 0xFE,
         DQT  = 0xDB,
         SOF0 = 0xC0,
+        SOF2 = 0xC2,
+        SOF3 = 0xC3,
         DHT  = 0xC4,
         SOS  = 0xDA,
         EOI  = 0xD9,
@@ -42,9 +46,15 @@ enum jpeg_section {
         DNL  = 0xDC,
         DHP  = 0xDE,
         EXP  = 0xDF,
-        DRI  = 0xDD
+        DRI  = 0xDD,
+
+        /* RST0 to RST7, cycled between restart intervals */
+        RST0 = 0xD0
 };
 
+/* Number of distinct restart markers */
+#define NB_RST 8
+
 /* JPEG status check */
 enum jpeg_status {
         DHT_OK  = 1,
@@ -57,6 +67,7 @@ enum jpeg_status {
 struct comp {
 
         /* SOF0 data */
+        uint8_t id;
         uint8_t nb_blocks_h;
         uint8_t nb_blocks_v;
         uint8_t i_q;
@@ -69,6 +80,20 @@ struct comp {
         int32_t last_DC;
 };
 
+/* Progressive scan informations */
+struct scan {
+
+        /* Components of the scan, in coding order */
+        uint8_t nb_comps;
+        uint8_t comps[MAX_COMPS];
+
+        /* Spectral selection : first and last zig-zag coefficients */
+        uint8_t start, end;
+
+        /* Successive approximation : previous and current low bits */
+        uint8_t high, low;
+};
+
 /* MCU informations */
 struct mcu_info {
 
@@ -122,12 +147,40 @@ struct jpeg_data {
 	/* Compression rate */
         uint8_t compression;
 
+        /*
+         * IJG quality of the standard quantification
+         * tables (0 : generic table and compression rate)
+         */
+        uint8_t quality;
+
+        /* Use the standard Huffman tables instead of optimized ones */
+        bool standard_htables;
+
+        /*
+         * Write a lossless (SOF3) frame, each sample being
+         * predicted with the predictor selection value (1 - 7)
+         */
+        bool lossless;
+        uint8_t predictor;
+
 	/* JPEG status check */
         uint8_t state;
 
         /* Raw decoded data */
         uint32_t *raw_data;
 
+        /* Allocated raw_data size (in bytes) */
+        uint32_t raw_capacity;
+
+        /*
+         * Spare image buffer, swapped with raw_data
+         * when the MCU layout changes
+         */
+        uint32_t *spare_data;
+
+        /* Allocated spare_data size (in bytes) */
+        uint32_t spare_capacity;
+
         /*
          * Indicates if the raw_data
          * is a plain image or an MCU image
@@ -139,6 +192,80 @@ struct jpeg_data {
 
         /* JPEG compressed MCU image data */
         int32_t *mcu_data;
+
+        /*
+         * Indicates that mcu_data already holds
+         * a JPEG input's quantified coefficients
+         */
+        bool transcoded;
+
+        /*
+         * Unquantified DCT coefficients of the MCU image,
+         * cached when cache_dct is set to try several
+         * quantifications (valid once dct_cached is set)
+         */
+        int32_t *dct_data;
+
+        /* Allocated dct_data size (in bytes) */
+        uint32_t dct_capacity;
+
+        bool cache_dct;
+        bool dct_cached;
+
+        /*
+         * Quantify with trellis quantification, whose
+         * rate model uses each component's AC code sizes
+         */
+        bool trellis;
+        uint8_t trellis_sizes[MAX_COMPS][0x100];
+
+        /* Allocated mcu_data size (in bytes) */
+        uint32_t mcu_capacity;
+
+        /* Number of processing threads */
+        uint32_t nb_threads;
+
+        /* Number of MCUs per restart interval (0 : no restart) */
+        uint16_t restart_interval;
+
+        /* Progressive JPEG : SOF2 frame being read, or to write */
+        bool progressive;
+
+        /* Scan being read */
+        struct scan read_scan;
+
+        /* Progressive scan script, the default one when NULL */
+        const struct scan *scans;
+        uint8_t nb_scans;
+
+        /* Progressive scan being written */
+        const struct scan *scan;
+
+        /* Region of interest to decode (empty : whole image) */
+        struct region crop;
+
+        /* Aligned MCU processing buffers, one per thread */
+        struct workspace *workspaces;
+        uint32_t nb_workspaces;
+
+        /*
+         * Memory bitstreams of restart intervals : one per pipeline
+         * slot when writing, one per thread when reading
+         */
+        struct bitstream **streams;
+        uint32_t nb_streams;
+
+        /*
+         * Scan loaded to read restart intervals, and the intervals'
+         * start and end offsets (capacities in bytes)
+         */
+        uint8_t *scan_data;
+        uint32_t scan_capacity;
+        uint32_t *offsets;
+        uint32_t offsets_capacity;
+
+        /* Pipeline worker threads (NULL : started for each run) */
+        struct thread_pool *pool;
 };
 
 
@@ -150,8 +277,17 @@ extern uint8_t read_section(struct bitstream *stream, enum jpeg_section section,
 extern void read_header(struct bitstream *stream, 
 			struct jpeg_data *jpeg, bool *error);
 
+/* Computes the encoder's quantification table for a compression rate */
+extern void default_qtable(uint8_t qtable[BLOCK_SIZE], uint8_t compression);
+
 /* Extract raw image data */
 extern void read_image(struct jpeg_data *jpeg, bool *error);
 
+/*
+ * Extracts the quantified coefficients of a JPEG file
+ * into mcu_data, without decoding them
+ */
+extern void read_coefficients(struct jpeg_data *jpeg, bool *error);
+
 
 #endif
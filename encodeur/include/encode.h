@@ -28,11 +28,53 @@ struct options {
         /* Compression rate */
         uint8_t compression;
 
+        /*
+         * IJG quality of the standard quantification
+         * and Huffman tables (0 : not used)
+         */
+        uint8_t quality;
+
         /*
          * Indicates if we must
          * produce a grayscale image
          */
         bool gray;
+
+        /* Number of processing threads */
+        uint32_t nb_threads;
+
+        /* Number of MCUs per restart interval (0 : no restart) */
+        uint16_t restart_interval;
+
+        /* Write a progressive JPEG */
+        bool progressive;
+
+        /* Region of interest to decode (empty : whole image) */
+        struct region crop;
+
+        /* Lossless transform of a JPEG input */
+        enum transform transform;
+
+        /* Only rewrite a JPEG input with optimized Huffman tables */
+        bool optimize_only;
+
+        /* Requantize a JPEG input's coefficients to the compression rate */
+        bool requantize;
+
+        /* Downscale a JPEG input by 2 in the DCT domain */
+        bool half_size;
+
+        /* Maximum output file size in bytes (0 : no limit) */
+        uint32_t max_bytes;
+
+        /* Only estimate the output file size, without writing it */
+        bool estimate;
+
+        /* Use rate-distortion optimized (trellis) quantification */
+        bool trellis;
+
+        /* Lossless (compression rate 0) predictor selection value */
+        uint8_t predictor;
 };
 
 /* Compiling definitions */
@@ -43,6 +85,9 @@ enum jpeg_section;
 /* Frees all JPEG Huffman tables */
 extern void free_jpeg_data(struct jpeg_data *jpeg);
 
+/* Frees all JPEG image buffers */
+extern void free_jpeg_buffers(struct jpeg_data *jpeg);
+
 /* Writes a specific JPEG section */
 extern void write_section(struct bitstream *stream, enum jpeg_section section,
                           struct jpeg_data *jpeg, bool *error);
@@ -53,6 +98,25 @@ extern void write_header(struct bitstream *stream, struct jpeg_data *jpeg, bool
 /* Compresses raw mcu data, and computes Huffman / Quantification tables */
 extern void compute_jpeg(struct jpeg_data *jpeg, bool *error);
 
+/*
+ * Finds the lowest compression rate whose estimated file size
+ * fits in max_bytes, raised until the written file really fits,
+ * and sets its quantification tables
+ */
+extern void fit_jpeg_size(struct jpeg_data *jpeg, uint32_t max_bytes, bool *error);
+
+/*
+ * Computes the AC Huffman code sizes of a first compression,
+ * and enables trellis quantification for the next one
+ */
+extern void trellis_jpeg(struct jpeg_data *jpeg, bool *error);
+
+/*
+ * Quickly estimates the JPEG file size, from the entropy
+ * of the values' frequencies instead of Huffman tables
+ */
+extern uint32_t estimate_jpeg(struct jpeg_data *jpeg, bool *error);
+
 /* Writes previously compressed JPEG data */
 extern void write_blocks(struct bitstream *stream, struct jpeg_data *jpeg, bool *error);
 
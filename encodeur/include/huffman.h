@@ -38,10 +38,44 @@ extern bool write_huffman_value(int8_t value, struct huff_table *table,
                          uint32_t **freqs, uint8_t freq_type);
 
 /*
- * Creates a Huffman tree according
- * to given input frequencies.
+ * Creates a Huffman table according to given input
+ * frequencies, with canonical codes of at most 16 bits.
+ * The given table is reused when not NULL.
  */
-extern struct huff_table *create_huffman_tree(uint32_t freqs[0x100], bool *error);
+extern struct huff_table *create_huffman_tree(uint32_t freqs[0x100],
+                                              struct huff_table *table, bool *error);
+
+/*
+ * Creates a JPEG standard Huffman table :
+ * type 0 for DC, 1 for AC, and index 0 for
+ * luminance, 1 for chrominance.
+ * The given table is reused when not NULL.
+ */
+extern struct huff_table *create_standard_table(uint8_t type, uint8_t index,
+                                                struct huff_table *table);
+
+/*
+ * Computes the size in bits of all the values coded with a
+ * given table, and the number of values it defines
+ */
+extern uint64_t table_bits(const struct huff_table *table, const uint32_t freqs[0x100],
+                           uint16_t *nb_values);
+
+/* Copies the code size of each value of a table (0 : no code) */
+extern void table_code_sizes(const struct huff_table *table, uint8_t sizes[0x100]);
+
+/*
+ * Computes the size in bits of all the values coded with
+ * the Huffman code create_huffman_tree would give them,
+ * without building a whole table.
+ */
+extern uint64_t huffman_bits(const uint32_t freqs[0x100]);
+
+/*
+ * Approximates the size in bits of all the values from their
+ * frequencies' entropy, without building any Huffman code
+ */
+extern uint64_t entropy_bits(const uint32_t freqs[0x100]);
 
 /*
  * Writes a Huffman table into the stream.
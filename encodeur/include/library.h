@@ -43,25 +43,47 @@ extern bool is_valid_tiff(char *path);
  */
 extern bool parse_args(int argc, char **argv, struct options *options);
 
+/*
+ * Ensures a buffer holds at least size bytes.
+ * The buffer is only reallocated when it must grow,
+ * and freed on allocation failure (NULL is then returned).
+ */
+extern void *reserve_buffer(void *buffer, uint32_t *capacity, uint32_t size);
+
 /*
  * Converts an MCU image to a regular image.
+ * The output image is allocated when NULL.
  */
 extern uint32_t *mcu_to_image(
         uint32_t *data, struct mcu_info *mcu,
-        uint32_t width, uint32_t height);
+        uint32_t width, uint32_t height,
+        uint32_t *image);
 
 /*
  * Converts an image to an MCU image.
+ * The output MCU image is allocated when NULL.
  */
 extern uint32_t *image_to_mcu(
         uint32_t *image, struct mcu_info *mcu,
-        uint32_t width, uint32_t height);
+        uint32_t width, uint32_t height,
+        uint32_t *data);
 
 /*
  * Process specific options.
  */
 extern void process_options(struct options *options, struct jpeg_data *jpeg, bool *error);
 
+/*
+ * Clips a region to a width x height image.
+ * Returns false if the region lies outside the image.
+ */
+extern bool clip_region(struct region *region, uint32_t width, uint32_t height);
+
+/*
+ * Keeps only the crop region of the image, as a plain image.
+ */
+extern void crop_image(struct jpeg_data *jpeg, bool *error);
+
 /*
  * Exports raw MCU image data as TIFF.
  */
@@ -0,0 +1,30 @@
+/* Projet C - Sujet JPEG */
+#ifndef __LOSSLESS_H__
+#define __LOSSLESS_H__
+
+#include "common.h"
+#include "decode.h"
+
+
+/* Sample precision of lossless frames, in bits */
+#define LOSSLESS_PRECISION 8
+
+/*
+ * Predicts every sample of the image (SOF3 lossless frame) from
+ * its neighbours with the jpeg->predictor selection value, and
+ * computes the Huffman tables of the prediction differences
+ */
+extern void compute_lossless(struct jpeg_data *jpeg, bool *error);
+
+/* Writes the prediction differences of a lossless image, line by line */
+extern void write_lossless(struct bitstream *stream, struct jpeg_data *jpeg, bool *error);
+
+/*
+ * Decodes a lossless (SOF3) scan line by line into a plain image,
+ * each sample being predicted from its already decoded neighbours.
+ * Lines after the crop region, if any, are not decoded.
+ */
+extern void decode_lossless(struct bitstream *stream, struct jpeg_data *jpeg, bool *error);
+
+
+#endif
@@ -5,6 +5,9 @@
 #include "unpack.h"
 
 
+/* Detects the required magnitude to encode a value */
+extern uint8_t magnitude_class(int16_t value);
+
 /*
  * Packs and writes an 8x8 JPEG data block to stream.
  * If freqs is not NULL, computes written values's frequencies
@@ -15,5 +18,60 @@ extern void pack_block(struct bitstream *stream,
                 struct huff_table *table_AC,
                 int32_t bloc[64], uint32_t **freqs);
 
+/*
+ * Packs a lossless prediction difference.
+ * If freqs is not NULL, only counts its magnitude class.
+ */
+extern void pack_difference(struct bitstream *stream, struct huff_table *table,
+                int32_t diff, uint32_t **freqs);
+
+
+/* Longest End Of Band run */
+#define MAX_EOB_RUN 0x7FFF
+
+/* Most refinement bits buffered during an End Of Band run */
+#define MAX_EOB_BITS 1000
+
+/*
+ * End Of Band run of progressive AC scans,
+ * carried from one block to the next
+ */
+struct eob_run {
+
+        /* Number of blocks whose band is over */
+        uint16_t length;
+
+        /* Refinement bits of these blocks, written after the EOBn code */
+        uint8_t bits[MAX_EOB_BITS];
+        uint16_t nb_bits;
+};
+
+/*
+ * Progressive scans : packs the first bits of a DC coefficient,
+ * or its bit at the low successive approximation bit
+ */
+extern void pack_DC_first(struct bitstream *stream, struct huff_table *table_DC,
+                int32_t *pred_DC, uint8_t low, int32_t bloc[64], uint32_t **freqs);
+
+extern void pack_DC_refine(struct bitstream *stream, uint8_t low, int32_t bloc[64],
+                uint32_t **freqs);
+
+/*
+ * Progressive scans : packs the first bits of the start to end
+ * AC coefficients, or their bits at the low bit.
+ * Blocks ending their band early extend the EOB run.
+ */
+extern void pack_AC_first(struct bitstream *stream, struct huff_table *table_AC,
+                uint8_t start, uint8_t end, uint8_t low, struct eob_run *run,
+                int32_t bloc[64], uint32_t **freqs);
+
+extern void pack_AC_refine(struct bitstream *stream, struct huff_table *table_AC,
+                uint8_t start, uint8_t end, uint8_t low, struct eob_run *run,
+                int32_t bloc[64], uint32_t **freqs);
+
+/* Writes the pending EOB run, if any */
+extern void flush_eob_run(struct bitstream *stream, struct huff_table *table_AC,
+                struct eob_run *run, uint32_t **freqs);
+
 #endif
 
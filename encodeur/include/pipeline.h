@@ -0,0 +1,61 @@
+/* Projet C - Sujet JPEG */
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include "common.h"
+
+
+/*
+ * Row pipeline stages.
+ * Each MCU row goes through load, then process, then store,
+ * using one of the caller's slots until it is stored.
+ */
+struct pipeline_stages {
+
+        /*
+         * Serial stage, run by the calling thread in row order.
+         * Returns false to stop the pipeline (may be NULL).
+         */
+        bool (*load)(void *data, uint32_t row, void *slot);
+
+        /* Parallel stage, run by any worker (0 to nb_threads - 1) */
+        void (*process)(void *data, uint32_t row, void *slot, uint32_t worker);
+
+        /* Serial stage, run in row order (may be NULL) */
+        void (*store)(void *data, uint32_t row, void *slot);
+};
+
+
+/*
+ * Worker threads kept from one pipeline run to another,
+ * so that contexts decoding or encoding many images
+ * do not start new threads for each of them.
+ */
+struct thread_pool;
+
+
+/* Number of threads to use by default (online processors) */
+extern uint32_t default_nb_threads(void);
+
+/* Number of slots needed to keep nb_threads workers busy */
+extern uint32_t pipeline_nb_slots(uint32_t nb_threads);
+
+/* Creates a thread pool, whose threads are started on demand */
+extern struct thread_pool *create_thread_pool(void);
+
+/* Stops a thread pool's threads and frees it */
+extern void free_thread_pool(struct thread_pool *pool);
+
+/*
+ * Runs nb_rows rows through the pipeline stages, with nb_threads
+ * processing workers (everything is done inline for 1 thread).
+ * The workers are pool threads, kept started for the next runs
+ * (a temporary pool is used if pool is NULL).
+ * slots must hold pipeline_nb_slots(nb_threads) slot pointers.
+ * Returns false if a load stage failed or threads could not start.
+ */
+extern bool run_pipeline(struct thread_pool *pool, const struct pipeline_stages *stages,
+                         void *data, void **slots, uint32_t nb_rows, uint32_t nb_threads);
+
+
+#endif
@@ -2,7 +2,6 @@
 #ifndef __PRIORITY_QUEUE_H__
 #define __PRIORITY_QUEUE_H__
 
-#include "huffman.h"
 #include "common.h"
 
 
@@ -21,13 +20,13 @@ struct priority_queue *create_queue(uint32_t max_size);
 /*
  * Inserts an element with the given priority.
  */
-bool insert_queue(struct priority_queue *queue, uint32_t priority, struct huff_table *table);
+bool insert_queue(struct priority_queue *queue, uint32_t priority, uint16_t node);
 
 /*
  * Retrieves the best priority element (leaves it in the queue).
  * Returns false if the queue is empty.
  */
-bool best_queue(struct priority_queue *queue, uint32_t *priority, struct huff_table **table);
+bool best_queue(struct priority_queue *queue, uint32_t *priority, uint16_t *node);
 
 /*
  * Deletes the best priority element
@@ -15,6 +15,15 @@ extern void iqzz_block (int32_t in[64], int32_t out[64], uint8_t quantif[64]);
  */
 extern void qzz_block (int32_t out[64], int32_t in[64], uint8_t quantif[64]);
 
+/*
+ * Computes a zigzag quantification minimizing, for the AC
+ * coefficients, their squared error plus lambda times their
+ * number of bits, given the AC Huffman code sizes.
+ * lambda is relative to the mean squared AC quantifier.
+ */
+extern void trellis_qzz_block(int32_t in[64], int32_t out[64], uint8_t quantif[64],
+                              const uint8_t code_sizes[0x100], double lambda);
+
 /*
  * Adjusts a quantification table's compression quality.
  *
@@ -28,5 +37,16 @@ extern void qzz_block (int32_t out[64], int32_t in[64], uint8_t quantif[64]);
  */
 extern void quantify_qtable(uint8_t out[64], const uint8_t in[64], uint8_t quality);
 
+/*
+ * Scales a quantification table given in natural order
+ * to an IJG quality, and stores it in zigzag order.
+ *
+ * Quality range : 1 - 100
+ *
+ * 50  : Unchanged table
+ * 100 : No compression
+ */
+extern void scale_qtable(uint8_t out[64], const uint8_t in[64], uint8_t quality);
+
 #endif
 
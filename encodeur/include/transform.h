@@ -0,0 +1,32 @@
+/* Projet C - Sujet JPEG */
+#ifndef __TRANSFORM_H__
+#define __TRANSFORM_H__
+
+#include "common.h"
+#include "decode.h"
+
+
+/*
+ * Losslessly transforms the quantified coefficients of a JPEG
+ * input (see read_coefficients) : the crop region, whose origin
+ * is moved to an MCU boundary, is flipped, transposed or rotated.
+ * Partial edge MCUs that would be mirrored are trimmed.
+ */
+extern void transform_jpeg(struct jpeg_data *jpeg, enum transform transform, bool *error);
+
+/*
+ * Downscales by 2 the quantified coefficients of a JPEG input
+ * (see read_coefficients) : the low frequencies of each 2x2 blocks
+ * are merged into one block, quantified with the same table
+ */
+extern void downscale_jpeg(struct jpeg_data *jpeg, bool *error);
+
+/*
+ * Requantizes the quantified coefficients of a JPEG input
+ * (see read_coefficients) with the encoder's quantification
+ * table for jpeg->compression, without leaving the DCT domain
+ */
+extern void requantize_jpeg(struct jpeg_data *jpeg, bool *error);
+
+
+#endif
@@ -24,5 +24,32 @@ extern void unpack_block(struct bitstream *stream,
 		struct huff_table *table_AC,
 		int32_t bloc[64]);
 
+/*
+ * Progressive scans : unpacks the first bits of a DC coefficient
+ * or refines it by one bit at the low successive approximation bit
+ */
+extern void unpack_DC_first(struct bitstream *stream, struct huff_table *table_DC,
+                int32_t *pred_DC, uint8_t low, int32_t bloc[64]);
+
+extern void unpack_DC_refine(struct bitstream *stream, uint8_t low, int32_t bloc[64]);
+
+/*
+ * Progressive scans : unpacks the first bits of the start to end
+ * AC coefficients, or refines them by one bit at the low bit.
+ * eobrun counts the following blocks ending their band right away.
+ */
+extern void unpack_AC_first(struct bitstream *stream, struct huff_table *table_AC,
+                uint8_t start, uint8_t end, uint8_t low,
+                uint32_t *eobrun, int32_t bloc[64]);
+
+extern void unpack_AC_refine(struct bitstream *stream, struct huff_table *table_AC,
+                uint8_t start, uint8_t end, uint8_t low,
+                uint32_t *eobrun, int32_t bloc[64]);
+
+/*
+ * Lossless scans : reads a prediction difference
+ */
+extern int32_t unpack_difference(struct bitstream *stream, struct huff_table *table);
+
 #endif
 
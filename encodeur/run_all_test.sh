@@ -13,10 +13,14 @@ then
             res_tiff2jpeg="$3/tiff2jpeg"
             res_tiff2tiff="$3/tiff2tiff"
             res_jpeg2jpeg="$3/jpeg2jpeg"
+            res_lossless="$3/lossless"
+            res_trellis="$3/trellis"
             mkdir -p "$res_jpeg2tiff"
             mkdir -p "$res_tiff2jpeg"
             mkdir -p "$res_tiff2tiff"
             mkdir -p "$res_jpeg2jpeg"
+            mkdir -p "$res_lossless"
+            mkdir -p "$res_trellis"
 
             # Compile encoder project 
             make
@@ -58,7 +62,7 @@ then
                     echo "Input extension must be tif or tiff."
                 fi
 
-                c=0
+                c=1
                 echo "Compression rate : $c"
                 ./jpeg_encode "$file" -o "$res_name" -c "$c"
                 while [ "$?" -ne "0" ] && [ "$c" -le "$c_max" ]
@@ -89,6 +93,60 @@ then
                 echo -e "\n"
             done
 
+            # Check lossless (-c 0) round trips : encode, decode then
+            # compare with the TIFF to TIFF transformation
+            # Results in "$3"/res_lossless
+            for file in "$2"/*
+            do
+                if [[ "$file" == *".tif" || "$file" == *".tiff" ]]
+                then
+                    name="$(basename "$file")"
+                    res_name="$res_lossless""/""${name%.*}"".jpg"
+                    echo "########### Lossless round trip for $name ###########"
+
+                    ./jpeg_encode "$file" -o "$res_name" -c 0 > /dev/null
+                    ./jpeg_encode "$res_name" -o "$res_lossless""/""$name" -d > /dev/null
+                    if cmp -s "$res_lossless""/""$name" "$res_tiff2tiff""/""$name"
+                    then
+                        echo "Lossless round trip OK"
+                    else
+                        echo "ERROR : lossless round trip differs"
+                    fi
+                else
+                    echo "Input extension must be tif or tiff."
+                fi
+                echo "###############################################################################"
+                echo -e "\n"
+            done
+
+            # Check that trellis quantification gives the same
+            # coefficients to sequential and progressive (-p) files
+            # Results in "$3"/res_trellis
+            for file in "$2"/*
+            do
+                if [[ "$file" == *".tif" || "$file" == *".tiff" ]]
+                then
+                    name="$(basename "$file")"
+                    res_name="$res_trellis""/""${name%.*}"
+                    echo "########### Progressive trellis quantification for $name ###########"
+
+                    ./jpeg_encode "$file" -o "$res_name"".jpg" -c 3 --trellis > /dev/null
+                    ./jpeg_encode "$file" -o "$res_name""_p.jpg" -c 3 --trellis -p > /dev/null
+                    ./jpeg_encode "$res_name"".jpg" -o "$res_name"".tiff" -d > /dev/null
+                    ./jpeg_encode "$res_name""_p.jpg" -o "$res_name""_p.tiff" -d > /dev/null
+                    if cmp -s "$res_name"".tiff" "$res_name""_p.tiff"
+                    then
+                        echo "Progressive trellis quantification OK"
+                    else
+                        echo "ERROR : progressive trellis quantification differs"
+                    fi
+                else
+                    echo "Input extension must be tif or tiff."
+                fi
+                echo "###############################################################################"
+                echo -e "\n"
+            done
+
             # Compute JPEG to JPEG transformation
             # Results in "$3"/res_jpeg2jpeg
             c_max=25
@@ -106,7 +164,7 @@ then
                     echo "Input extension must be jpeg or jpg."
                 fi
 
-                c=0
+                c=1
                 echo "Compression rate : $c"
                 ./jpeg_encode "$file" -o "$res_name" -c "$c" > /dev/null
                 while [ "$?" -ne "0" ] && [ "$c" -le "$c_max" ]
@@ -8,12 +8,21 @@
  */
 struct bitstream {
 
-        /* Currently opened file */
+        /* Currently opened file (NULL : memory bitstream) */
         FILE *file;
 
         /* Opened file's mode */
         enum stream_mode mode;
 
+        /* Memory data read or written instead of a file, its size and next byte's position */
+        uint8_t *data;
+        uint32_t size;
+        uint32_t pos;
+
+        /* Owned buffer of written memory data, and its allocated size */
+        uint8_t *buffer;
+        uint32_t capacity;
+
         /* Current byte */
         uint8_t byte;
 
@@ -47,13 +56,11 @@ struct bitstream *create_bitstream(const char *filename, enum stream_mode mode)
 
                 /* Create and initialize the stream */
                 if (file != NULL) {
-                        stream = malloc(sizeof(struct bitstream));
+                        stream = calloc(1, sizeof(struct bitstream));
 
                         if (stream != NULL) {
                                 stream->file = file;
                                 stream->mode = mode;
-                                stream->byte = 0;
-                                stream->index = 0;
                         }
                         else
                                 fclose(file);
@@ -63,6 +70,140 @@ struct bitstream *create_bitstream(const char *filename, enum stream_mode mode)
         return stream;
 }
 
+/*
+ * Opens the given stream, or a new one when NULL,
+ * on memory data with the right mode (read / write)
+ */
+static struct bitstream *open_memory(struct bitstream *stream, enum stream_mode mode,
+                                     uint8_t *data, uint32_t size)
+{
+        if (stream == NULL)
+                stream = calloc(1, sizeof(struct bitstream));
+
+        if (stream != NULL) {
+                if (stream->file != NULL)
+                        fclose(stream->file);
+
+                stream->file = NULL;
+                stream->mode = mode;
+                stream->data = data;
+                stream->size = size;
+                stream->pos = 0;
+                stream->byte = 0;
+                stream->index = 0;
+        }
+
+        return stream;
+}
+
+/*
+ * Opens a write only bitstream into a growing memory buffer,
+ * owned by the stream and given by memory_bitstream_data.
+ * The given stream is reused when not NULL, keeping its buffer.
+ */
+struct bitstream *create_memory_bitstream(struct bitstream *stream)
+{
+        stream = open_memory(stream, WRONLY, NULL, 0);
+
+        if (stream != NULL)
+                stream->data = stream->buffer;
+
+        return stream;
+}
+
+/*
+ * Opens size bytes of memory as read only bitstream, data must outlive the stream.
+ * The given stream is reused when not NULL.
+ */
+struct bitstream *open_memory_bitstream(struct bitstream *stream,
+                                        const uint8_t *data, uint32_t size)
+{
+        if (data == NULL || size == 0)
+                return NULL;
+
+        return open_memory(stream, RDONLY, (uint8_t*)data, size);
+}
+
+/* Returns the data written to a memory bitstream, and its size in *size */
+const uint8_t *memory_bitstream_data(struct bitstream *stream, uint32_t *size)
+{
+        if (stream == NULL || stream->file != NULL) {
+                *size = 0;
+                return NULL;
+        }
+
+        *size = stream->size;
+
+        return stream->data;
+}
+
+/* Returns true if the stream reads or writes a file or memory */
+static inline bool is_open(struct bitstream *stream)
+{
+        return stream != NULL && (stream->file != NULL || stream->mode != 0);
+}
+
+/* Reads up to size bytes from the file or memory, returns the number of read bytes */
+static inline size_t get_bytes(struct bitstream *stream, void *dest, size_t size)
+{
+        if (stream->file != NULL)
+                return fread(dest, 1, size, stream->file);
+
+        if (size > stream->size - stream->pos)
+                size = stream->size - stream->pos;
+
+        memcpy(dest, &stream->data[stream->pos], size);
+        stream->pos += size;
+
+        return size;
+}
+
+/*
+ * Writes size bytes to the file or memory, growing the memory
+ * buffer when required. Returns the number of written bytes.
+ */
+static inline size_t put_bytes(struct bitstream *stream, const void *src, size_t size)
+{
+        if (stream->file != NULL)
+                return fwrite(src, 1, size, stream->file);
+
+        if (stream->mode != WRONLY)
+                return 0;
+
+        if (stream->pos + size > stream->capacity) {
+                uint32_t capacity = 2 * stream->capacity + 0x1000;
+
+                if (capacity < stream->pos + size)
+                        capacity = stream->pos + size;
+
+                uint8_t *buffer = realloc(stream->buffer, capacity);
+
+                if (buffer == NULL)
+                        return 0;
+
+                stream->buffer = buffer;
+                stream->data = buffer;
+                stream->capacity = capacity;
+        }
+
+        memcpy(&stream->data[stream->pos], src, size);
+        stream->pos += size;
+
+        if (stream->pos > stream->size)
+                stream->size = stream->pos;
+
+        return size;
+}
+
+/* Moves the file or memory position by offset bytes */
+static inline void move_bitstream(struct bitstream *stream, int32_t offset)
+{
+        if (stream->file != NULL)
+                fseek(stream->file, offset, SEEK_CUR);
+        else
+                stream->pos += offset;
+}
+
 /* Returns true if eof is reached */
 bool end_of_bitstream(struct bitstream *stream)
 {
@@ -72,6 +213,9 @@ bool end_of_bitstream(struct bitstream *stream)
                 end = feof(stream->file) ? true : false;
         }
 
+        else if (is_open(stream))
+                end = stream->pos >= stream->size;
+
         return end;
 }
 
@@ -86,14 +230,14 @@ int8_t next_bit(struct bitstream *stream, bool byte_stuffing)
         if (stream->index == 0) {
 
                 uint8_t last = *byte;
-                size = fread(byte, 1, 1, stream->file);
+                size = get_bytes(stream, byte, 1);
                 
                 /* Byte_stuffing */
                 if (byte_stuffing && last == 0xFF) {
                         if (*byte != 0x00)
                                 return -1;
 
-                        size = fread(byte, 1, 1, stream->file);
+                        size = get_bytes(stream, byte, 1);
                 }
                 
                 /* Error handling */
@@ -121,7 +265,7 @@ uint8_t read_bitstream(struct bitstream *stream,
         uint16_t nb_bit_read = 0;
         uint32_t out = 0;
 
-        if (stream == NULL || stream->file == NULL || dest == NULL)
+        if (!is_open(stream) || dest == NULL)
                 return 0;
         
         /* Read bit per bit */
@@ -142,7 +286,7 @@ uint8_t read_bitstream(struct bitstream *stream,
 /* Read in the stream until the value "byte" is found or the end of file */
 bool skip_bitstream_until(struct bitstream *stream, uint8_t byte)
 {
-        if (stream != NULL && stream->file != NULL) {
+        if (is_open(stream)) {
 
                 /* The current byte is our goal */
                 if (stream->index == 8 && stream->byte == byte) {
@@ -157,7 +301,7 @@ bool skip_bitstream_until(struct bitstream *stream, uint8_t byte)
                          * is found or the end of file
                          */
                         while (*cur_byte != byte && size > 0) {
-                                size = fread(cur_byte, 1, 1, stream->file);
+                                size = get_bytes(stream, cur_byte, 1);
                         }
 
                         if (*cur_byte == byte) {
@@ -173,6 +317,44 @@ bool skip_bitstream_until(struct bitstream *stream, uint8_t byte)
         return false;
 }
 
+/*
+ * Skips byte stuffed data until the next marker, left unread.
+ * Returns the marker's code, or 0 if the end of file is reached.
+ */
+uint8_t skip_bitstream_to_marker(struct bitstream *stream)
+{
+        uint8_t byte, last = 0;
+
+        if (!is_open(stream))
+                return 0;
+
+        /* A whole unread byte is searched too, a partly read one skipped */
+        if (stream->index == 8)
+                move_bitstream(stream, -1);
+        else
+                last = stream->byte;
+
+        stream->index = 0;
+
+        while (get_bytes(stream, &byte, 1) == 1) {
+
+                /* A 0xFF byte not followed by a stuffed 0x00 byte */
+                if (last == 0xFF && byte != 0x00 && byte != 0xFF) {
+
+                        /* Leave the whole marker unread */
+                        move_bitstream(stream, -1);
+                        stream->byte = 0xFF;
+                        stream->index = 8;
+
+                        return byte;
+                }
+
+                last = (last == 0xFF && byte == 0x00) ? 0 : byte;
+        }
+
+        return 0;
+}
+
 /* Close the stream and free all memory */
 void free_bitstream(struct bitstream *stream)
 {
@@ -180,6 +362,7 @@ void free_bitstream(struct bitstream *stream)
                 if (stream->file != NULL)
                         fclose(stream->file);
 
+                SAFE_FREE(stream->buffer);
                 SAFE_FREE(stream);
         }
 }
@@ -198,12 +381,12 @@ int8_t write_bit(struct bitstream *stream, uint8_t bit, bool byte_stuffing)
 
                 uint8_t cur = *byte;
 
-                size = fwrite(byte, 1, 1, stream->file);
+                size = put_bytes(stream, byte, 1);
                 *byte = 0;
 
                 /* Byte Stuffing */
                 if (byte_stuffing && cur == 0xFF)
-                        size = fwrite(byte, 1, 1, stream->file);
+                        size = put_bytes(stream, byte, 1);
 
                 /* Error handling */
                 if (size == 0)
@@ -218,7 +401,13 @@ int8_t write_bit(struct bitstream *stream, uint8_t bit, bool byte_stuffing)
 /* Write a byte into the stream */
 void write_byte(struct bitstream *stream, uint8_t byte)
 {
-        fwrite(&byte, 1, 1, stream->file);
+        put_bytes(stream, &byte, 1);
+}
+
+/* Write size raw bytes into the stream */
+void write_bytes(struct bitstream *stream, const void *data, size_t size)
+{
+        put_bytes(stream, data, size);
 }
 
 /* Write a short as big endian into the stream*/
@@ -230,7 +419,7 @@ void write_short_BE(struct bitstream *stream, uint16_t val)
         temp[0] = val >> 8;
         temp[1] = val;
         
-        fwrite(temp, 1, 2, stream->file);
+        put_bytes(stream, temp, 2);
 }
 
 /* Seek the stream to a specific position */
@@ -239,7 +428,10 @@ void seek_bitstream(struct bitstream *stream, uint32_t pos)
         stream->byte = 0;
         stream->index = 0;
 
-        fseek(stream->file, pos, SEEK_SET);
+        if (stream->file != NULL)
+                fseek(stream->file, pos, SEEK_SET);
+        else
+                stream->pos = (pos < stream->size) ? pos : stream->size;
 }
 
 /* Returns the current stream position */
@@ -250,9 +442,88 @@ uint32_t pos_bitstream(struct bitstream *stream)
         if (stream != NULL && stream->file != NULL)
                 pos = ftell(stream->file);
 
+        else if (is_open(stream))
+                pos = stream->pos;
+
         return pos;
 }
 
+/*
+ * Loads all bytes from the current position to the end of file
+ * into *data, of *capacity bytes, only reallocated when it must grow,
+ * without moving the stream. Returns the loaded size (0 on error).
+ */
+uint32_t load_bitstream(struct bitstream *stream, uint8_t **data, uint32_t *capacity)
+{
+        uint32_t size;
+
+        if (stream == NULL || stream->file == NULL || data == NULL || capacity == NULL)
+                return 0;
+
+        const uint32_t pos = pos_bitstream(stream);
+
+        fseek(stream->file, 0, SEEK_END);
+        size = ftell(stream->file) - pos;
+
+        seek_bitstream(stream, pos);
+
+        /* The previous content is not kept */
+        if (size > *capacity) {
+                SAFE_FREE(*data);
+                *data = malloc(size);
+                *capacity = (*data != NULL) ? size : 0;
+        }
+
+        if (*data == NULL || fread(*data, 1, size, stream->file) != size)
+                size = 0;
+
+        seek_bitstream(stream, pos);
+
+        return size;
+}
+
+/*
+ * Sizes an array of nb memory bitstreams (one per pipeline slot or thread),
+ * growing the *streams array of *nb_streams streams when required.
+ * Returns false on allocation failure.
+ */
+bool reserve_bitstreams(struct bitstream ***streams, uint32_t *nb_streams, uint32_t nb)
+{
+        if (streams == NULL || nb_streams == NULL)
+                return false;
+
+        if (nb > *nb_streams) {
+                struct bitstream **array = realloc(*streams, nb * sizeof(struct bitstream*));
+
+                if (array == NULL)
+                        return false;
+
+                *streams = array;
+
+                for (; *nb_streams < nb; (*nb_streams)++) {
+                        array[*nb_streams] = calloc(1, sizeof(struct bitstream));
+
+                        if (array[*nb_streams] == NULL)
+                                return false;
+                }
+        }
+
+        return true;
+}
+
+/* Frees an array of *nb_streams bitstreams */
+void free_bitstreams(struct bitstream ***streams, uint32_t *nb_streams)
+{
+        if (streams == NULL || nb_streams == NULL)
+                return;
+
+        for (uint32_t i = 0; i < *nb_streams; i++)
+                free_bitstream((*streams)[i]);
+
+        SAFE_FREE(*streams);
+        *nb_streams = 0;
+}
+
 /*
  * Writes all remaining bits to the stream if necessary
  */
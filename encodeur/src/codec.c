@@ -0,0 +1,311 @@
+
+#include "codec.h"
+#include "decode.h"
+#include "library.h"
+#include "transform.h"
+
+
+/*
+ * Internal encoder context structure
+ */
+struct jpeg_encoder {
+
+        /* Image data, whose buffers are reused by each image */
+        struct jpeg_data jpeg;
+};
+
+/*
+ * Internal decoder context structure
+ */
+struct jpeg_decoder {
+
+        /* Image data, whose buffers are reused by each image */
+        struct jpeg_data jpeg;
+};
+
+
+/*
+ * Clears a jpeg structure, keeping its allocated buffers.
+ */
+static void reset_jpeg(struct jpeg_data *jpeg)
+{
+        struct jpeg_data kept = *jpeg;
+
+        memset(jpeg, 0, sizeof(struct jpeg_data));
+
+        /* Huffman tables are rebuilt in place by compute_jpeg */
+        memcpy(jpeg->htables, kept.htables, sizeof(kept.htables));
+
+        jpeg->raw_data = kept.raw_data;
+        jpeg->raw_capacity = kept.raw_capacity;
+        jpeg->spare_data = kept.spare_data;
+        jpeg->spare_capacity = kept.spare_capacity;
+        jpeg->mcu_data = kept.mcu_data;
+        jpeg->mcu_capacity = kept.mcu_capacity;
+        jpeg->dct_data = kept.dct_data;
+        jpeg->dct_capacity = kept.dct_capacity;
+        jpeg->workspaces = kept.workspaces;
+        jpeg->nb_workspaces = kept.nb_workspaces;
+        jpeg->streams = kept.streams;
+        jpeg->nb_streams = kept.nb_streams;
+        jpeg->scan_data = kept.scan_data;
+        jpeg->scan_capacity = kept.scan_capacity;
+        jpeg->offsets = kept.offsets;
+        jpeg->offsets_capacity = kept.offsets_capacity;
+        jpeg->pool = kept.pool;
+}
+
+/* Creates an encoder context */
+struct jpeg_encoder *create_jpeg_encoder(void)
+{
+        struct jpeg_encoder *encoder = calloc(1, sizeof(struct jpeg_encoder));
+
+        if (encoder == NULL)
+                return NULL;
+
+        /* Pipeline threads are kept between images */
+        encoder->jpeg.pool = create_thread_pool();
+
+        if (encoder->jpeg.pool == NULL)
+                SAFE_FREE(encoder);
+
+        return encoder;
+}
+
+/* Clears any image specific state, keeping allocated memory */
+void reset_jpeg_encoder(struct jpeg_encoder *encoder)
+{
+        if (encoder != NULL)
+                reset_jpeg(&encoder->jpeg);
+}
+
+/*
+ * Reads options->input and prepares its data for compression
+ */
+static void prepare_jpeg(struct jpeg_data *jpeg, const struct options *options, bool *error)
+{
+        /* Options may be adjusted to the input image */
+        struct options image_options = *options;
+
+        reset_jpeg(jpeg);
+
+        /* Retrieve options */
+        jpeg->path = image_options.input;
+        jpeg->compression = image_options.compression;
+        jpeg->quality = image_options.quality;
+        jpeg->nb_threads = image_options.nb_threads;
+        jpeg->mcu.h = image_options.mcu_h;
+        jpeg->mcu.v = image_options.mcu_v;
+
+
+        /*
+         * Downscale, requantize and / or losslessly transform a JPEG input's
+         * quantified coefficients, or only compute its optimal Huffman tables
+         */
+        if (image_options.optimize_only || image_options.requantize || image_options.half_size
+            || image_options.transform != TRANSFORM_NONE || image_options.crop.width > 0) {
+                jpeg->crop = image_options.crop;
+
+                read_coefficients(jpeg, error);
+
+                if (image_options.half_size)
+                        downscale_jpeg(jpeg, error);
+
+                if (image_options.requantize)
+                        requantize_jpeg(jpeg, error);
+
+                transform_jpeg(jpeg, image_options.transform, error);
+
+        } else {
+                /* Read input image */
+                read_image(jpeg, error);
+
+                /* Enable specific options */
+                process_options(&image_options, jpeg, error);
+
+                /* Compression rate 0 : lossless frame */
+                jpeg->lossless = image_options.compression == 0;
+                jpeg->predictor = image_options.predictor;
+        }
+
+        /* Output restart markers */
+        jpeg->restart_interval = image_options.restart_interval;
+
+        /* Output progressive scans */
+        jpeg->progressive = image_options.progressive;
+
+        /* Progressive scans always optimize their Huffman tables */
+        jpeg->standard_htables = jpeg->quality > 0 && !jpeg->progressive;
+}
+
+/*
+ * Encodes options->input (TIFF or JPEG) as a JPEG file at options->output.
+ * Returns true on error.
+ */
+bool encode_jpeg(struct jpeg_encoder *encoder, const struct options *options)
+{
+        bool error = false;
+
+        if (encoder == NULL || options == NULL)
+                return true;
+
+        struct bitstream *stream = create_bitstream(options->output, WRONLY);
+
+        if (stream == NULL)
+                return true;
+
+
+        struct jpeg_data *jpeg = &encoder->jpeg;
+
+        /* Read and prepare the input image */
+        prepare_jpeg(jpeg, options, &error);
+
+        /* Search the compression rate fitting the size limit */
+        if (options->max_bytes > 0)
+                fit_jpeg_size(jpeg, options->max_bytes, &error);
+
+        /* Compute the code sizes used by trellis quantification */
+        if (options->trellis)
+                trellis_jpeg(jpeg, &error);
+
+
+        /* Compute Huffman tables */
+        compute_jpeg(jpeg, &error);
+
+
+        /* Write JPEG header */
+        write_header(stream, jpeg, &error);
+
+        /* Write computed JPEG data */
+        write_blocks(stream, jpeg, &error);
+
+        /* End JPEG file */
+        write_section(stream, EOI, NULL, &error);
+
+        /* Close output file */
+        free_bitstream(stream);
+
+
+        /* Remove the invalid created file */
+        if (error)
+                remove(options->output);
+
+
+        return error;
+}
+
+/*
+ * Estimates the size of options->input (TIFF or JPEG) encoded
+ * as a JPEG file, without computing Huffman tables or writing it.
+ * Returns true on error.
+ */
+bool estimate_jpeg_size(struct jpeg_encoder *encoder, const struct options *options,
+                        uint32_t *size)
+{
+        bool error = false;
+
+        if (encoder == NULL || options == NULL || size == NULL)
+                return true;
+
+        struct jpeg_data *jpeg = &encoder->jpeg;
+
+        /* Read and prepare the input image */
+        prepare_jpeg(jpeg, options, &error);
+
+        /* Count the Huffman frequencies of all values */
+        *size = estimate_jpeg(jpeg, &error);
+
+        return error;
+}
+
+/* Frees an encoder context and all its memory */
+void free_jpeg_encoder(struct jpeg_encoder *encoder)
+{
+        if (encoder != NULL) {
+                free_jpeg_data(&encoder->jpeg);
+                free_jpeg_buffers(&encoder->jpeg);
+        }
+
+        SAFE_FREE(encoder);
+}
+
+
+/* Creates a decoder context */
+struct jpeg_decoder *create_jpeg_decoder(void)
+{
+        struct jpeg_decoder *decoder = calloc(1, sizeof(struct jpeg_decoder));
+
+        if (decoder == NULL)
+                return NULL;
+
+        /* Pipeline threads are kept between images */
+        decoder->jpeg.pool = create_thread_pool();
+
+        if (decoder->jpeg.pool == NULL)
+                SAFE_FREE(decoder);
+
+        return decoder;
+}
+
+/* Clears any image specific state, keeping allocated memory */
+void reset_jpeg_decoder(struct jpeg_decoder *decoder)
+{
+        if (decoder != NULL)
+                reset_jpeg(&decoder->jpeg);
+}
+
+/*
+ * Decodes options->input (TIFF or JPEG) as a TIFF file at options->output.
+ * Returns true on error.
+ */
+bool decode_jpeg(struct jpeg_decoder *decoder, const struct options *options)
+{
+        bool error = false;
+
+        if (decoder == NULL || options == NULL)
+                return true;
+
+
+        /* Options may be adjusted to the input image */
+        struct options image_options = *options;
+        struct jpeg_data *jpeg = &decoder->jpeg;
+
+        reset_jpeg(jpeg);
+
+        /* Retrieve options */
+        jpeg->path = image_options.input;
+        jpeg->mcu.h = image_options.mcu_h;
+        jpeg->mcu.v = image_options.mcu_v;
+        jpeg->nb_threads = image_options.nb_threads;
+        jpeg->crop = image_options.crop;
+
+        /* Read input image, only decoding the crop region if any */
+        read_image(jpeg, &error);
+
+        /* Keep only the crop region */
+        crop_image(jpeg, &error);
+
+        /* Enable specific options */
+        process_options(&image_options, jpeg, &error);
+
+
+        /* Specify output path */
+        jpeg->path = image_options.output;
+
+        /* Export as TIFF file */
+        export_tiff(jpeg, &error);
+
+
+        return error;
+}
+
+/* Frees a decoder context and all its memory */
+void free_jpeg_decoder(struct jpeg_decoder *decoder)
+{
+        if (decoder != NULL) {
+                free_jpeg_data(&decoder->jpeg);
+                free_jpeg_buffers(&decoder->jpeg);
+        }
+
+        SAFE_FREE(decoder);
+}
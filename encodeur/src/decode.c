@@ -9,6 +9,8 @@
 #include "upsampler.h"
 #include "downsampler.h"
 #include "library.h"
+#include "pipeline.h"
+#include "lossless.h"
 
 
 /* Extract and decode a whole JPEG file */
@@ -26,6 +28,19 @@ static void scan_jpeg(struct bitstream *stream, struct jpeg_data *jpeg, bool *er
  */
 static const uint8_t generic_qt[64];
 
+/*
+ * JPEG standard luminance and chrominance quantification tables
+ * Source : ITU T.81, Annex K.1
+ */
+static const uint8_t luminance_qt[64];
+static const uint8_t chrominance_qt[64];
+
+
+/* Computes the encoder's quantification table for a compression rate */
+void default_qtable(uint8_t qtable[BLOCK_SIZE], uint8_t compression)
+{
+        quantify_qtable(qtable, generic_qt, compression);
+}
 
 /* Extract raw image data */
 void read_image(struct jpeg_data *jpeg, bool *error)
@@ -54,10 +69,6 @@ void read_image(struct jpeg_data *jpeg, bool *error)
                 uint8_t i_q = 0;
                 uint8_t *qtable = (uint8_t*)&jpeg->qtables[0];
 
-                /* Gimp QTables codes (disabled) */
-                // uint8_t *Y_qtable = (uint8_t*)&jpeg->qtables[0];
-                // uint8_t *CbCr_qtable = (uint8_t*)&jpeg->qtables[1];
-
 
                 /* Initialize table indexes */
                 for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
@@ -67,18 +78,21 @@ void read_image(struct jpeg_data *jpeg, bool *error)
                         jpeg->comps[i].i_ac = i;
 
 
-                        /* Gimp QTables codes (disabled) */
-                        //if (i > 0)
-                        //        i_q = 1;
+                        /* Chrominance tables for standard tables */
+                        if (i > 0 && jpeg->quality > 0)
+                                i_q = 1;
 
                         jpeg->comps[i].i_q = i_q;
                 }
 
-                quantify_qtable(qtable, generic_qt, jpeg->compression);
+                /* Standard tables scaled to an IJG quality */
+                if (jpeg->quality > 0) {
+                        scale_qtable(qtable, luminance_qt, jpeg->quality);
+                        scale_qtable(jpeg->qtables[1], chrominance_qt, jpeg->quality);
+                }
 
-                /* Gimp QTables codes (disabled) */
-                // quantify_qtable(Y_qtable, Y_gimp, jpeg->compression);
-                // quantify_qtable(CbCr_qtable, CbCr_gimp, jpeg->compression);
+                else
+                        default_qtable(qtable, jpeg->compression);
 
 
                 /* Initialize components's SOS order */
@@ -97,6 +111,31 @@ static void read_jpeg(struct jpeg_data *ojpeg, bool *error)
                 struct jpeg_data jpeg;
                 memset(&jpeg, 0, sizeof(jpeg));
 
+                /* Decode into the caller's image buffer, workspaces and scan buffers */
+                jpeg.raw_data = ojpeg->raw_data;
+                jpeg.raw_capacity = ojpeg->raw_capacity;
+                jpeg.workspaces = ojpeg->workspaces;
+                jpeg.nb_workspaces = ojpeg->nb_workspaces;
+                jpeg.streams = ojpeg->streams;
+                jpeg.nb_streams = ojpeg->nb_streams;
+                jpeg.scan_data = ojpeg->scan_data;
+                jpeg.scan_capacity = ojpeg->scan_capacity;
+                jpeg.offsets = ojpeg->offsets;
+                jpeg.offsets_capacity = ojpeg->offsets_capacity;
+                jpeg.nb_threads = ojpeg->nb_threads;
+                jpeg.pool = ojpeg->pool;
+                jpeg.crop = ojpeg->crop;
+                ojpeg->raw_data = NULL;
+                ojpeg->raw_capacity = 0;
+                ojpeg->workspaces = NULL;
+                ojpeg->nb_workspaces = 0;
+                ojpeg->streams = NULL;
+                ojpeg->nb_streams = 0;
+                ojpeg->scan_data = NULL;
+                ojpeg->scan_capacity = 0;
+                ojpeg->offsets = NULL;
+                ojpeg->offsets_capacity = 0;
+
 
                 struct bitstream *stream = create_bitstream(ojpeg->path, RDONLY);
 
@@ -122,11 +161,16 @@ static void read_jpeg(struct jpeg_data *ojpeg, bool *error)
                         compute_mcu(ojpeg, error);
 
 
-                        /* Extract and decode raw JPEG data */
-                        scan_jpeg(stream, &jpeg, error);
-
-                        ojpeg->raw_data = jpeg.raw_data;
+                        /*
+                         * Extract and decode raw JPEG data,
+                         * lossless frames into a plain image
+                         */
+                        ojpeg->is_plain_image = jpeg.lossless;
 
+                        if (jpeg.lossless)
+                                decode_lossless(stream, &jpeg, error);
+                        else
+                                scan_jpeg(stream, &jpeg, error);
 
                         free_bitstream(stream);
                         free_jpeg_data(&jpeg);
@@ -137,6 +181,18 @@ static void read_jpeg(struct jpeg_data *ojpeg, bool *error)
 
                 } else
                         *error = true;
+
+                /* Give the image buffer, workspaces and scan buffers back */
+                ojpeg->raw_data = jpeg.raw_data;
+                ojpeg->raw_capacity = jpeg.raw_capacity;
+                ojpeg->workspaces = jpeg.workspaces;
+                ojpeg->nb_workspaces = jpeg.nb_workspaces;
+                ojpeg->streams = jpeg.streams;
+                ojpeg->nb_streams = jpeg.nb_streams;
+                ojpeg->scan_data = jpeg.scan_data;
+                ojpeg->scan_capacity = jpeg.scan_capacity;
+                ojpeg->offsets = jpeg.offsets;
+                ojpeg->offsets_capacity = jpeg.offsets_capacity;
         }
 }
 
@@ -271,8 +327,13 @@ uint8_t read_section(struct bitstream *stream, enum jpeg_section section,
                 break;
 
         case SOF0:
+        case SOF2:
+        case SOF3:
                 if (jpeg != NULL) {
                         uint8_t accuracy;
+
+                        jpeg->progressive = (marker == SOF2);
+                        jpeg->lossless = (marker == SOF3);
                         read_byte(stream, &accuracy);
 
                         if (accuracy != 8) {
@@ -294,30 +355,39 @@ uint8_t read_section(struct bitstream *stream, enum jpeg_section section,
                         else {
                                 /* Read all component information */
                                 for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
-                                        uint8_t i_c, i_q;
+                                        uint8_t id, i_c, i_q;
                                         uint8_t h_sampling_factor;
                                         uint8_t v_sampling_factor;
 
-                                        *error |= read_byte(stream, &i_c);
+                                        *error |= read_byte(stream, &id);
+                                        i_c = id;
 
                                         /*
                                          * Component index must range
-                                         * in 1 - 3 or 0 - 2
+                                         * in 1 - 3 or 0 - 2, lossless
+                                         * RGB components being 'R', 'G', 'B'
                                          */
-                                        if (i_c > 3)
+                                        if (jpeg->lossless && i_c > 3)
+                                                i_c = i;
+
+                                        else if (i_c > 3)
                                                 *error = true;
 
                                         /*
                                          * When indexes range in 1 - 3,
                                          * convert them to 0 - 2
                                          */
-                                        if (i_c != i && i_c > 0)
+                                        else if (i_c != i && i_c > 0)
                                                 --i_c;
 
                                         *error |= read_byte(stream, &byte);
                                         h_sampling_factor = byte >> 4;
                                         v_sampling_factor = byte & 0xF;
 
+                                        /* Lossless samples are only supported unsubsampled */
+                                        if (jpeg->lossless && byte != 0x11)
+                                                *error = true;
+
                                         *error |= read_byte(stream, &i_q);
 
                                         if (i_q >= MAX_QTABLES)
@@ -325,13 +395,21 @@ uint8_t read_section(struct bitstream *stream, enum jpeg_section section,
 
                                         /* Initialize component informations */
                                         if (!*error) {
+                                                jpeg->comps[i_c].id = id;
                                                 jpeg->comps[i_c].nb_blocks_h = h_sampling_factor;
                                                 jpeg->comps[i_c].nb_blocks_v = v_sampling_factor;
                                                 jpeg->comps[i_c].i_q = i_q;
                                         }
 
+                                        /* Blocks are stored by component order */
+                                        jpeg->comp_order[i] = i;
+
                                         /* Update jpeg status */
                                         jpeg->state |= SOF0_OK;
+
+                                        /* Lossless frames need no quantification table */
+                                        if (jpeg->lossless)
+                                                jpeg->state |= DQT_OK;
                                 }
                         }
                 } else
@@ -377,8 +455,11 @@ uint8_t read_section(struct bitstream *stream, enum jpeg_section section,
                                         *error = true;
 
 
-                                if (!*error)
+                                /* Tables redefined between scans replace the previous ones */
+                                if (!*error) {
+                                        free_huffman_table(jpeg->htables[type][i_h]);
                                         jpeg->htables[type][i_h] = table;
+                                }
 
                                 else
                                         free_huffman_table(table);
@@ -397,43 +478,95 @@ uint8_t read_section(struct bitstream *stream, enum jpeg_section section,
         /* Start Of Scan */
         case SOS:
                 if (jpeg != NULL) {
+                        struct scan *scan = &jpeg->read_scan;
                         uint8_t nb_comps, i_c;
 
                         read_byte(stream, &nb_comps);
 
                         /* 
-                         * Check that the number of component is 
-                         * the same as in the SOF Section
+                         * Check that the scan only holds
+                         * components of the SOF Section
                          */
-                        if (nb_comps != jpeg->nb_comps) {
+                        if (nb_comps == 0 || nb_comps > jpeg->nb_comps) {
                                 *error = true;
                                 return SOS;
                         }
 
+                        scan->nb_comps = nb_comps;
+
                         /* Read component informations */
                         for (uint8_t i = 0; i < nb_comps; i++) {
                                 read_byte(stream, &byte);
 
+                                /* Find the component declared in SOF */
+                                for (i_c = 0; i_c < jpeg->nb_comps; i_c++)
+                                        if (jpeg->comps[i_c].id == byte)
+                                                break;
+
+                                if (i_c == jpeg->nb_comps) {
+                                        *error = true;
+                                        return SOS;
+                                }
+
+                                scan->comps[i] = i_c;
+
                                 /*
-                                 * When indexes range in 1 - 3,
-                                 * convert them to 0 - 2
+                                 * Blocks of single scan baseline
+                                 * files are stored in scan order
                                  */
-                                i_c = byte;
-                                if(i_c != i && i_c > 0)
-                                        --i_c;
-
-                                jpeg->comp_order[i] = i_c;
+                                if (!jpeg->progressive && nb_comps == jpeg->nb_comps)
+                                        jpeg->comp_order[i] = i_c;
 
                                 /* Read Huffman table indexes */
                                 read_byte(stream, &byte);
+
                                 jpeg->comps[i_c].i_dc = byte >> 4;
                                 jpeg->comps[i_c].i_ac = byte & 0xF;
+
+                                if (jpeg->comps[i_c].i_dc >= MAX_HTABLES
+                                    || jpeg->comps[i_c].i_ac >= MAX_HTABLES)
+                                        *error = true;
                         }
 
-                        /* Skip unused SOS data */
-                        read_byte(stream, &byte);
-                        read_byte(stream, &byte);
-                        read_byte(stream, &byte);
+                        /* Read spectral selection and successive approximation */
+                        read_byte(stream, &scan->start);
+                        read_byte(stream, &scan->end);
+                        *error |= read_byte(stream, &byte);
+
+                        scan->high = byte >> 4;
+                        scan->low = byte & 0xF;
+
+                        /*
+                         * DC and AC coefficients are never mixed,
+                         * and AC scans only hold one component
+                         */
+                        if (jpeg->progressive
+                            && (scan->start > scan->end || scan->end >= BLOCK_SIZE
+                                || (scan->start == 0 && scan->end != 0)
+                                || (scan->start > 0 && nb_comps != 1)
+                                || scan->low > 13
+                                || (scan->high && scan->high != scan->low + 1)))
+                                *error = true;
+
+                        /*
+                         * Lossless scans hold the predictor
+                         * and the point transform instead
+                         */
+                        if (jpeg->lossless && (scan->start < 1 || scan->start > 7
+                                               || scan->low >= LOSSLESS_PRECISION))
+                                *error = true;
+                } else
+                        *error = true;
+
+                break;
+
+        /* Define Restart Interval */
+        case DRI:
+                if (jpeg != NULL) {
+                        *error |= read_short_BE(stream, &jpeg->restart_interval);
+                        unread -= sizeof(jpeg->restart_interval);
+
+                        skip_bitstream(stream, unread);
                 } else
                         *error = true;
 
@@ -475,7 +608,9 @@ static void read_tiff(struct jpeg_data *ojpeg, bool *error)
                                 uint32_t *line = NULL;
 
                                 const uint32_t nb_pixels_max = ojpeg->width * ojpeg->height;
-                                ojpeg->raw_data = malloc(nb_pixels_max * sizeof(uint32_t));
+                                ojpeg->raw_data = reserve_buffer(ojpeg->raw_data,
+                                                &ojpeg->raw_capacity,
+                                                nb_pixels_max * sizeof(uint32_t));
 
                                 if (ojpeg->raw_data == NULL)
                                         *error = true;
@@ -502,97 +637,715 @@ static void read_tiff(struct jpeg_data *ojpeg, bool *error)
 }
 
 
-/* Extract and decode raw JPEG data */
-static void scan_jpeg(struct bitstream *stream, struct jpeg_data *jpeg, bool *error)
-{
-        if (stream == NULL || error == NULL || *error || jpeg == NULL)
-                return;
+/*
+ * MCU row decoding state,
+ * shared by all the pipeline stages
+ */
+struct row_decoder {
+        struct jpeg_data *jpeg;
+        struct bitstream *stream;
 
+        /* Number of blocks per MCU */
+        uint32_t nb_mcu_blocks;
 
-        /* Retrieve MCU data */
-        uint8_t mcu_h = jpeg->mcu.h;
-        uint8_t mcu_v = jpeg->mcu.v;
-        uint8_t mcu_h_dim = jpeg->mcu.h_dim;
-        uint8_t mcu_v_dim = jpeg->mcu.v_dim;
-        uint32_t nb_mcu = jpeg->mcu.nb;
-
-        /* Scan variables */
-        uint8_t nb_blocks_h, nb_blocks_v, nb_blocks;
-        uint8_t i_c, i_q, i_dc, i_ac;
-        int32_t *last_DC;
-
-        uint8_t idct[mcu_h_dim * mcu_v_dim][BLOCK_SIZE];
-        int32_t block[BLOCK_SIZE];
-        int32_t iqzz[BLOCK_SIZE];
-        uint8_t *upsampled;
-
-        uint32_t mcu_size = mcu_h * mcu_v;
-        uint32_t *mcu_RGB = NULL;
-        uint8_t data_YCbCr[MAX_COMPS][mcu_size];
-        uint8_t *mcu_YCbCr[MAX_COMPS] = {
-                (uint8_t*)&data_YCbCr[0],
-                (uint8_t*)&data_YCbCr[1],
-                (uint8_t*)&data_YCbCr[2]
-        };
+        /* Last DC value of each component */
+        int32_t last_DC[MAX_COMPS];
 
-        /* Buffer to store raw jpeg data */
-        const uint32_t nb_pixels_max = mcu_size * nb_mcu;
-        jpeg->raw_data = malloc(nb_pixels_max * sizeof(uint32_t));
+        /* Index of each component's first block in an MCU */
+        uint8_t first_block[MAX_COMPS];
 
-        if (jpeg->raw_data == NULL) {
-                *error = true;
-                return;
-        }
+        /* MCU rows and columns covering the crop region */
+        uint32_t first_row, end_row;
+        uint32_t first_mcu, end_mcu;
 
-        /* Extract and decode all MCUs */
-        for (uint32_t i = 0; i < nb_mcu; i++) {
-                mcu_RGB = &jpeg->raw_data[i * mcu_size];
+        /*
+         * Unpacked blocks of the whole image when restart intervals
+         * or multiple scans were decoded beforehand, NULL otherwise
+         */
+        int32_t *blocks;
+};
+
+/* Entropy decodes nb_mcus MCUs, predicting DC values from last_DC */
+static void unpack_mcus(struct bitstream *stream, struct jpeg_data *jpeg,
+                        int32_t last_DC[MAX_COMPS], uint32_t nb_mcus, int32_t *block)
+{
+        uint8_t i_c, i_dc, i_ac, nb_blocks;
+
+        for (uint32_t m = 0; m < nb_mcus; m++) {
 
                 /* Retrieve each component */
                 for (uint8_t j = 0; j < jpeg->nb_comps; j++) {
 
                         /* Retrieve component informations */
                         i_c = jpeg->comp_order[j];
+                        i_dc = jpeg->comps[i_c].i_dc;
+                        i_ac = jpeg->comps[i_c].i_ac;
+                        nb_blocks = jpeg->comps[i_c].nb_blocks_h
+                                  * jpeg->comps[i_c].nb_blocks_v;
+
+                        /* Retrieve each block from the JPEG file */
+                        for (uint8_t n = 0; n < nb_blocks; n++) {
+                                unpack_block(stream, jpeg->htables[0][i_dc], &last_DC[i_c],
+                                             jpeg->htables[1][i_ac], block);
+
+                                block += BLOCK_SIZE;
+                        }
+                }
+        }
+}
+
+/* Entropy decodes one MCU row (serial stage) */
+static bool load_row(void *data, uint32_t row, void *slot)
+{
+        struct row_decoder *decoder = data;
+
+        UNUSED(row);
+
+        unpack_mcus(decoder->stream, decoder->jpeg, decoder->last_DC,
+                    decoder->jpeg->mcu.nb_h, slot);
+
+        return true;
+}
+
+/*
+ * Converts one MCU row's blocks to ARGB MCUs (parallel stage) :
+ * iqzz, IDCT, upsampling and color conversion.
+ */
+static void process_row(void *data, uint32_t row, void *slot, uint32_t worker)
+{
+        struct row_decoder *decoder = data;
+        struct jpeg_data *jpeg = decoder->jpeg;
+        struct workspace *ws = &jpeg->workspaces[worker];
+
+        uint8_t i_c, i_q, nb_blocks_h, nb_blocks_v, nb_blocks;
+        int32_t *block = slot;
+
+        const uint8_t mcu_h_dim = jpeg->mcu.h_dim;
+        const uint8_t mcu_v_dim = jpeg->mcu.v_dim;
+        const uint32_t mcu_size = jpeg->mcu.h * jpeg->mcu.v;
+
+        uint32_t *mcu_RGB = &jpeg->raw_data[(row * jpeg->mcu.nb_h + decoder->first_mcu)
+                                            * mcu_size];
 
+        /* Rows above the crop region are only entropy decoded */
+        if (row < decoder->first_row)
+                return;
+
+        /* Blocks of restart intervals are already unpacked */
+        if (decoder->blocks != NULL)
+                block = &decoder->blocks[row * jpeg->mcu.nb_h
+                                         * decoder->nb_mcu_blocks * BLOCK_SIZE];
+
+        /* Only the MCUs covering the crop region are reconstructed */
+        block += decoder->first_mcu * decoder->nb_mcu_blocks * BLOCK_SIZE;
+
+        for (uint32_t m = decoder->first_mcu; m < decoder->end_mcu; m++) {
+
+                /* Convert each component */
+                for (uint8_t j = 0; j < jpeg->nb_comps; j++) {
+
+                        /* Retrieve component informations */
+                        i_c = jpeg->comp_order[j];
+                        i_q = jpeg->comps[i_c].i_q;
                         nb_blocks_h = jpeg->comps[i_c].nb_blocks_h;
                         nb_blocks_v = jpeg->comps[i_c].nb_blocks_v;
                         nb_blocks = nb_blocks_h * nb_blocks_v;
 
-                        i_dc = jpeg->comps[i_c].i_dc;
-                        i_ac = jpeg->comps[i_c].i_ac;
-                        i_q = jpeg->comps[i_c].i_q;
-
-                        last_DC = &jpeg->comps[i_c].last_DC;
-
-                        /* Retrieve MCUs from the JPEG file */
+                        /* Convert raw data to Y, Cb or Cr MCU data */
                         for (uint8_t n = 0; n < nb_blocks; n++) {
+                                iqzz_block(block, ws->coeffs, (uint8_t*)&jpeg->qtables[i_q]);
+                                idct_block(ws->coeffs, &ws->blocks[n * BLOCK_SIZE]);
 
-                                /* Retrieve one block from the JPEG file */
-                                unpack_block(stream, jpeg->htables[0][i_dc], last_DC,
-                                                     jpeg->htables[1][i_ac], block);
-
-                                /* Convert raw data to Y, Cb or Cr MCU data */
-                                iqzz_block(block, iqzz, (uint8_t*)&jpeg->qtables[i_q]);
-                                idct_block(iqzz, (uint8_t*)&idct[n]);
+                                block += BLOCK_SIZE;
                         }
 
                         /* Upsample current MCUs */
-                        upsampled = mcu_YCbCr[i_c];
-                        upsampler((uint8_t*)idct, nb_blocks_h, nb_blocks_v, 
-                                  upsampled, mcu_h_dim, mcu_v_dim);
+                        upsampler(ws->blocks, nb_blocks_h, nb_blocks_v,
+                                  ws->YCbCr[i_c], mcu_h_dim, mcu_v_dim);
                 }
 
                 /* Convert YCbCr to RGB for color images */
                 if (jpeg->nb_comps == 3)
-                        YCbCr_to_ARGB(mcu_YCbCr, mcu_RGB, mcu_h_dim, mcu_v_dim);
+                        YCbCr_to_ARGB(ws->YCbCr, mcu_RGB, mcu_h_dim, mcu_v_dim);
 
                 /* Convert Y to RGB for grayscale images */
-                else if (jpeg->nb_comps == 1)
-                        Y_to_ARGB(mcu_YCbCr[0], mcu_RGB, mcu_h_dim, mcu_v_dim);
+                else
+                        Y_to_ARGB(ws->YCbCr[0], mcu_RGB, mcu_h_dim, mcu_v_dim);
+
+                mcu_RGB += mcu_size;
+        }
+}
+
+/*
+ * Restart intervals decoding state,
+ * shared by all the pipeline stages
+ */
+struct interval_decoder {
+
+        struct row_decoder *rows;
+
+        /* Entropy coded data, up to the end of file */
+        const uint8_t *data;
+
+        /* Start and end offsets of each interval in data */
+        uint32_t *starts, *ends;
+
+        /* Number of MCUs in the image */
+        uint32_t nb_mcu;
+
+        /* Indicates that an interval could not be decoded */
+        bool error;
+};
+
+/*
+ * Locates all nb_intervals restart intervals
+ * in the entropy coded data following the stream's position.
+ * Returns the end of scan's offset in data, or 0 on error.
+ */
+static uint32_t find_intervals(struct interval_decoder *decoder, uint32_t nb_intervals,
+                               uint32_t size)
+{
+        const uint8_t *data = decoder->data;
+        uint32_t k = 0;
+        uint8_t marker;
+
+        decoder->starts[0] = 0;
+
+        for (uint32_t i = 0; i + 1 < size; i++) {
+
+                if (data[i] != SECTION_HEAD)
+                        continue;
+
+                marker = data[i + 1];
+
+                /* Stuffed 0xFF byte */
+                if (marker == 0x00) {
+                        i++;
+                        continue;
+                }
+
+                /* Fill byte, the marker follows */
+                if (marker == SECTION_HEAD)
+                        continue;
+
+                /* Any other marker than RSTn ends the scan */
+                if (marker < RST0 || marker >= RST0 + NB_RST) {
+                        decoder->ends[k] = i;
+
+                        return k + 1 == nb_intervals ? i : 0;
+                }
+
+                /* One more restart interval */
+                if (++k == nb_intervals)
+                        return 0;
+
+                decoder->ends[k - 1] = i;
+                decoder->starts[k] = i + 2;
+                i++;
+        }
+
+        return 0;
+}
+
+/* Entropy decodes one restart interval (parallel stage) */
+static void process_interval(void *data, uint32_t interval, void *slot, uint32_t worker)
+{
+        struct interval_decoder *decoder = data;
+        struct row_decoder *rows = decoder->rows;
+        struct jpeg_data *jpeg = rows->jpeg;
+        bool *error = slot;
+
+        const uint32_t first_mcu = interval * jpeg->restart_interval;
+        uint32_t nb_mcus = decoder->nb_mcu - first_mcu;
+
+        /* DC predictions restart from 0 in each interval */
+        int32_t last_DC[MAX_COMPS] = { 0 };
+
+        if (nb_mcus > jpeg->restart_interval)
+                nb_mcus = jpeg->restart_interval;
+
+        /* Intervals above the crop region are not needed */
+        *error = false;
+
+        if (first_mcu + nb_mcus <= rows->first_row * jpeg->mcu.nb_h)
+                return;
+
+        struct bitstream *stream = open_memory_bitstream(
+                        jpeg->streams[worker],
+                        &decoder->data[decoder->starts[interval]],
+                        decoder->ends[interval] - decoder->starts[interval]);
+
+        *error = stream == NULL;
+
+        if (stream != NULL)
+                unpack_mcus(stream, jpeg, last_DC, nb_mcus,
+                            &rows->blocks[first_mcu * rows->nb_mcu_blocks * BLOCK_SIZE]);
+}
+
+/* Collects each restart interval's status (serial stage) */
+static void store_interval(void *data, uint32_t interval, void *slot)
+{
+        struct interval_decoder *decoder = data;
+        bool *error = slot;
+
+        UNUSED(interval);
+
+        decoder->error |= *error;
+}
+
+/*
+ * Entropy decodes all restart intervals in parallel,
+ * into rows->blocks, then moves the stream after the scan
+ */
+static void unpack_intervals(struct bitstream *stream, struct row_decoder *rows,
+                             uint32_t nb_mcu, uint32_t nb_threads, bool *error)
+{
+        struct jpeg_data *jpeg = rows->jpeg;
+        struct interval_decoder decoder;
+
+        const uint32_t scan_pos = pos_bitstream(stream);
+        const uint32_t nb_intervals = (nb_mcu + jpeg->restart_interval - 1)
+                                    / jpeg->restart_interval;
+        uint32_t end = 0;
+
+        decoder.rows = rows;
+        decoder.nb_mcu = nb_mcu;
+        decoder.error = false;
+
+        /* Load the whole scan and locate its RSTn markers */
+        const uint32_t size = load_bitstream(stream, &jpeg->scan_data, &jpeg->scan_capacity);
+
+        jpeg->offsets = reserve_buffer(jpeg->offsets, &jpeg->offsets_capacity,
+                                       2 * nb_intervals * sizeof(uint32_t));
+
+        decoder.data = jpeg->scan_data;
+        decoder.starts = jpeg->offsets;
+        decoder.ends = &decoder.starts[nb_intervals];
+
+        if (size > 0 && decoder.starts != NULL)
+                end = find_intervals(&decoder, nb_intervals, size);
+
+        if (!reserve_bitstreams(&jpeg->streams, &jpeg->nb_streams, nb_threads))
+                *error = true;
+
+        else if (end == 0) {
+                printf("ERROR : invalid restart markers\n");
+                *error = true;
+
+        } else {
+                const uint32_t nb_slots = pipeline_nb_slots(nb_threads);
+                const struct pipeline_stages stages = {
+                        NULL, process_interval, store_interval
+                };
+
+                bool status[nb_slots];
+                void *slots[nb_slots];
+
+                for (uint32_t i = 0; i < nb_slots; i++)
+                        slots[i] = &status[i];
+
+                /* Decode all restart intervals, up to the crop region's last row */
+                const uint32_t nb_needed = (rows->end_row * jpeg->mcu.nb_h
+                                            + jpeg->restart_interval - 1)
+                                         / jpeg->restart_interval;
+
+                if (!run_pipeline(jpeg->pool, &stages, &decoder, slots,
+                                  nb_needed < nb_intervals ? nb_needed : nb_intervals,
+                                  nb_threads)
+                    || decoder.error)
+                        *error = true;
+
+                /* Continue reading after the scan */
+                seek_bitstream(stream, scan_pos + end);
+        }
+}
+
+/* Computes how many blocks of a component cover an image dimension */
+static inline uint32_t blocks_per_dim(uint8_t nb_blocks, uint8_t mcu_dim, uint16_t dim)
+{
+        const uint32_t comp_dim = (dim * nb_blocks + mcu_dim - 1) / mcu_dim;
+
+        return (comp_dim + BLOCK_DIM - 1) / BLOCK_DIM;
+}
+
+/*
+ * Returns the whole image unpacked block of component i_c
+ * at (x, y), in blocks of this component
+ */
+static int32_t *coeffs_block(struct row_decoder *decoder, uint8_t i_c,
+                             uint32_t x, uint32_t y)
+{
+        const struct comp *comp = &decoder->jpeg->comps[i_c];
+
+        const uint32_t mcu = (y / comp->nb_blocks_v) * decoder->jpeg->mcu.nb_h
+                           + x / comp->nb_blocks_h;
+        const uint32_t n = decoder->first_block[i_c]
+                         + (y % comp->nb_blocks_v) * comp->nb_blocks_h
+                         + x % comp->nb_blocks_h;
 
+        return &decoder->blocks[(mcu * decoder->nb_mcu_blocks + n) * BLOCK_SIZE];
+}
+
+/* Entropy decodes the bits of a block coded by the current scan */
+static void unpack_coeffs(struct bitstream *stream, struct jpeg_data *jpeg, uint8_t i_c,
+                          int32_t *pred_DC, uint32_t *eobrun, int32_t *block)
+{
+        const struct scan *scan = &jpeg->read_scan;
+        struct huff_table *table_DC = jpeg->htables[0][jpeg->comps[i_c].i_dc];
+        struct huff_table *table_AC = jpeg->htables[1][jpeg->comps[i_c].i_ac];
+
+        /* Baseline scans code whole blocks */
+        if (!jpeg->progressive)
+                unpack_block(stream, table_DC, pred_DC, table_AC, block);
+
+        else if (scan->start == 0) {
+                if (scan->high == 0)
+                        unpack_DC_first(stream, table_DC, pred_DC, scan->low, block);
+                else
+                        unpack_DC_refine(stream, scan->low, block);
+        }
+        else if (scan->high == 0)
+                unpack_AC_first(stream, table_AC, scan->start, scan->end,
+                                scan->low, eobrun, block);
+        else
+                unpack_AC_refine(stream, table_AC, scan->start, scan->end,
+                                 scan->low, eobrun, block);
+}
+
+/*
+ * Entropy decodes one scan of a multiple scans frame,
+ * completing or refining the unpacked blocks of the whole image
+ */
+static void unpack_scan(struct bitstream *stream, struct row_decoder *decoder, bool *error)
+{
+        struct jpeg_data *jpeg = decoder->jpeg;
+        const struct scan *scan = &jpeg->read_scan;
+
+        int32_t last_DC[MAX_COMPS] = { 0 };
+        uint32_t eobrun = 0;
+        uint8_t i_c = scan->comps[0];
+        uint8_t marker;
+
+        /* Interleaved scans code whole MCUs */
+        uint32_t nb_units_h = jpeg->mcu.nb_h;
+        uint32_t nb_units_v = jpeg->mcu.nb_v;
+
+        /*
+         * Other scans code single blocks of their component,
+         * except the ones only padding the last MCUs
+         */
+        if (scan->nb_comps == 1) {
+                nb_units_h = blocks_per_dim(jpeg->comps[i_c].nb_blocks_h,
+                                            jpeg->mcu.h_dim, jpeg->width);
+                nb_units_v = blocks_per_dim(jpeg->comps[i_c].nb_blocks_v,
+                                            jpeg->mcu.v_dim, jpeg->height);
+        }
+
+        for (uint32_t unit = 0; unit < nb_units_h * nb_units_v; unit++) {
+                const uint32_t x = unit % nb_units_h;
+                const uint32_t y = unit / nb_units_h;
+
+                /* Predictions and EOB runs are reset at each RSTn marker */
+                if (jpeg->restart_interval > 0 && unit > 0
+                    && unit % jpeg->restart_interval == 0) {
+                        marker = skip_bitstream_to_marker(stream);
+
+                        if (marker < RST0 || marker >= RST0 + NB_RST) {
+                                *error = true;
+                                return;
+                        }
+
+                        skip_bitstream(stream, 2);
+
+                        memset(last_DC, 0, sizeof(last_DC));
+                        eobrun = 0;
+                }
+
+                if (scan->nb_comps == 1) {
+                        unpack_coeffs(stream, jpeg, i_c, &last_DC[i_c], &eobrun,
+                                      coeffs_block(decoder, i_c, x, y));
+                        continue;
+                }
+
+                /* Retrieve each block of each component of the MCU */
+                for (uint8_t j = 0; j < scan->nb_comps; j++) {
+                        const uint8_t nb_blocks_h = jpeg->comps[scan->comps[j]].nb_blocks_h;
+                        const uint8_t nb_blocks_v = jpeg->comps[scan->comps[j]].nb_blocks_v;
+
+                        i_c = scan->comps[j];
+
+                        for (uint8_t n = 0; n < nb_blocks_h * nb_blocks_v; n++)
+                                unpack_coeffs(stream, jpeg, i_c, &last_DC[i_c], &eobrun,
+                                              coeffs_block(decoder, i_c,
+                                                           x * nb_blocks_h + n % nb_blocks_h,
+                                                           y * nb_blocks_v + n / nb_blocks_h));
+                }
+        }
+}
+
+/*
+ * Entropy decodes all the scans of a progressive or multiple
+ * scans baseline frame into the whole image blocks,
+ * which must be zeroed beforehand
+ */
+static void unpack_scans(struct bitstream *stream, struct row_decoder *decoder, bool *error)
+{
+        struct jpeg_data *jpeg = decoder->jpeg;
+        uint8_t marker = SOS;
+
+        while (marker == SOS && !*error) {
+
+                unpack_scan(stream, decoder, error);
+
+                /* Read all sections until the next scan or EOI */
+                marker = ANY;
+
+                while (!*error && marker != SOS) {
+                        const uint8_t next = skip_bitstream_to_marker(stream);
+
+                        if (next == EOI)
+                                break;
+
+                        if (next == 0)
+                                *error = true;
+                        else
+                                marker = read_section(stream, ANY, jpeg, error);
+                }
+        }
+}
+
+/*
+ * Indicates whether the frame's blocks are spread over
+ * several scans : progressive scans, or baseline scans
+ * holding only some of the components
+ */
+static inline bool multiple_scans(const struct jpeg_data *jpeg)
+{
+        return jpeg->progressive || jpeg->read_scan.nb_comps < jpeg->nb_comps;
+}
+
+/* Extract and decode raw JPEG data */
+static void scan_jpeg(struct bitstream *stream, struct jpeg_data *jpeg, bool *error)
+{
+        if (stream == NULL || error == NULL || *error || jpeg == NULL)
+                return;
+
+        if (jpeg->nb_comps != 1 && jpeg->nb_comps != 3) {
+                *error = true;
+                return;
+        }
+
+
+        struct row_decoder decoder;
+        uint32_t nb_threads = jpeg->nb_threads;
+
+        if (nb_threads == 0)
+                nb_threads = 1;
+
+        decoder.jpeg = jpeg;
+        decoder.stream = stream;
+        decoder.nb_mcu_blocks = 0;
+        decoder.blocks = NULL;
+
+        memset(decoder.last_DC, 0, sizeof(decoder.last_DC));
+
+        for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
+                const uint8_t i_c = jpeg->comp_order[i];
+
+                decoder.first_block[i_c] = decoder.nb_mcu_blocks;
+                decoder.nb_mcu_blocks += jpeg->comps[i_c].nb_blocks_h
+                                       * jpeg->comps[i_c].nb_blocks_v;
+        }
+
+        /* Only the MCUs covering the crop region are decoded, if any */
+        struct region region = jpeg->crop;
+
+        decoder.first_row = 0;
+        decoder.end_row = jpeg->mcu.nb_v;
+        decoder.first_mcu = 0;
+        decoder.end_mcu = jpeg->mcu.nb_h;
+
+        if (region.width > 0 && region.height > 0
+            && clip_region(&region, jpeg->width, jpeg->height)) {
+                decoder.first_row = region.y / jpeg->mcu.v;
+                decoder.end_row = (region.y + region.height + jpeg->mcu.v - 1) / jpeg->mcu.v;
+                decoder.first_mcu = region.x / jpeg->mcu.h;
+                decoder.end_mcu = (region.x + region.width + jpeg->mcu.h - 1) / jpeg->mcu.h;
+        }
+
+
+        /* Size one workspace per worker once for the whole frame */
+        if (!reserve_workspaces(&jpeg->workspaces, &jpeg->nb_workspaces, nb_threads,
+                                jpeg->mcu.h_dim, jpeg->mcu.v_dim)) {
+                *error = true;
+                return;
+        }
+
+        /* Buffer to store raw jpeg data */
+        const uint32_t nb_pixels_max = jpeg->mcu.h * jpeg->mcu.v * jpeg->mcu.nb;
+        jpeg->raw_data = reserve_buffer(jpeg->raw_data, &jpeg->raw_capacity,
+                                        nb_pixels_max * sizeof(uint32_t));
+
+        if (jpeg->raw_data == NULL) {
+                *error = true;
+                return;
+        }
+
+
+        /* Allocate the pipeline's MCU rows of unpacked blocks */
+        const uint32_t nb_slots = pipeline_nb_slots(nb_threads);
+        const size_t row_size = jpeg->mcu.nb_h * decoder.nb_mcu_blocks
+                              * BLOCK_SIZE * sizeof(int32_t);
+
+        void *slots[nb_slots];
+        uint8_t *memory = aligned_malloc(nb_slots * row_size);
+
+        if (memory == NULL) {
+                *error = true;
+                return;
+        }
+
+        for (uint32_t i = 0; i < nb_slots; i++)
+                slots[i] = &memory[i * row_size];
+
+        struct pipeline_stages stages = { load_row, process_row, NULL };
+
+        /*
+         * Multiple scans fill the blocks of the whole image :
+         * rows are only reconstructed once all scans are decoded
+         */
+        if (multiple_scans(jpeg)) {
+                decoder.blocks = aligned_malloc(jpeg->mcu.nb_v * row_size);
+
+                if (decoder.blocks != NULL) {
+                        memset(decoder.blocks, 0, jpeg->mcu.nb_v * row_size);
+                        unpack_scans(stream, &decoder, error);
+                } else
+                        *error = true;
+
+                stages.load = NULL;
+        }
+
+        /*
+         * Restart intervals are independent : unpack them all
+         * in parallel first, rows then only need reconstruction
+         */
+        else if (jpeg->restart_interval > 0) {
+                decoder.blocks = aligned_malloc(jpeg->mcu.nb_v * row_size);
+
+                if (decoder.blocks != NULL)
+                        unpack_intervals(stream, &decoder, jpeg->mcu.nb, nb_threads, error);
                 else
                         *error = true;
+
+                stages.load = NULL;
+        }
+
+
+        /* Extract and decode all MCU rows, up to the crop region's last one */
+        if (!*error && !run_pipeline(jpeg->pool, &stages, &decoder, slots, decoder.end_row, nb_threads))
+                *error = true;
+
+        aligned_free(decoder.blocks);
+        aligned_free(memory);
+}
+
+/*
+ * Extracts the quantified coefficients of a JPEG file
+ * into mcu_data, without decoding them
+ */
+void read_coefficients(struct jpeg_data *jpeg, bool *error)
+{
+        if (jpeg == NULL || jpeg->path == NULL || *error) {
+                *error = true;
+                return;
+        }
+
+        struct bitstream *stream = create_bitstream(jpeg->path, RDONLY);
+
+        if (stream == NULL) {
+                *error = true;
+                return;
+        }
+
+        /* Huffman tables kept from a previous image are replaced */
+        free_jpeg_data(jpeg);
+
+        /* Read jpeg header data */
+        read_header(stream, jpeg, error);
+
+        /* Lossless frames hold samples, not DCT coefficients */
+        if (!*error && jpeg->lossless) {
+                printf("ERROR : lossless JPEG files can not be transcoded\n");
+                *error = true;
         }
+
+        /* Detect MCU informations from the jpeg structure */
+        detect_mcu(jpeg, error);
+
+
+        struct row_decoder decoder;
+        uint32_t nb_threads = jpeg->nb_threads;
+
+        if (nb_threads == 0)
+                nb_threads = 1;
+
+        decoder.jpeg = jpeg;
+        decoder.stream = stream;
+        decoder.nb_mcu_blocks = 0;
+        decoder.first_row = 0;
+        decoder.end_row = jpeg->mcu.nb_v;
+        decoder.first_mcu = 0;
+        decoder.end_mcu = jpeg->mcu.nb_h;
+
+        memset(decoder.last_DC, 0, sizeof(decoder.last_DC));
+
+        for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
+                const uint8_t i_c = jpeg->comp_order[i];
+
+                decoder.first_block[i_c] = decoder.nb_mcu_blocks;
+                decoder.nb_mcu_blocks += jpeg->comps[i_c].nb_blocks_h
+                                       * jpeg->comps[i_c].nb_blocks_v;
+        }
+
+        if (!*error)
+                jpeg->mcu_data = reserve_buffer(jpeg->mcu_data, &jpeg->mcu_capacity,
+                                jpeg->mcu.nb * decoder.nb_mcu_blocks * BLOCK_SIZE
+                                * sizeof(int32_t));
+
+        if (jpeg->mcu_data == NULL)
+                *error = true;
+
+        decoder.blocks = jpeg->mcu_data;
+
+
+        /* Entropy decode all MCUs, restart intervals in parallel */
+        if (!*error && multiple_scans(jpeg)) {
+                memset(jpeg->mcu_data, 0, jpeg->mcu.nb * decoder.nb_mcu_blocks
+                                          * BLOCK_SIZE * sizeof(int32_t));
+                unpack_scans(stream, &decoder, error);
+
+        } else if (!*error && jpeg->restart_interval > 0)
+                unpack_intervals(stream, &decoder, jpeg->mcu.nb, nb_threads, error);
+
+        else if (!*error)
+                unpack_mcus(stream, jpeg, decoder.last_DC, jpeg->mcu.nb, jpeg->mcu_data);
+
+        free_bitstream(stream);
+
+        /* The encoder builds its own Huffman tables */
+        free_jpeg_data(jpeg);
+
+        if (*error)
+                printf("ERROR : invalid input JPEG file\n");
+
+        /* Use one AC/DC tree per component */
+        for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
+                jpeg->comps[i].i_dc = i;
+                jpeg->comps[i].i_ac = i;
+        }
+
+        jpeg->transcoded = true;
 }
 
 
@@ -609,6 +1362,32 @@ static const uint8_t generic_qt[64] =
         13, 13, 14, 14, 14, 15, 15, 16
 };
 
+/* Annex K.1 luminance QTable (natural order) */
+static const uint8_t luminance_qt[64] =
+{
+        16,  11,  10,  16,  24,  40,  51,  61,
+        12,  12,  14,  19,  26,  58,  60,  55,
+        14,  13,  16,  24,  40,  57,  69,  56,
+        14,  17,  22,  29,  51,  87,  80,  62,
+        18,  22,  37,  56,  68, 109, 103,  77,
+        24,  35,  55,  64,  81, 104, 113,  92,
+        49,  64,  78,  87, 103, 121, 120, 101,
+        72,  92,  95,  98, 112, 100, 103,  99
+};
+
+/* Annex K.1 chrominance QTable (natural order) */
+static const uint8_t chrominance_qt[64] =
+{
+        17,  18,  24,  47,  99,  99,  99,  99,
+        18,  21,  26,  66,  99,  99,  99,  99,
+        24,  26,  56,  99,  99,  99,  99,  99,
+        47,  66,  99,  99,  99,  99,  99,  99,
+        99,  99,  99,  99,  99,  99,  99,  99,
+        99,  99,  99,  99,  99,  99,  99,  99,
+        99,  99,  99,  99,  99,  99,  99,  99,
+        99,  99,  99,  99,  99,  99,  99,  99
+};
+
 /* (x + y + 1) QTable */
 // const uint8_t generic_qt[64] =
 // {
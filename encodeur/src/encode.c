@@ -9,146 +9,713 @@
 #include "upsampler.h"
 #include "downsampler.h"
 #include "library.h"
+#include "pipeline.h"
+#include "lossless.h"
 
 /* Computes how many MCUs are required to cover a given dimension */
 static inline uint16_t mcu_per_dim(uint8_t mcu, uint16_t dim);
 
+/* Computes how many blocks of a component cover an image dimension */
+static inline uint32_t blocks_per_dim(uint8_t nb_blocks, uint8_t mcu_dim, uint16_t dim);
 
-/* Compresses raw mcu data, and computes Huffman tables */
-void compute_jpeg(struct jpeg_data *jpeg, bool *error)
+
+/*
+ * MCU row encoding state,
+ * shared by all the pipeline stages
+ */
+struct row_encoder {
+        struct jpeg_data *jpeg;
+
+        /* Number of blocks per MCU */
+        uint32_t nb_mcu_blocks;
+
+        /* Index of each component's first block in an MCU */
+        uint32_t first_block[MAX_COMPS];
+
+        /* DC frequency corrections for each row's first blocks */
+        int32_t DC_fixes[MAX_COMPS][0x100];
+};
+
+/*
+ * Identifier of a component in SOF and SOS sections :
+ * lossless RGB components are named 'R', 'G' and 'B'
+ */
+static inline uint8_t comp_id(const struct jpeg_data *jpeg, uint8_t i_c)
+{
+        if (jpeg->lossless && jpeg->nb_comps == 3)
+                return "RGB"[i_c];
+
+        return i_c + 1;
+}
+
+/* Indicates if an MCU starts a restart interval */
+static inline bool is_restart_mcu(const struct jpeg_data *jpeg, uint32_t mcu)
+{
+        return jpeg->restart_interval > 0 && mcu % jpeg->restart_interval == 0;
+}
+
+/*
+ * Indicates if a pixel block is constant,
+ * its DCT then being only a DC coefficient
+ */
+static inline bool is_flat_block(const uint8_t *pixels)
 {
-        if (jpeg == NULL || *error) {
+        uint8_t diff = 0;
+
+        /* Branchless, so that the compiler vectorizes it */
+        for (uint8_t i = 1; i < BLOCK_SIZE; i++)
+                diff |= pixels[i] ^ pixels[0];
+
+        return diff == 0;
+}
+
+/*
+ * Compresses one MCU : color conversion, downsampling,
+ * DCT and quantification of all its blocks.
+ * The DCT coefficients are also kept in dct when not NULL.
+ */
+static void compress_mcu(struct jpeg_data *jpeg, struct workspace *ws,
+                         uint32_t *mcu_RGB, int32_t *block, int32_t *dct)
+{
+        uint8_t i_c, i_q, nb_blocks_h, nb_blocks_v, nb_blocks;
+
+        const uint8_t mcu_h_dim = jpeg->mcu.h_dim;
+        const uint8_t mcu_v_dim = jpeg->mcu.v_dim;
+
+        /* Convert RGB to YCbCr for color images */
+        if (jpeg->nb_comps == 3)
+                ARGB_to_YCbCr(mcu_RGB, ws->YCbCr, mcu_h_dim, mcu_v_dim);
+
+        /* Convert RGB to Y for gray images */
+        else
+                ARGB_to_Y(mcu_RGB, ws->YCbCr[0], mcu_h_dim, mcu_v_dim);
+
+
+        /* Encode each component in the correct order */
+        for (uint8_t j = 0; j < jpeg->nb_comps; j++) {
+
+                /* Retrieve component informations */
+                i_c = jpeg->comp_order[j];
+                i_q = jpeg->comps[i_c].i_q;
+                nb_blocks_h = jpeg->comps[i_c].nb_blocks_h;
+                nb_blocks_v = jpeg->comps[i_c].nb_blocks_v;
+                nb_blocks = nb_blocks_h * nb_blocks_v;
+
+                /* Downsample current MCUs */
+                downsampler(ws->YCbCr[i_c], mcu_h_dim, mcu_v_dim,
+                            ws->blocks, nb_blocks_h, nb_blocks_v);
+
+                /* Compress each block */
+                for (uint8_t n = 0; n < nb_blocks; n++) {
+                        const uint8_t *pixels = &ws->blocks[n * BLOCK_SIZE];
+
+                        /* Flat blocks skip the DCT, their AC coefficients being 0 */
+                        if (is_flat_block(pixels)) {
+                                memset(ws->coeffs, 0, BLOCK_SIZE * sizeof(int32_t));
+                                memset(block, 0, BLOCK_SIZE * sizeof(int32_t));
+
+                                ws->coeffs[0] = (pixels[0] - 128) * BLOCK_DIM;
+                                block[0] = ws->coeffs[0] / jpeg->qtables[i_q][0];
+
+                        } else {
+                                dct_block(&ws->blocks[n * BLOCK_SIZE], ws->coeffs);
+                                qzz_block(ws->coeffs, block, (uint8_t*)&jpeg->qtables[i_q]);
+                        }
+
+                        if (dct != NULL) {
+                                memcpy(dct, ws->coeffs, BLOCK_SIZE * sizeof(int32_t));
+                                dct += BLOCK_SIZE;
+                        }
+
+                        block += BLOCK_SIZE;
+                }
+        }
+}
+
+/* Quantifies one MCU's previously computed DCT coefficients */
+static void quantify_mcu(struct jpeg_data *jpeg, int32_t *dct, int32_t *block)
+{
+        uint8_t i_c, i_q, nb_blocks;
+
+        for (uint8_t j = 0; j < jpeg->nb_comps; j++) {
+
+                i_c = jpeg->comp_order[j];
+                i_q = jpeg->comps[i_c].i_q;
+                nb_blocks = jpeg->comps[i_c].nb_blocks_h * jpeg->comps[i_c].nb_blocks_v;
+
+                for (uint8_t n = 0; n < nb_blocks; n++) {
+                        if (jpeg->trellis)
+                                trellis_qzz_block(dct, block, (uint8_t*)&jpeg->qtables[i_q],
+                                                  jpeg->trellis_sizes[i_c], TRELLIS_LAMBDA);
+                        else
+                                qzz_block(dct, block, (uint8_t*)&jpeg->qtables[i_q]);
+
+                        dct += BLOCK_SIZE;
+                        block += BLOCK_SIZE;
+                }
+        }
+}
+
+/*
+ * Compresses one MCU row (parallel stage), unless its quantified
+ * or DCT coefficients are already known, then counts the row's
+ * Huffman values in the worker's frequency tables.
+ * Each row's first DC values are counted as if predicted
+ * perfectly, store_row corrects them afterwards.
+ * DC predictions restart from 0 at each restart interval.
+ */
+static void process_row(void *data, uint32_t row, void *slot, uint32_t worker)
+{
+        struct row_encoder *encoder = data;
+        struct jpeg_data *jpeg = encoder->jpeg;
+        struct workspace *ws = &jpeg->workspaces[worker];
+
+        uint8_t i_c, nb_blocks;
+        int32_t last_DC[MAX_COMPS];
+        int32_t *block, *dct = NULL;
+
+        const uint32_t first_mcu = row * jpeg->mcu.nb_h;
+
+        UNUSED(slot);
+
+        for (uint32_t m = 0; m < jpeg->mcu.nb_h; m++) {
+
+                const bool restart = is_restart_mcu(jpeg, first_mcu + m);
+
+                block = &jpeg->mcu_data[(first_mcu + m) * encoder->nb_mcu_blocks * BLOCK_SIZE];
+
+                if (jpeg->cache_dct)
+                        dct = &jpeg->dct_data[(first_mcu + m) * encoder->nb_mcu_blocks
+                                              * BLOCK_SIZE];
+
+                /* Cached DCT coefficients only need to be quantified */
+                if (jpeg->dct_cached)
+                        quantify_mcu(jpeg, dct, block);
+
+                else if (!jpeg->transcoded)
+                        compress_mcu(jpeg, ws, &jpeg->raw_data[(first_mcu + m) * jpeg->mcu.size],
+                                     block, dct);
+
+
+                /* Compute data frequencies of each component */
+                for (uint8_t j = 0; j < jpeg->nb_comps; j++) {
+
+                        i_c = jpeg->comp_order[j];
+                        nb_blocks = jpeg->comps[i_c].nb_blocks_h
+                                  * jpeg->comps[i_c].nb_blocks_v;
+
+                        for (uint8_t n = 0; n < nb_blocks; n++) {
+
+                                /* The row's first DC is predicted by store_row */
+                                if (n == 0 && restart)
+                                        last_DC[i_c] = 0;
+
+                                else if (n == 0 && m == 0)
+                                        last_DC[i_c] = block[0];
+
+                                /* Empty pack_block execution counting frequencies */
+                                if (!jpeg->progressive && !jpeg->standard_htables)
+                                        pack_block(NULL, NULL, &last_DC[i_c], NULL, block,
+                                                   ws->freqs[i_c]);
+
+                                block += BLOCK_SIZE;
+                        }
+                }
+        }
+}
+
+/*
+ * Corrects the DC frequencies of one MCU row's first blocks,
+ * now that their predictions are known (serial stage).
+ */
+static void store_row(void *data, uint32_t row, void *slot)
+{
+        struct row_encoder *encoder = data;
+        struct jpeg_data *jpeg = encoder->jpeg;
+
+        uint8_t i_c, nb_blocks;
+        int16_t diff;
+
+        const uint32_t row_size = jpeg->mcu.nb_h * encoder->nb_mcu_blocks;
+        const int32_t *blocks = &jpeg->mcu_data[row * row_size * BLOCK_SIZE];
+        const int32_t *last_mcu = &blocks[(row_size - encoder->nb_mcu_blocks) * BLOCK_SIZE];
+        const bool restart = is_restart_mcu(jpeg, row * jpeg->mcu.nb_h);
+
+        UNUSED(slot);
+
+        for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
+                i_c = jpeg->comp_order[i];
+                nb_blocks = jpeg->comps[i_c].nb_blocks_h * jpeg->comps[i_c].nb_blocks_v;
+
+                /* Replace the perfect prediction by the real one */
+                if (!restart) {
+                        diff = blocks[encoder->first_block[i_c] * BLOCK_SIZE]
+                             - jpeg->comps[i_c].last_DC;
+
+                        encoder->DC_fixes[i_c][0]--;
+                        encoder->DC_fixes[i_c][magnitude_class(diff)]++;
+                }
+
+                /* The row's last block predicts the next row */
+                jpeg->comps[i_c].last_DC =
+                        last_mcu[(encoder->first_block[i_c] + nb_blocks - 1) * BLOCK_SIZE];
+        }
+}
+
+/*
+ * Compresses raw mcu data, and merges the Huffman
+ * frequencies of all values into the first workspace's ones
+ */
+static void count_jpeg(struct jpeg_data *jpeg, bool *error)
+{
+        if (jpeg == NULL || *error || (jpeg->nb_comps != 1 && jpeg->nb_comps != 3)) {
                 *error = true;
                 return;
         }
 
+        struct row_encoder encoder;
+        uint32_t nb_threads = jpeg->nb_threads;
         uint8_t i_c;
-        uint8_t mcu_h = jpeg->mcu.h;
-        uint8_t mcu_v = jpeg->mcu.v;
-        uint8_t mcu_h_dim = jpeg->mcu.h_dim;
-        uint8_t mcu_v_dim = jpeg->mcu.v_dim;
-        uint32_t nb_mcu = jpeg->mcu.nb;
-        uint32_t block_idx = 0;
-
-        uint8_t nb_blocks_h, nb_blocks_v, nb_blocks;
-        uint8_t i_q;
-        int32_t *last_DC;
-
-        int32_t *block;
-        int32_t qzz[BLOCK_SIZE];
-        uint8_t *mcu_data, *qtable;
-        uint8_t dct[mcu_h_dim * mcu_v_dim][BLOCK_SIZE];
-
-        uint32_t *mcu_RGB = NULL;
-        uint8_t data_YCbCr[3][mcu_h * mcu_v];
-        uint8_t *mcu_YCbCr[3] = {
-                (uint8_t*)&data_YCbCr[0],
-                (uint8_t*)&data_YCbCr[1],
-                (uint8_t*)&data_YCbCr[2]
-        };
-
-
-        /* Use 1 table for each tree (AC/DC)
-         * Allocate 0x100 values because Huffman values use 8 bits */
-        uint32_t freq_data[MAX_COMPS][2][0x100];
-
-        /* Components's frequence tables */
-        uint32_t *freqs[MAX_COMPS][2] = {
-                { (uint32_t*)&freq_data[0][0], (uint32_t*)&freq_data[0][1] },
-                { (uint32_t*)&freq_data[1][0], (uint32_t*)&freq_data[1][1] },
-                { (uint32_t*)&freq_data[2][0], (uint32_t*)&freq_data[2][1] }
-        };
+
+        if (nb_threads == 0)
+                nb_threads = 1;
+
+        encoder.jpeg = jpeg;
+        encoder.nb_mcu_blocks = 0;
+
+        for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
+                i_c = jpeg->comp_order[i];
+
+                encoder.first_block[i_c] = encoder.nb_mcu_blocks;
+                encoder.nb_mcu_blocks += jpeg->comps[i_c].nb_blocks_h
+                                       * jpeg->comps[i_c].nb_blocks_v;
+        }
+
+        memset(encoder.DC_fixes, 0, sizeof(encoder.DC_fixes));
+
+
+        /* Size one workspace per worker once for the whole image */
+        if (!reserve_workspaces(&jpeg->workspaces, &jpeg->nb_workspaces, nb_threads,
+                                jpeg->mcu.h_dim, jpeg->mcu.v_dim)) {
+                *error = true;
+                return;
+        }
 
         /* Set default frequencies to 0 */
-        memset(freq_data, 0, sizeof(freq_data));
+        for (uint32_t t = 0; t < nb_threads; t++)
+                for (uint8_t i = 0; i < MAX_COMPS; i++)
+                        for (uint8_t j = 0; j < 2; j++)
+                                memset(jpeg->workspaces[t].freqs[i][j], 0,
+                                       0x100 * sizeof(uint32_t));
 
 
-        const uint8_t nb_mcu_blocks = mcu_h_dim * mcu_v_dim + (jpeg->nb_comps - 1);
-        jpeg->mcu_data = malloc(nb_mcu * nb_mcu_blocks * BLOCK_SIZE * sizeof(int32_t));
+        jpeg->mcu_data = reserve_buffer(jpeg->mcu_data, &jpeg->mcu_capacity,
+                        jpeg->mcu.nb * encoder.nb_mcu_blocks * BLOCK_SIZE * sizeof(int32_t));
 
         if (jpeg->mcu_data == NULL) {
                 *error = true;
                 return;
         }
 
-        /* Encode all MCUs */
-        for (uint32_t i = 0; i < nb_mcu; i++) {
+        /*  Reset last_DC fields used for DC predictions */
+        for (uint8_t i = 0; i < jpeg->nb_comps; i++)
+                jpeg->comps[i].last_DC = 0;
 
-                mcu_RGB = &(jpeg->raw_data[i * jpeg->mcu.size]);
 
-                /* Convert RGB to YCbCr for color images */
-                if (jpeg->nb_comps == 3)
-                        ARGB_to_YCbCr(mcu_RGB, mcu_YCbCr, mcu_h_dim, mcu_v_dim);
+        /* Compress all MCU rows in parallel, correcting DC frequencies in order */
+        const struct pipeline_stages stages = { NULL, process_row, store_row };
+        void *slots[pipeline_nb_slots(nb_threads)];
 
-                /* Convert RGB to Y for gray images */
-                else if (jpeg->nb_comps == 1)
-                        ARGB_to_Y(mcu_RGB, mcu_YCbCr[0], mcu_h_dim, mcu_v_dim);
+        memset(slots, 0, sizeof(slots));
 
-                else
-                        *error = true;
+        if (!run_pipeline(jpeg->pool, &stages, &encoder, slots, jpeg->mcu.nb_v, nb_threads)) {
+                *error = true;
+                return;
+        }
 
 
-                /* Encode each component in the correct order */
-                for (uint8_t j = 0; j < jpeg->nb_comps; j++) {
+        /* Merge all frequency tables into the first worker's ones */
+        uint32_t *(*freqs)[2] = jpeg->workspaces[0].freqs;
 
-                        /* Retrieve component informations */
-                        i_c = jpeg->comp_order[j];
-                        i_q = jpeg->comps[i_c].i_q;
-                        nb_blocks_h = jpeg->comps[i_c].nb_blocks_h;
-                        nb_blocks_v = jpeg->comps[i_c].nb_blocks_v;
-                        nb_blocks = nb_blocks_h * nb_blocks_v;
-                        last_DC = &jpeg->comps[i_c].last_DC;
+        for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
+                for (uint32_t t = 1; t < nb_threads; t++)
+                        for (uint8_t j = 0; j < 2; j++)
+                                for (uint16_t v = 0; v < 0x100; v++)
+                                        freqs[i][j][v] += jpeg->workspaces[t].freqs[i][j][v];
 
-                        /* Downsample current MCUs */
-                        mcu_data = mcu_YCbCr[i_c];
-                        downsampler(mcu_data, mcu_h_dim, mcu_v_dim, (uint8_t*)dct, nb_blocks_h, nb_blocks_v);
+                for (uint16_t v = 0; v < 0x100; v++)
+                        freqs[i][0][v] += encoder.DC_fixes[i][v];
+        }
 
-                        /* Compress each MCU and compute data frequencies */
-                        for (uint8_t n = 0; n < nb_blocks; n++) {
+        /*  Reset last_DC fields so that write_blocks can work fine */
+        for (uint8_t i = 0; i < jpeg->nb_comps; i++)
+                jpeg->comps[i].last_DC = 0;
+}
+
+/*
+ * Sets the standard Huffman tables : luminance ones for the
+ * first component, chrominance ones shared by the others
+ */
+static void set_standard_tables(struct jpeg_data *jpeg, bool *error)
+{
+        for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
+                jpeg->comps[i].i_dc = (i > 0);
+                jpeg->comps[i].i_ac = (i > 0);
+        }
 
-                                dct_block((uint8_t*)&dct[n], qzz);
+        for (uint8_t i = 0; i < MAX_HTABLES; i++) {
+                for (uint8_t h = 0; h < 2; h++) {
+                        struct huff_table **table = &jpeg->htables[h][i];
 
-                                block = &jpeg->mcu_data[block_idx];
+                        if (i < 2 && i < jpeg->nb_comps) {
+                                *table = create_standard_table(h, i, *table);
 
-                                qtable = (uint8_t*)&jpeg->qtables[i_q];
-                                qzz_block (qzz, block, qtable);
+                                if (*table == NULL)
+                                        *error = true;
+                        }
 
-                                /* Empty pack_block execution counting frequencies */
-                                pack_block(NULL, NULL, last_DC, NULL, block, freqs[i_c]);
+                        else {
+                                free_huffman_table(*table);
+                                *table = NULL;
+                        }
+                }
+        }
+}
+
+/* Computes sequential Huffman tables from the counted frequencies */
+static void create_tables(struct jpeg_data *jpeg, bool *error)
+{
+        if (*error)
+                return;
+
+        /* Standard tables need no frequencies */
+        if (jpeg->standard_htables) {
+                set_standard_tables(jpeg, error);
+                return;
+        }
+
+        uint32_t *(*freqs)[2] = jpeg->workspaces[0].freqs;
+
+        /*
+         * Create all Huffman trees, reusing previously allocated
+         * tables and freeing the ones no component needs anymore
+         */
+        for (uint8_t i = 0; i < MAX_HTABLES; i++) {
+                for (uint8_t h = 0; h < 2; h++) {
+                        struct huff_table **table = &jpeg->htables[h][i];
+
+                        if (i < jpeg->nb_comps)
+                                *table = create_huffman_tree(freqs[i][h], *table, error);
 
-                                block_idx += BLOCK_SIZE;
+                        else {
+                                free_huffman_table(*table);
+                                *table = NULL;
                         }
                 }
         }
+}
+
+/* Compresses raw mcu data, and computes Huffman tables */
+void compute_jpeg(struct jpeg_data *jpeg, bool *error)
+{
+        /* Lossless frames code prediction differences instead of blocks */
+        if (jpeg != NULL && jpeg->lossless) {
+                compute_lossless(jpeg, error);
+                return;
+        }
+
+        count_jpeg(jpeg, error);
+
+        /* Progressive scans create their own Huffman trees */
+        if (*error || jpeg->progressive)
+                return;
+
+        create_tables(jpeg, error);
+}
+
+/* Allocates the buffer caching the image's DCT coefficients */
+static void reserve_dct(struct jpeg_data *jpeg, bool *error)
+{
+        uint32_t nb_mcu_blocks = 0;
 
-        /*  Reset last_DC fields so that write_blocks can work fine */
         for (uint8_t i = 0; i < jpeg->nb_comps; i++)
-                jpeg->comps[i].last_DC = 0;
+                nb_mcu_blocks += jpeg->comps[i].nb_blocks_h * jpeg->comps[i].nb_blocks_v;
+
+        jpeg->dct_data = reserve_buffer(jpeg->dct_data, &jpeg->dct_capacity,
+                        jpeg->mcu.nb * nb_mcu_blocks * BLOCK_SIZE * sizeof(int32_t));
+
+        if (jpeg->dct_data == NULL)
+                *error = true;
+        else
+                jpeg->cache_dct = true;
+}
+
+/*
+ * Compresses raw mcu data once to compute the AC Huffman code
+ * sizes, with which compute_jpeg then quantifies the cached
+ * DCT coefficients again with trellis quantification
+ */
+void trellis_jpeg(struct jpeg_data *jpeg, bool *error)
+{
+        if (jpeg == NULL || *error || jpeg->transcoded) {
+                *error = true;
+                return;
+        }
+
+        reserve_dct(jpeg, error);
+
+        /*
+         * Frequencies are always counted here : sequential
+         * tables model the rate of progressive scans too
+         */
+        const bool progressive = jpeg->progressive;
+        const bool standard_htables = jpeg->standard_htables;
+
+        jpeg->progressive = false;
+        jpeg->standard_htables = false;
+        count_jpeg(jpeg, error);
+        jpeg->progressive = progressive;
+        jpeg->standard_htables = standard_htables;
+
+        /* Standard tables give the code sizes of the written file */
+        create_tables(jpeg, error);
+
+        if (*error)
+                return;
+
+        for (uint8_t i = 0; i < jpeg->nb_comps; i++)
+                table_code_sizes(jpeg->htables[1][jpeg->comps[i].i_ac],
+                                 jpeg->trellis_sizes[i]);
+
+        jpeg->dct_cached = true;
+        jpeg->trellis = true;
+}
+
+/*
+ * Estimates the JPEG file size from the merged Huffman frequencies :
+ * code sizes given by code_bits (or by the components' current
+ * Huffman tables when NULL) and magnitude bits of all values,
+ * plus headers
+ */
+static uint32_t estimate_size(struct jpeg_data *jpeg,
+                              uint64_t (*code_bits)(const uint32_t freqs[0x100]))
+{
+        uint32_t *(*freqs)[2] = jpeg->workspaces[0].freqs;
+        uint64_t bits = 0;
+        uint16_t nb_values;
+        bool qtables[MAX_QTABLES];
+        bool htables[2][MAX_HTABLES];
+
+        memset(qtables, 0, sizeof(qtables));
+        memset(htables, 0, sizeof(htables));
+
+        /* SOI, APP0, COM, SOF0, DQT, DHT, SOS and EOI sections */
+        uint32_t bytes = 2 + 18 + 4 + strlen(COMMENT) + 10 + 3 * jpeg->nb_comps
+                       + 4 + 4 + 8 + 2 * jpeg->nb_comps + 2;
 
-        /*  Create all Huffman trees */
         for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
-                jpeg->htables[0][i] = create_huffman_tree(freqs[i][0], error);
-                jpeg->htables[1][i] = create_huffman_tree(freqs[i][1], error);
+
+                /* One quantification table per index */
+                if (!qtables[jpeg->comps[i].i_q]) {
+                        qtables[jpeg->comps[i].i_q] = true;
+                        bytes += 1 + BLOCK_SIZE;
+                }
+
+                /* One DC and one AC Huffman table per index */
+                for (uint8_t h = 0; h < 2; h++) {
+                        const uint8_t i_h = (h == 0) ? jpeg->comps[i].i_dc
+                                                     : jpeg->comps[i].i_ac;
+                        nb_values = 0;
+
+                        if (code_bits != NULL)
+                                bits += code_bits(freqs[i][h]);
+                        else
+                                bits += table_bits(jpeg->htables[h][i_h], freqs[i][h],
+                                                   &nb_values);
+
+                        /* Values end with their number of magnitude bits */
+                        for (uint16_t v = 0; v < 0x100; v++) {
+                                if (freqs[i][h][v] > 0) {
+                                        bits += (uint64_t)freqs[i][h][v] * (v & 0xF);
+
+                                        if (code_bits != NULL)
+                                                nb_values++;
+                                }
+                        }
+
+                        if (!htables[h][i_h]) {
+                                htables[h][i_h] = true;
+                                bytes += 1 + 16 + nb_values;
+                        }
+                }
+        }
+
+        /* DRI section, RSTn markers and each interval's padding bits */
+        if (jpeg->restart_interval > 0) {
+                const uint32_t nb_intervals = (jpeg->mcu.nb + jpeg->restart_interval - 1)
+                                            / jpeg->restart_interval;
+
+                bytes += 6 + 2 * (nb_intervals - 1);
+                bits += 4 * nb_intervals;
         }
+
+        /* About one 0xFF byte out of 256 is followed by a stuffed 0x00 */
+        const uint64_t data = (bits + 7) / 8;
+
+        return bytes + data + data / 0x100;
+}
+
+/*
+ * Computes the exact file size of the image at the current
+ * quantification tables, by writing it to memory
+ */
+static uint32_t packed_size(struct jpeg_data *jpeg, bool *error)
+{
+        uint32_t size = 0;
+        struct bitstream *stream = create_memory_bitstream(NULL);
+
+        if (stream == NULL) {
+                *error = true;
+                return 0;
+        }
+
+        compute_jpeg(jpeg, error);
+        write_header(stream, jpeg, error);
+        write_blocks(stream, jpeg, error);
+        write_section(stream, EOI, NULL, error);
+
+        memory_bitstream_data(stream, &size);
+        free_bitstream(stream);
+
+        return size;
+}
+
+/*
+ * Finds the lowest compression rate whose estimated file size fits
+ * in max_bytes, and sets its quantification tables. The image's DCT
+ * is only computed once : each try only quantifies the cached DCT
+ * coefficients again and counts their Huffman frequencies.
+ * The found rate is then written to memory, and raised
+ * until the real file size fits.
+ */
+void fit_jpeg_size(struct jpeg_data *jpeg, uint32_t max_bytes, bool *error)
+{
+        /* Sizes are estimated from sequential Huffman frequencies */
+        if (jpeg == NULL || *error || jpeg->transcoded || jpeg->progressive) {
+                *error = true;
+                return;
+        }
+
+        reserve_dct(jpeg, error);
+
+        if (*error)
+                return;
+
+        /* Compression rate 0 selects lossless frames, not a DCT rate */
+        int8_t low = 1, high = MAX_COMPRESSION;
+        int8_t best = MAX_COMPRESSION + 1;
+
+        /* Higher compression rates give smaller files */
+        while (low <= high && !*error) {
+                const uint8_t compression = (low + high) / 2;
+
+                for (uint8_t i = 0; i < jpeg->nb_comps; i++)
+                        default_qtable(jpeg->qtables[jpeg->comps[i].i_q], compression);
+
+                count_jpeg(jpeg, error);
+                jpeg->dct_cached = true;
+
+                if (estimate_size(jpeg, huffman_bits) <= max_bytes) {
+                        best = compression;
+                        high = compression - 1;
+                } else
+                        low = compression + 1;
+        }
+
+        /* Estimates only approximate the stuffed 0x00 bytes */
+        for (; best <= MAX_COMPRESSION && !*error; best++) {
+                for (uint8_t i = 0; i < jpeg->nb_comps; i++)
+                        default_qtable(jpeg->qtables[jpeg->comps[i].i_q], best);
+
+                if (packed_size(jpeg, error) <= max_bytes)
+                        break;
+        }
+
+        if (!*error && best > MAX_COMPRESSION) {
+                printf("ERROR : the image does not fit in %" PRIu32 " bytes\n", max_bytes);
+                *error = true;
+        }
+
+        /* Use the found compression rate */
+        if (!*error)
+                jpeg->compression = best;
+}
+
+/*
+ * Quickly estimates the JPEG file size, from the entropy of the
+ * values' frequencies instead of Huffman tables (or from the
+ * standard Huffman tables' code sizes when they are used)
+ */
+uint32_t estimate_jpeg(struct jpeg_data *jpeg, bool *error)
+{
+        /* Sizes are estimated from sequential Huffman frequencies */
+        if (jpeg == NULL || jpeg->progressive) {
+                *error = true;
+                return 0;
+        }
+
+        const bool standard_htables = jpeg->standard_htables;
+
+        /* Frequencies are always counted here */
+        jpeg->standard_htables = false;
+        count_jpeg(jpeg, error);
+        jpeg->standard_htables = standard_htables;
+
+        if (*error)
+                return 0;
+
+        if (standard_htables) {
+                set_standard_tables(jpeg, error);
+                return estimate_size(jpeg, NULL);
+        }
+
+        return estimate_size(jpeg, entropy_bits);
 }
 
 /* Writes a whole JPEG header */
 void write_header(struct bitstream *stream, struct jpeg_data *jpeg, bool *error)
 {
-        /* Write header data */
+        const bool progressive = (jpeg != NULL && jpeg->progressive);
+        const bool lossless = (jpeg != NULL && jpeg->lossless);
+
+        /* Write header data, JFIF implying YCbCr components */
         write_section(stream, SOI, jpeg, error);
-        write_section(stream, APP0, jpeg, error);
+
+        if (!lossless)
+                write_section(stream, APP0, jpeg, error);
+
         write_section(stream, COM, jpeg, error);
-        write_section(stream, SOF0, jpeg, error);
 
-        /* Write all Quantification tables */
-        write_section(stream, DQT, jpeg, error);
+        if (lossless)
+                write_section(stream, SOF3, jpeg, error);
+        else
+                write_section(stream, progressive ? SOF2 : SOF0, jpeg, error);
+
+        /* Write all Quantification tables, lossless frames have none */
+        if (!lossless)
+                write_section(stream, DQT, jpeg, error);
+
+        /* Write all Huffman tables, progressive scans write their own */
+        if (!progressive)
+                write_section(stream, DHT, jpeg, error);
 
-        /* Write all Huffman tables */
-        write_section(stream, DHT, jpeg, error);
+        /* Write the restart interval if any */
+        if (jpeg != NULL && jpeg->restart_interval > 0)
+                write_section(stream, DRI, jpeg, error);
 
         /* Write SOS data */
-        write_section(stream, SOS, jpeg, error);
+        if (!progressive)
+                write_section(stream, SOS, jpeg, error);
 }
 
 /* Writes a specific JPEG section */
@@ -271,6 +838,8 @@ void write_section(struct bitstream *stream, enum jpeg_section section,
                 break;
 
         case SOF0:
+        case SOF2:
+        case SOF3:
                 if (jpeg != NULL) {
                         const uint8_t accuracy = 8;
                         write_byte(stream, accuracy);
@@ -284,13 +853,19 @@ void write_section(struct bitstream *stream, enum jpeg_section section,
 
                         /* Write all component informations */
                         for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
-                                uint8_t i_c = i + 1;
                                 uint8_t i_q = jpeg->comps[i].i_q;
                                 uint8_t h_sampling_factor = jpeg->comps[i].nb_blocks_h;
                                 uint8_t v_sampling_factor = jpeg->comps[i].nb_blocks_v;
 
+                                /* Lossless samples are neither subsampled nor quantified */
+                                if (jpeg->lossless) {
+                                        i_q = 0;
+                                        h_sampling_factor = 1;
+                                        v_sampling_factor = 1;
+                                }
+
                                 /* Write component index */
-                                write_byte(stream, i_c);
+                                write_byte(stream, comp_id(jpeg, i));
 
 
                                 /* Write sampling factors */
@@ -350,15 +925,18 @@ void write_section(struct bitstream *stream, enum jpeg_section section,
         /* Start Of Scan */
         case SOS:
                 if (jpeg != NULL) {
+                        const struct scan *scan = jpeg->scan;
+                        const uint8_t nb_comps = (scan != NULL) ? scan->nb_comps
+                                                                : jpeg->nb_comps;
                         uint8_t i_c;
 
-                        write_byte(stream, jpeg->nb_comps);
+                        write_byte(stream, nb_comps);
 
                         /* Write component informations */
-                        for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
+                        for (uint8_t i = 0; i < nb_comps; i++) {
 
-                                i_c = jpeg->comp_order[i];
-                                write_byte(stream, i_c + 1);
+                                i_c = (scan != NULL) ? scan->comps[i] : jpeg->comp_order[i];
+                                write_byte(stream, comp_id(jpeg, i_c));
 
 
                                 /* Write Huffman table indexes */
@@ -370,15 +948,43 @@ void write_section(struct bitstream *stream, enum jpeg_section section,
                                 write_byte(stream, byte);
                         }
 
+                        /*
+                         * Lossless scans : predictor selection value,
+                         * no point transform
+                         */
+                        if (jpeg->lossless) {
+                                write_byte(stream, jpeg->predictor);
+                                write_byte(stream, 0x00);
+                                write_byte(stream, 0x00);
+                        }
+
+                        /* Write spectral selection and successive approximation */
+                        else if (scan != NULL) {
+                                write_byte(stream, scan->start);
+                                write_byte(stream, scan->end);
+                                write_byte(stream, (scan->high << 4) | (scan->low & 0xF));
+                        }
+
                         /* Write remaining SOS data */
-                        write_byte(stream, 0x00);
-                        write_byte(stream, 0x3F);
-                        write_byte(stream, 0x00);
+                        else {
+                                write_byte(stream, 0x00);
+                                write_byte(stream, 0x3F);
+                                write_byte(stream, 0x00);
+                        }
                 } else
                         *error = true;
 
                 break;
 
+        /* Define Restart Interval */
+        case DRI:
+                if (jpeg != NULL)
+                        write_short_BE(stream, jpeg->restart_interval);
+                else
+                        *error = true;
+
+                break;
+
         // case TEM:
         // case DNL:
         // case DHP:
@@ -400,50 +1006,430 @@ void write_section(struct bitstream *stream, enum jpeg_section section,
         seek_bitstream(stream, end_section);
 }
 
-/* Writes previously compressed JPEG data */
-void write_blocks(struct bitstream *stream, struct jpeg_data *jpeg, bool *error)
+/*
+ * Writes nb_mcus previously compressed MCUs from first_mcu,
+ * DC predictions starting from 0, then aligns the stream on a byte
+ */
+static void write_mcus(struct bitstream *stream, struct jpeg_data *jpeg,
+                       uint32_t first_mcu, uint32_t nb_mcus, uint32_t nb_mcu_blocks)
 {
-        if (stream == NULL || *error || jpeg == NULL || jpeg->state != ALL_OK) {
-                *error = true;
-                return;
-        }
-
-        uint8_t i_c;
-        uint32_t nb_mcu = jpeg->mcu.nb;
-        uint8_t nb_blocks_h, nb_blocks_v, nb_blocks;
-        int32_t *last_DC;
-        int32_t *block;
-        uint32_t block_idx = 0;
-
+        uint8_t i_c, i_dc, i_ac, nb_blocks;
+        int32_t last_DC[MAX_COMPS] = { 0 };
+        int32_t *block = &jpeg->mcu_data[first_mcu * nb_mcu_blocks * BLOCK_SIZE];
 
-        /* Write all compressed MCUs */
-        for (uint32_t i = 0; i < nb_mcu; i++) {
+        for (uint32_t m = 0; m < nb_mcus; m++) {
 
                 /* Write each component in the correct order */
                 for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
 
                         /* Retrieve component informations */
                         i_c = jpeg->comp_order[i];
-                        nb_blocks_h = jpeg->comps[i_c].nb_blocks_h;
-                        nb_blocks_v = jpeg->comps[i_c].nb_blocks_v;
-                        nb_blocks = nb_blocks_h * nb_blocks_v;
-                        last_DC = &jpeg->comps[i_c].last_DC;
+                        i_dc = jpeg->comps[i_c].i_dc;
+                        i_ac = jpeg->comps[i_c].i_ac;
+                        nb_blocks = jpeg->comps[i_c].nb_blocks_h
+                                  * jpeg->comps[i_c].nb_blocks_v;
 
-                        /* Write each MCU */
+                        /* Write each block */
                         for (uint8_t n = 0; n < nb_blocks; n++) {
-                                block = &jpeg->mcu_data[block_idx];
+                                pack_block(stream, jpeg->htables[0][i_dc], &last_DC[i_c],
+                                           jpeg->htables[1][i_ac], block, NULL);
+
+                                block += BLOCK_SIZE;
+                        }
+                }
+        }
+
+        /* Enforce last bits into the stream */
+        flush_bitstream(stream);
+}
+
+/*
+ * Restart intervals writing state,
+ * shared by all the pipeline stages
+ */
+struct interval_writer {
+        struct jpeg_data *jpeg;
+        struct bitstream *stream;
+
+        /* Number of blocks per MCU */
+        uint32_t nb_mcu_blocks;
+
+        /* Indicates that an interval could not be written */
+        bool error;
+};
+
+/*
+ * Entropy codes one restart interval into
+ * the slot's memory bitstream (parallel stage)
+ */
+static void process_interval(void *data, uint32_t row, void *slot, uint32_t worker)
+{
+        struct interval_writer *writer = data;
+        struct jpeg_data *jpeg = writer->jpeg;
+
+        const uint32_t first_mcu = row * jpeg->restart_interval;
+        uint32_t nb_mcus = jpeg->mcu.nb - first_mcu;
+
+        UNUSED(worker);
+
+        if (nb_mcus > jpeg->restart_interval)
+                nb_mcus = jpeg->restart_interval;
+
+        /* The slot's buffer is kept, only emptied */
+        struct bitstream *stream = create_memory_bitstream(slot);
+
+        write_mcus(stream, jpeg, first_mcu, nb_mcus, writer->nb_mcu_blocks);
+}
+
+/*
+ * Appends one restart interval to the JPEG file,
+ * after its RSTn marker (serial stage)
+ */
+static void store_interval(void *data, uint32_t row, void *slot)
+{
+        struct interval_writer *writer = data;
+        uint32_t size;
+        const uint8_t *interval = memory_bitstream_data(slot, &size);
+
+        if (interval == NULL) {
+                writer->error = true;
+                return;
+        }
+
+        if (row > 0) {
+                write_byte(writer->stream, SECTION_HEAD);
+                write_byte(writer->stream, RST0 + (row - 1) % NB_RST);
+        }
+
+        write_bytes(writer->stream, interval, size);
+}
+
+/*
+ * Default progressive scan scripts : DC first, low frequency AC,
+ * remaining AC then successive approximation refinements
+ */
+static const struct scan color_scans[] = {
+        { 3, { 0, 1, 2 }, 0,  0, 0, 1 },
+        { 1, { 0 },       1,  5, 0, 2 },
+        { 1, { 2 },       1, 63, 0, 1 },
+        { 1, { 1 },       1, 63, 0, 1 },
+        { 1, { 0 },       6, 63, 0, 2 },
+        { 1, { 0 },       1, 63, 2, 1 },
+        { 3, { 0, 1, 2 }, 0,  0, 1, 0 },
+        { 1, { 2 },       1, 63, 1, 0 },
+        { 1, { 1 },       1, 63, 1, 0 },
+        { 1, { 0 },       1, 63, 1, 0 }
+};
+
+static const struct scan gray_scans[] = {
+        { 1, { 0 }, 0,  0, 0, 1 },
+        { 1, { 0 }, 1,  5, 0, 2 },
+        { 1, { 0 }, 6, 63, 0, 2 },
+        { 1, { 0 }, 1, 63, 2, 1 },
+        { 1, { 0 }, 0,  0, 1, 0 },
+        { 1, { 0 }, 1, 63, 1, 0 }
+};
+
+/*
+ * Progressive scans writing state
+ */
+struct scan_writer {
+        struct jpeg_data *jpeg;
+
+        /* Number of blocks per MCU */
+        uint32_t nb_mcu_blocks;
+
+        /* Index of each component's first block in an MCU */
+        uint32_t first_block[MAX_COMPS];
+};
+
+/*
+ * Returns the compressed block of component i_c
+ * at (x, y), in blocks of this component
+ */
+static int32_t *scan_block(const struct scan_writer *writer, uint8_t i_c,
+                           uint32_t x, uint32_t y)
+{
+        const struct jpeg_data *jpeg = writer->jpeg;
+        const struct comp *comp = &jpeg->comps[i_c];
+
+        const uint32_t mcu = (y / comp->nb_blocks_v) * jpeg->mcu.nb_h
+                           + x / comp->nb_blocks_h;
+        const uint32_t n = writer->first_block[i_c]
+                         + (y % comp->nb_blocks_v) * comp->nb_blocks_h
+                         + x % comp->nb_blocks_h;
+
+        return &jpeg->mcu_data[(mcu * writer->nb_mcu_blocks + n) * BLOCK_SIZE];
+}
+
+/* Packs the bits of a block coded by the current progressive scan */
+static void pack_scan_block(struct bitstream *stream, struct jpeg_data *jpeg, uint8_t i_c,
+                            int32_t *pred_DC, struct eob_run *run, int32_t *block,
+                            uint32_t **freqs)
+{
+        const struct scan *scan = jpeg->scan;
+        struct huff_table *table_DC = jpeg->htables[0][i_c];
+        struct huff_table *table_AC = jpeg->htables[1][i_c];
+
+        if (scan->start == 0) {
+                if (scan->high == 0)
+                        pack_DC_first(stream, table_DC, pred_DC, scan->low, block, freqs);
+                else
+                        pack_DC_refine(stream, scan->low, block, freqs);
+        }
+        else if (scan->high == 0)
+                pack_AC_first(stream, table_AC, scan->start, scan->end, scan->low,
+                              run, block, freqs);
+        else
+                pack_AC_refine(stream, table_AC, scan->start, scan->end, scan->low,
+                               run, block, freqs);
+}
+
+/*
+ * Entropy codes the current progressive scan,
+ * only counting its Huffman values when freqs is not NULL
+ */
+static void pack_scan(struct bitstream *stream, const struct scan_writer *writer,
+                      uint32_t *(*freqs)[2])
+{
+        struct jpeg_data *jpeg = writer->jpeg;
+        const struct scan *scan = jpeg->scan;
+
+        int32_t last_DC[MAX_COMPS] = { 0 };
+        struct eob_run run;
+        uint8_t i_c = scan->comps[0];
+
+        run.length = 0;
+        run.nb_bits = 0;
+
+        /* Interleaved scans code whole MCUs */
+        uint32_t nb_units_h = jpeg->mcu.nb_h;
+        uint32_t nb_units_v = jpeg->mcu.nb_v;
+
+        /*
+         * Other scans code single blocks of their component,
+         * except the ones only padding the last MCUs
+         */
+        if (scan->nb_comps == 1) {
+                nb_units_h = blocks_per_dim(jpeg->comps[i_c].nb_blocks_h,
+                                            jpeg->mcu.h_dim, jpeg->width);
+                nb_units_v = blocks_per_dim(jpeg->comps[i_c].nb_blocks_v,
+                                            jpeg->mcu.v_dim, jpeg->height);
+        }
 
-                                pack_block(stream, jpeg->htables[0][i_c], last_DC,
-                                                     jpeg->htables[1][i_c], block, NULL);
+        for (uint32_t unit = 0; unit < nb_units_h * nb_units_v; unit++) {
+                const uint32_t x = unit % nb_units_h;
+                const uint32_t y = unit / nb_units_h;
 
-                                block_idx += BLOCK_SIZE;
+                /* Predictions and EOB runs restart after each RSTn marker */
+                if (unit > 0 && is_restart_mcu(jpeg, unit)) {
+                        flush_eob_run(stream, jpeg->htables[1][i_c], &run,
+                                      (freqs != NULL) ? freqs[i_c] : NULL);
+
+                        memset(last_DC, 0, sizeof(last_DC));
+
+                        if (freqs == NULL) {
+                                flush_bitstream(stream);
+
+                                write_byte(stream, SECTION_HEAD);
+                                write_byte(stream, RST0 + (unit / jpeg->restart_interval - 1)
+                                                          % NB_RST);
                         }
+                }
 
+                if (scan->nb_comps == 1) {
+                        pack_scan_block(stream, jpeg, i_c, &last_DC[i_c], &run,
+                                        scan_block(writer, i_c, x, y),
+                                        (freqs != NULL) ? freqs[i_c] : NULL);
+                        continue;
+                }
+
+                /* Write each block of each component of the MCU */
+                for (uint8_t j = 0; j < scan->nb_comps; j++) {
+                        const uint8_t nb_blocks_h = jpeg->comps[scan->comps[j]].nb_blocks_h;
+                        const uint8_t nb_blocks_v = jpeg->comps[scan->comps[j]].nb_blocks_v;
+
+                        i_c = scan->comps[j];
+
+                        for (uint8_t n = 0; n < nb_blocks_h * nb_blocks_v; n++)
+                                pack_scan_block(stream, jpeg, i_c, &last_DC[i_c], &run,
+                                                scan_block(writer, i_c,
+                                                           x * nb_blocks_h + n % nb_blocks_h,
+                                                           y * nb_blocks_v + n / nb_blocks_h),
+                                                (freqs != NULL) ? freqs[i_c] : NULL);
                 }
         }
 
-        /* Enforce last bits into the file */
-        flush_bitstream(stream);
+        flush_eob_run(stream, jpeg->htables[1][i_c], &run,
+                      (freqs != NULL) ? freqs[i_c] : NULL);
+
+        /* Enforce last bits into the stream */
+        if (freqs == NULL)
+                flush_bitstream(stream);
+}
+
+/*
+ * Writes all progressive scans of the scan script,
+ * each one after its own Huffman tables
+ */
+static void write_scans(struct bitstream *stream, struct jpeg_data *jpeg, bool *error)
+{
+        struct scan_writer writer;
+        uint32_t *(*freqs)[2] = jpeg->workspaces[0].freqs;
+        uint8_t i_c;
+
+        writer.jpeg = jpeg;
+        writer.nb_mcu_blocks = 0;
+
+        for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
+                i_c = jpeg->comp_order[i];
+
+                writer.first_block[i_c] = writer.nb_mcu_blocks;
+                writer.nb_mcu_blocks += jpeg->comps[i_c].nb_blocks_h
+                                      * jpeg->comps[i_c].nb_blocks_v;
+        }
+
+        if (jpeg->scans == NULL) {
+                jpeg->scans = (jpeg->nb_comps == 3) ? color_scans : gray_scans;
+                jpeg->nb_scans = (jpeg->nb_comps == 3)
+                               ? sizeof(color_scans) / sizeof(struct scan)
+                               : sizeof(gray_scans) / sizeof(struct scan);
+        }
+
+        for (uint8_t s = 0; s < jpeg->nb_scans && !*error; s++) {
+                const struct scan *scan = &jpeg->scans[s];
+
+                /* DC refinement scans have no Huffman table */
+                const bool coded = (scan->start > 0 || scan->high == 0);
+                const uint8_t type = (scan->start > 0);
+
+                bool used[MAX_HTABLES] = { false };
+
+                /* DC and AC coefficients are never mixed, AC scans hold one component */
+                if (scan->nb_comps == 0 || scan->nb_comps > jpeg->nb_comps
+                    || scan->start > scan->end || scan->end >= BLOCK_SIZE
+                    || (scan->start == 0 && scan->end != 0)
+                    || (scan->start > 0 && scan->nb_comps != 1)) {
+                        *error = true;
+                        break;
+                }
+
+                for (uint8_t j = 0; j < scan->nb_comps; j++) {
+                        if (scan->comps[j] >= jpeg->nb_comps)
+                                *error = true;
+                        else
+                                used[scan->comps[j]] = coded;
+                }
+
+                if (*error)
+                        break;
+
+                jpeg->scan = scan;
+
+                /* Count the scan's Huffman values */
+                for (uint8_t i = 0; i < MAX_COMPS; i++)
+                        for (uint8_t j = 0; j < 2; j++)
+                                memset(freqs[i][j], 0, 0x100 * sizeof(uint32_t));
+
+                pack_scan(NULL, &writer, freqs);
+
+                /*
+                 * Create this scan's Huffman trees, freeing
+                 * the other ones so that only these are written
+                 */
+                for (uint8_t i = 0; i < MAX_HTABLES; i++) {
+                        for (uint8_t h = 0; h < 2; h++) {
+                                struct huff_table **table = &jpeg->htables[h][i];
+
+                                if (h == type && used[i])
+                                        *table = create_huffman_tree(freqs[i][h], *table, error);
+
+                                else {
+                                        free_huffman_table(*table);
+                                        *table = NULL;
+                                }
+                        }
+                }
+
+                if (coded)
+                        write_section(stream, DHT, jpeg, error);
+
+                write_section(stream, SOS, jpeg, error);
+
+                if (!*error)
+                        pack_scan(stream, &writer, NULL);
+        }
+
+        jpeg->scan = NULL;
+}
+
+/* Writes previously compressed JPEG data */
+void write_blocks(struct bitstream *stream, struct jpeg_data *jpeg, bool *error)
+{
+        if (stream == NULL || *error || jpeg == NULL) {
+                *error = true;
+                return;
+        }
+
+        /* Lossless frames are written line by line */
+        if (jpeg->lossless) {
+                write_lossless(stream, jpeg, error);
+                return;
+        }
+
+        /* Progressive scans write their own Huffman tables */
+        if (jpeg->progressive) {
+                write_scans(stream, jpeg, error);
+                return;
+        }
+
+        if (jpeg->state != ALL_OK) {
+                *error = true;
+                return;
+        }
+
+        struct interval_writer writer;
+        uint32_t nb_threads = jpeg->nb_threads;
+
+        if (nb_threads == 0)
+                nb_threads = 1;
+
+        writer.jpeg = jpeg;
+        writer.stream = stream;
+        writer.nb_mcu_blocks = 0;
+        writer.error = false;
+
+        for (uint8_t i = 0; i < jpeg->nb_comps; i++)
+                writer.nb_mcu_blocks += jpeg->comps[i].nb_blocks_h * jpeg->comps[i].nb_blocks_v;
+
+
+        /* Without restart markers, write all MCUs as one segment */
+        if (jpeg->restart_interval == 0) {
+                write_mcus(stream, jpeg, 0, jpeg->mcu.nb, writer.nb_mcu_blocks);
+                return;
+        }
+
+
+        /* Entropy code restart intervals in parallel, writing them in order */
+        const uint32_t nb_intervals = (jpeg->mcu.nb + jpeg->restart_interval - 1)
+                                    / jpeg->restart_interval;
+
+        const uint32_t nb_slots = pipeline_nb_slots(nb_threads);
+        const struct pipeline_stages stages = { NULL, process_interval, store_interval };
+
+        void *slots[nb_slots];
+
+        /* Each slot's memory bitstream is kept for the next images */
+        if (!reserve_bitstreams(&jpeg->streams, &jpeg->nb_streams, nb_slots)) {
+                *error = true;
+                return;
+        }
+
+        for (uint32_t i = 0; i < nb_slots; i++)
+                slots[i] = jpeg->streams[i];
+
+        if (!run_pipeline(jpeg->pool, &stages, &writer, slots, nb_intervals, nb_threads) || writer.error)
+                *error = true;
 }
 
 /* Detects MCU informations from header data */
@@ -519,15 +1505,54 @@ static inline uint16_t mcu_per_dim(uint8_t mcu, uint16_t dim)
         return (dim % mcu) ? ++nb : nb;
 }
 
+/* Computes how many blocks of a component cover an image dimension */
+static inline uint32_t blocks_per_dim(uint8_t nb_blocks, uint8_t mcu_dim, uint16_t dim)
+{
+        const uint32_t comp_dim = (dim * nb_blocks + mcu_dim - 1) / mcu_dim;
+
+        return (comp_dim + BLOCK_DIM - 1) / BLOCK_DIM;
+}
+
 /* Frees all JPEG Huffman tables */
 void free_jpeg_data(struct jpeg_data *jpeg)
 {
         if (jpeg == NULL)
                 return;
 
-        for (uint8_t i = 0; i < 2; i++)
-                for (uint8_t j = 0; j < MAX_HTABLES; j++)
+        for (uint8_t i = 0; i < 2; i++) {
+                for (uint8_t j = 0; j < MAX_HTABLES; j++) {
                         free_huffman_table(jpeg->htables[i][j]);
+                        jpeg->htables[i][j] = NULL;
+                }
+        }
+}
+
+/* Frees all JPEG image buffers */
+void free_jpeg_buffers(struct jpeg_data *jpeg)
+{
+        if (jpeg == NULL)
+                return;
+
+        SAFE_FREE(jpeg->raw_data);
+        SAFE_FREE(jpeg->spare_data);
+        SAFE_FREE(jpeg->mcu_data);
+        SAFE_FREE(jpeg->dct_data);
+
+        SAFE_FREE(jpeg->scan_data);
+        SAFE_FREE(jpeg->offsets);
+
+        free_workspaces(&jpeg->workspaces, &jpeg->nb_workspaces);
+        free_bitstreams(&jpeg->streams, &jpeg->nb_streams);
+
+        free_thread_pool(jpeg->pool);
+        jpeg->pool = NULL;
+
+        jpeg->raw_capacity = 0;
+        jpeg->spare_capacity = 0;
+        jpeg->mcu_capacity = 0;
+        jpeg->dct_capacity = 0;
+        jpeg->scan_capacity = 0;
+        jpeg->offsets_capacity = 0;
 }
 
 
@@ -1,15 +1,27 @@
 
 #include "huffman.h"
 #include "common.h"
-#include "priority_queue.h"
 
 
+/*
+ * Maximum number of nodes in a decoding Huffman tree :
+ * at most 256 leaves, as many internal nodes
+ * and one incomplete node per code size
+ */
+#define MAX_NODES (2 * 0x100 + 0x20)
+
+/*
+ * Node index meaning "no child".
+ * The root (index 0) is never a child.
+ */
+#define NO_NODE 0
+
 /*
  * Internal node structure
  */
 struct node {
-        struct huff_table *left;
-        struct huff_table *right;
+        uint16_t left;
+        uint16_t right;
 };
 
 /*
@@ -23,9 +35,9 @@ enum node_type {
 };
 
 /*
- * Huffman table node structure
+ * Huffman tree node structure
  */
-struct huff_table {
+struct huff_node {
 
         /* Node type : NODE or LEAF */
         enum node_type type;
@@ -42,56 +54,177 @@ struct huff_table {
         } u;
 };
 
+/*
+ * Huffman table structure :
+ * the decoding tree nodes of loaded tables are stored
+ * in one arena, the root being the first node, and the
+ * canonical codes are stored in flat arrays for encoding.
+ */
+struct huff_table {
+
+        /* Number of used nodes (0 : no decoding tree) */
+        uint16_t nb_nodes;
+
+        /* Node arena (NULL : encoding only table) */
+        struct huff_node *nodes;
+
+        /* Number of codes of each size (1 to 16 bits) */
+        uint16_t nb_codes[16];
+
+        /* Values sorted by code size */
+        uint8_t values[0x100];
+        uint16_t nb_values;
+
+        /* Code and code size of each value (size 0 : no code) */
+        uint16_t codes[0x100];
+        uint8_t sizes[0x100];
+};
+
 
 /*
- * Creates a Huffman table node
+ * JPEG standard Huffman tables : number of codes
+ * per size, then values, for luminance and chrominance
+ * Source : ITU T.81, Annex K.3
+ */
+static const uint8_t std_nb_codes[2][2][16] = {
+        {
+                { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 },
+                { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 }
+        },
+        {
+                { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7D },
+                { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 }
+        }
+};
+
+static const uint8_t std_DC_values[12] = {
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B
+};
+
+static const uint8_t std_AC_values[2][162] = {
+        {
+                0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+                0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+                0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08,
+                0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0,
+                0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0A, 0x16,
+                0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28,
+                0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+                0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+                0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+                0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+                0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+                0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+                0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+                0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7,
+                0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6,
+                0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5,
+                0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4,
+                0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2,
+                0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA,
+                0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+                0xF9, 0xFA
+        },
+        {
+                0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
+                0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+                0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+                0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52, 0xF0,
+                0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34,
+                0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26,
+                0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38,
+                0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+                0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+                0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+                0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+                0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+                0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96,
+                0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5,
+                0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4,
+                0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3,
+                0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2,
+                0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+                0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9,
+                0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+                0xF9, 0xFA
+        }
+};
+
+
+/*
+ * Allocates an empty Huffman table,
+ * or empties the given one so that it can be reused.
+ */
+static struct huff_table *init_huffman_table(struct huff_table *table)
+{
+        if (table == NULL) {
+                table = malloc(sizeof(struct huff_table));
+
+                if (table != NULL)
+                        table->nodes = NULL;
+        }
+
+        if (table != NULL) {
+                table->nb_nodes = 0;
+                table->nb_values = 0;
+        }
+
+        return table;
+}
+
+/*
+ * Creates a Huffman table node in the table's arena
  * according to the "type" argument.
+ * Returns its index, or NO_NODE when the arena is full.
  */
-static struct huff_table* create_node(enum node_type type, uint32_t code,
-                                uint8_t size, int8_t val)
+static uint16_t create_node(struct huff_table *table, enum node_type type,
+                            uint32_t code, uint8_t size, int8_t val)
 {
-        struct huff_table *node = malloc(sizeof(struct huff_table));
+        if (table->nodes == NULL || table->nb_nodes >= MAX_NODES)
+                return NO_NODE;
 
-        if (node != NULL) {
-                node->type = type;
-                node->code = code;
-                node->size = size;
+        uint16_t index = table->nb_nodes++;
+        struct huff_node *node = &table->nodes[index];
 
-                if (type == NODE) {
-                        node->u.node.left = NULL;
-                        node->u.node.right = NULL;
-                }
-                else
-                        node->u.val = val;
+        node->type = type;
+        node->code = code;
+        node->size = size;
+
+        if (type == NODE) {
+                node->u.node.left = NO_NODE;
+                node->u.node.right = NO_NODE;
         }
+        else
+                node->u.val = val;
 
-        return node;
+        return index;
 }
 
 /*
  * Recursively adds a Huffman value to a Huffman tree.
  */
-static int8_t add_huffman_code(int8_t value, uint8_t code_size, struct huff_table *parent)
+static int8_t add_huffman_code(struct huff_table *table, int8_t value,
+                               uint8_t code_size, uint16_t parent)
 {
         int8_t error = 0;
+        struct huff_node *node = &table->nodes[parent];
 
 
         /*
          * If we attempt to insert
-         * a value on a leaf or a NULL pointer,
-         * return an error.
+         * a value on a leaf, return an error.
          */
-        if (parent == NULL || parent->type == LEAF)
+        if (node->type == LEAF)
                 error = 1;
 
         else {
-                uint32_t code = parent->code << 1;
-                uint8_t size = parent->size + 1;
+                uint32_t code = node->code << 1;
+                uint8_t size = node->size + 1;
 
-                struct huff_table **left, **right;
+                uint16_t *left, *right;
 
-                left = &parent->u.node.left;
-                right = &parent->u.node.right;
+                left = &node->u.node.left;
+                right = &node->u.node.right;
 
 
                 /*
@@ -99,11 +232,11 @@ static int8_t add_huffman_code(int8_t value, uint8_t code_size, struct huff_tabl
                  * add it as a new leaf.
                  */
                 if (code_size == 0) {
-                        if (*left == NULL)
-                                *left = create_node(LEAF, code, size, value);
+                        if (*left == NO_NODE)
+                                *left = create_node(table, LEAF, code, size, value);
 
-                        else if (*right == NULL)
-                                *right = create_node(LEAF, code + 1, size, value);
+                        else if (*right == NO_NODE)
+                                *right = create_node(table, LEAF, code + 1, size, value);
 
                         else
                                 error = -1;
@@ -114,16 +247,23 @@ static int8_t add_huffman_code(int8_t value, uint8_t code_size, struct huff_tabl
                  * create non-existant internal nodes
                  */
                 else {
-                        if (*left == NULL)
-                                *left = create_node(NODE, code, size, 0);
+                        if (*left == NO_NODE)
+                                *left = create_node(table, NODE, code, size, 0);
 
-                        error = add_huffman_code(value, code_size - 1, *left);
+                        /* Full arena */
+                        if (*left == NO_NODE)
+                                return -1;
+
+                        error = add_huffman_code(table, value, code_size - 1, *left);
 
                         if (error) {
-                                if (*right == NULL)
-                                        *right = create_node(NODE, code + 1, size, 0);
+                                if (*right == NO_NODE)
+                                        *right = create_node(table, NODE, code + 1, size, 0);
+
+                                if (*right == NO_NODE)
+                                        return -1;
 
-                                error = add_huffman_code(value, code_size - 1, *right);
+                                error = add_huffman_code(table, value, code_size - 1, *right);
                         }
                 }
         }
@@ -131,6 +271,29 @@ static int8_t add_huffman_code(int8_t value, uint8_t code_size, struct huff_tabl
         return error;
 }
 
+/*
+ * Computes the canonical code of each value
+ * from the number of codes per size
+ */
+static void compute_canonical_codes(struct huff_table *table)
+{
+        uint16_t code = 0;
+        uint16_t pos = 0;
+
+        memset(table->sizes, 0, sizeof(table->sizes));
+
+        /* Consecutive codes per size, shifted to the next size */
+        for (uint8_t i = 0; i < 16; i++) {
+                for (uint16_t j = 0; j < table->nb_codes[i]; j++) {
+                        table->codes[table->values[pos]] = code++;
+                        table->sizes[table->values[pos]] = i + 1;
+                        pos++;
+                }
+
+                code <<= 1;
+        }
+}
+
 /*
  * Loads a Huffman table from the input stream.
  */
@@ -162,10 +325,18 @@ struct huff_table *load_huffman_table(
                 return NULL;
 
         else {
-                /* Allocate the Huffman tree */
-                table = calloc(1, sizeof(struct huff_table));
+                /* Allocate the whole Huffman tree at once */
+                table = init_huffman_table(NULL);
                 if (table == NULL)
                         return NULL;
+
+                table->nodes = malloc(MAX_NODES * sizeof(struct huff_node));
+                if (table->nodes == NULL) {
+                        free_huffman_table(table);
+                        return NULL;
+                }
+
+                create_node(table, NODE, 0, 0, 0);
         }
 
         /*
@@ -173,12 +344,19 @@ struct huff_table *load_huffman_table(
          * with their corresponding size.
          */
         for (uint8_t i = 0; i < sizeof(code_sizes); ++i) {
+                table->nb_codes[i] = code_sizes[i];
+
                 for (uint8_t j = 0; j < code_sizes[i]; ++j) {
                         size_read += read_bitstream(stream, 8, &dest, false);
-                        add_huffman_code(dest & 0xFF, i, table);
+                        add_huffman_code(table, dest & 0xFF, i, 0);
+
+                        table->values[table->nb_values++] = dest & 0xFF;
                 }
         }
 
+        /* Also allow reencoding with the loaded table */
+        compute_canonical_codes(table);
+
         *nb_byte_read = size_read / 8;
 
 
@@ -192,70 +370,46 @@ int8_t next_huffman_value(struct huff_table *table,
                 struct bitstream *stream)
 {
         int8_t bit;
-        int8_t result = 0;
+        uint16_t index = 0;
         uint32_t dest;
 
+        if (table == NULL || table->nb_nodes == 0)
+                return 0;
+
+        const struct huff_node *nodes = table->nodes;
+
         /* Advance in the Huffman tree
          * according to each read stream bit
          * until a leaf is found */
-        while (table && table->type == NODE) {
+        while (nodes[index].type == NODE) {
                 read_bitstream(stream, 1, &dest, true);
                 bit = dest & 1;
 
                 /* Go right if it's a 1 */
                 if (bit)
-                        table = table->u.node.right;
+                        index = nodes[index].u.node.right;
 
                 /* Go left if it's a 0 */
                 else
-                        table = table->u.node.left;
-        }
+                        index = nodes[index].u.node.left;
 
-        if (table != NULL)
-                result = table->u.val;
+                /* Invalid code */
+                if (index == NO_NODE)
+                        return 0;
+        }
 
-        return result;
+        return nodes[index].u.val;
 }
 
 /*
- * Recursively frees a Huffman table.
+ * Frees a Huffman table and all its nodes.
  */
 void free_huffman_table(struct huff_table *table)
 {
-        if (table != NULL) {
-
-                /* If it's an internal node, free it recursively */
-                if (table->type == NODE) {
-                        free_huffman_table(table->u.node.left);
-                        free_huffman_table(table->u.node.right);
-                }
-
-                SAFE_FREE(table);
-        }
-}
-
-/*
- * Recursively finds the Huffman code for a given value.
- */
-static struct huff_table *get_huffman_code(int8_t value, struct huff_table *table)
-{
-        struct huff_table *code = NULL;
-
-        if (table != NULL) {
-
-                /* Recursively continue on internal nodes */
-                if (table->type == NODE) {
-                        code = get_huffman_code(value, table->u.node.left);
-
-                        if (code == NULL)
-                                code = get_huffman_code(value, table->u.node.right);
-
-                /* A leaf has been reached */
-                } else if (table->type == LEAF && value == table->u.val)
-                        code = table;
-        }
+        if (table != NULL)
+                SAFE_FREE(table->nodes);
 
-        return code;
+        SAFE_FREE(table);
 }
 
 /*
@@ -273,331 +427,347 @@ bool write_huffman_value(int8_t value, struct huff_table *table,
 
 
         int8_t bit;
-        bool success = false;
-
-        struct huff_table *leaf = get_huffman_code(value, table);
 
-        if (leaf != NULL) {
-                uint32_t code = leaf->code;
-                uint8_t size = leaf->size;
+        if (table == NULL || table->sizes[(uint8_t)value] == 0) {
+                printf("FATAL ERROR : no Huffman code for %d\n", value);
+                return false;
+        }
 
-                /* Write the value's code, bit per bit */
-                for (uint8_t i = 0; i < size; i++) {
-                        bit = (code >> (size - 1 - i)) & 1;
-                        write_bit(stream, bit, true);
-                }
+        const uint16_t code = table->codes[(uint8_t)value];
+        const uint8_t size = table->sizes[(uint8_t)value];
 
-                success = true;
+        /* Write the value's code, bit per bit */
+        for (uint8_t i = 0; i < size; i++) {
+                bit = (code >> (size - 1 - i)) & 1;
+                write_bit(stream, bit, true);
         }
-        else
-                printf("FATAL ERROR : no Huffman code for %d\n", value);
 
 
-        return success;
+        return true;
 }
 
 /*
- * Computes a whole tree's codes and sizes
+ * Value and frequency pair, to sort values by frequency
  */
-static void compute_huffman_codes(struct huff_table *parent, bool *error)
-{
-        if (parent != NULL && parent->type != LEAF && !*error) {
-                uint32_t code = parent->code << 1;
-                uint8_t size = parent->size + 1;
-
-                /*
-                 * The package-merge Huffman construction
-                 * algorithm could improve this
-                 */
-                if (size > 16) {
-                        printf("Unable to create Huffman tree, try a higher compression rate\n");
-                        *error = true;
-                        return;
-                }
-
-                struct huff_table **left, **right;
-
-                left = &parent->u.node.left;
-                right = &parent->u.node.right;
-
-
-                /* Compute left child's codes / sizes */
-                if (*left != NULL) {
-                        (*left)->code = code;
-                        (*left)->size = size;
-
-                        compute_huffman_codes(*left, error);
-                }
-
-                /* Compute right child's codes / sizes */
-                if (*right != NULL) {
-                        (*right)->code = code | 1;
-                        (*right)->size = size;
-
-                        compute_huffman_codes(*right, error);
-                }
-        }
-}
+struct huff_weight {
+        uint64_t freq;
+        uint16_t val;
+};
 
 /*
- * Deletes a specific node from the tree.
+ * Sorts values by increasing frequency,
+ * then by decreasing value for equal frequencies
  */
-static void delete_node(struct huff_table **table, struct huff_table *target)
+static int compare_weights(const void *a, const void *b)
 {
-        if (table != NULL && *table != NULL) {
+        const struct huff_weight *w1 = a;
+        const struct huff_weight *w2 = b;
 
-                /* Once the target is found, delete it */
-                if (*table == target) {
-                        free_huffman_table(*table);
-                        *table = NULL;
+        if (w1->freq != w2->freq)
+                return (w1->freq < w2->freq) ? -1 : 1;
 
-                /* Once the node is found, delete it */
-                } else if ((*table)->type == NODE) {
-
-                        delete_node(&(*table)->u.node.left, target);
-                        delete_node(&(*table)->u.node.right, target);
-                }
-        }
+        return (int)w2->val - (int)w1->val;
 }
 
 /*
- * Creates a Huffman tree according
- * to given input frequencies.
+ * Computes the code size of each value (0 when unused),
+ * limited to 16 bits as JPEG requires (Annex K.2),
+ * and the number of codes per size.
+ * Returns the number of values.
  */
-struct huff_table *create_huffman_tree(uint32_t freqs[0x100], bool *error)
+static uint16_t compute_code_sizes(const uint32_t freqs[0x100], uint8_t sizes[0x100],
+                                   uint16_t nb_codes[16])
 {
-        if (error != NULL && *error)
-                return NULL;
+        /* All used values plus a reserved one */
+        struct huff_weight weights[0x100 + 1];
+        uint16_t counts[0x100 + 1];
+        uint16_t n = 0;
 
-        /* Create a priority queue */
-        struct priority_queue *queue = create_queue(0x100);
-        struct huff_table *node = NULL, *fake = NULL;
-
-        if (queue == NULL)
-                return NULL;
+        memset(sizes, 0, 0x100 * sizeof(uint8_t));
+        memset(nb_codes, 0, 16 * sizeof(uint16_t));
+        memset(counts, 0, sizeof(counts));
 
         /*
          * Null frequency value ensuring
          * no single code has only ones.
          * Indeed, libjpeg does not allow such a code.
          */
-        fake = create_node(LEAF, 0, 0, 0);
-        insert_queue(queue, 0, fake);
+        weights[n].freq = 0;
+        weights[n++].val = 0x100;
 
-        /* Insert all values to the queue */
         for (uint16_t val = 0; val < 0x100; val++) {
                 if (freqs[val] > 0) {
-                        node = create_node(LEAF, 0, 0, val);
-                        insert_queue(queue, freqs[val], node);
+                        weights[n].freq = freqs[val];
+                        weights[n++].val = val;
                 }
         }
 
-        struct huff_table *tree = NULL;
-        struct huff_table *child0 = NULL;
-        struct huff_table *child1 = NULL;
-        bool status = true;
-        uint32_t p1, p2;
+        if (n == 1)
+                return 0;
+
+        qsort(weights, n, sizeof(struct huff_weight), compare_weights);
+
 
+        /*
+         * In place Huffman code sizes computation on
+         * the sorted frequencies (Moffat and Katajainen) :
+         * first merge the two lightest trees, the parent
+         * of each tree replacing its frequency...
+         */
+        uint16_t leaf = 0, root = 0;
+
+        for (uint16_t next = 0; next < n - 1; next++) {
+                if (leaf >= n || (root < next && weights[root].freq < weights[leaf].freq)) {
+                        weights[next].freq = weights[root].freq;
+                        weights[root++].freq = next;
+                } else
+                        weights[next].freq = weights[leaf++].freq;
+
+                if (leaf >= n || (root < next && weights[root].freq < weights[leaf].freq)) {
+                        weights[next].freq += weights[root].freq;
+                        weights[root++].freq = next;
+                } else
+                        weights[next].freq += weights[leaf++].freq;
+        }
 
-        /* Huffman tree construction */
-        while (status) {
-                status = best_queue(queue, &p1, &child0);
+        /* ... then compute the internal nodes' depths ... */
+        weights[n - 2].freq = 0;
 
-                /* If there's a minimal priority tree */
-                if (status) {
-                        delete_queue(queue);
-                        status = best_queue(queue, &p2, &child1);
+        for (int32_t next = n - 3; next >= 0; next--)
+                weights[next].freq = weights[weights[next].freq].freq + 1;
+
+        /* ... and count the leaves of each depth */
+        int32_t avail = 1, used = 0, depth = 0;
+        int32_t next = n - 2;
+
+        while (avail > 0) {
+                while (next >= 0 && (int32_t)weights[next].freq == depth) {
+                        used++;
+                        next--;
                 }
 
-                /* If there's a new minimal priority tree */
-                if (status) {
-                        delete_queue(queue);
+                while (avail > used) {
+                        counts[depth]++;
+                        avail--;
+                }
 
+                avail = 2 * used;
+                used = 0;
+                depth++;
+        }
 
-                        node = create_node(NODE, 0, 0, 0);
 
-                        if (node != NULL) {
+        /*
+         * Limit code sizes to 16 bits : the prefix of two longest
+         * codes becomes one code, and a shorter code is split
+         */
+        for (uint16_t i = 0x100; i > 16; i--) {
+                while (counts[i] > 0) {
+                        uint16_t j = i - 2;
 
-                                node->u.node.left = child0;
-                                node->u.node.right = child1;
+                        while (counts[j] == 0)
+                                j--;
 
-                                /* Fuse both trees before adding them to the queue */
-                                insert_queue(queue, p1 + p2, node);
-                        } else
-                                break;
+                        counts[i] -= 2;
+                        counts[i - 1]++;
+                        counts[j + 1] += 2;
+                        counts[j]--;
                 }
-
-                /*
-                * Else, the Huffman tree is
-                * the last extracted one : child0
-                */
-                else
-                        tree = child0;
         }
 
-        /* Free the priority queue */
-        free_queue(queue);
 
-        /* Delete the fake node ensuring no code has only ones */
-        delete_node(&tree, fake);
+        /* Remove the reserved value's code, which is the longest one */
+        uint8_t size = 16;
+
+        while (counts[size] == 0)
+                size--;
 
+        counts[size]--;
 
-        /* Compute the final tree's codes and sizes */
-        compute_huffman_codes(tree, error);
 
+        /*
+         * Most frequent values get the shortest codes,
+         * the reserved value (first) getting none
+         */
+        int32_t pos = n - 1;
+
+        for (uint8_t i = 1; i <= 16; i++) {
+                nb_codes[i - 1] = counts[i];
 
-        return tree;
+                for (uint16_t j = 0; j < counts[i]; j++)
+                        sizes[weights[pos--].val] = i;
+        }
+
+        return n - 1;
 }
 
 /*
- * Retrieves all Huffman values per size.
+ * Creates a Huffman table according to given input
+ * frequencies, with canonical codes of at most 16 bits.
+ * The given table is reused when not NULL.
  */
-static void forge_huffman_values(struct huff_table *table, uint8_t **values,
-                          uint8_t *pos, uint8_t code_sizes[16])
+struct huff_table *create_huffman_tree(uint32_t freqs[0x100],
+                                       struct huff_table *table, bool *error)
 {
-        if (table != NULL) {
+        if (error != NULL && *error)
+                return table;
 
-                /* Retrieve each leaf */
-                if (table->type == LEAF){
-                        uint8_t i = table->size - 1;
+        table = init_huffman_table(table);
 
-                        /* Overflow check */
-                        if (pos[i] < code_sizes[i]) {
-                                values[i][pos[i]] = table->u.val;
-                                ++pos[i];       
-                        }
-                }
+        if (table == NULL)
+                return NULL;
 
-                /* Recursively retrieve each node's values */
-                else if (table->type == NODE) {
-                        forge_huffman_values(table->u.node.left, values, pos, code_sizes);
-                        forge_huffman_values(table->u.node.right, values, pos, code_sizes);
-                }
-        }
+        uint8_t sizes[0x100];
+        uint16_t pos[16];
+
+        table->nb_values = compute_code_sizes(freqs, sizes, table->nb_codes);
+
+
+        /* Sort values by code size, then by value */
+        pos[0] = 0;
+
+        for (uint8_t i = 1; i < 16; i++)
+                pos[i] = pos[i - 1] + table->nb_codes[i - 1];
+
+        for (uint16_t val = 0; val < 0x100; val++)
+                if (sizes[val] > 0)
+                        table->values[pos[sizes[val] - 1]++] = val;
+
+
+        /* Compute the canonical codes of all values */
+        compute_canonical_codes(table);
+
+
+        return table;
 }
 
 /*
- * Counts how many codes of each size there are.
+ * Creates a JPEG standard Huffman table :
+ * type 0 for DC, 1 for AC, and index 0 for
+ * luminance, 1 for chrominance.
+ * The given table is reused when not NULL.
  */
-static void count_code_sizes(struct huff_table *table, uint8_t *code_sizes)
+struct huff_table *create_standard_table(uint8_t type, uint8_t index,
+                                         struct huff_table *table)
 {
-        if (table != NULL) {
+        if (type > 1 || index > 1)
+                return table;
 
-                /* Count each leaf */
-                if (table->type == LEAF) {
-                        uint8_t i = table->size - 1;
+        table = init_huffman_table(table);
 
-                        if (i < 16)
-                                ++code_sizes[i];
-                }
+        if (table == NULL)
+                return NULL;
+
+        const uint8_t *values = (type == 0) ? std_DC_values : std_AC_values[index];
 
-                /* Recursively count all nodes */
-                else if (table->type == NODE) {
-                        count_code_sizes(table->u.node.left, code_sizes);
-                        count_code_sizes(table->u.node.right, code_sizes);
+        for (uint8_t i = 0; i < 16; i++) {
+                table->nb_codes[i] = std_nb_codes[type][index][i];
+
+                for (uint8_t j = 0; j < table->nb_codes[i]; j++) {
+                        table->values[table->nb_values] = values[table->nb_values];
+                        table->nb_values++;
                 }
         }
+
+        /* Compute the canonical codes of all values */
+        compute_canonical_codes(table);
+
+        return table;
 }
 
 /*
- * Writes a Huffman table into the stream.
+ * Computes the size in bits of all the values coded with a
+ * given table, and the number of values it defines
  */
-void write_huffman_table(struct bitstream *stream, struct huff_table **itable)
+uint64_t table_bits(const struct huff_table *table, const uint32_t freqs[0x100],
+                    uint16_t *nb_values)
 {
-        if (itable == NULL || *itable == NULL)
-                return;
-
-        uint8_t code_sizes[16];
-        uint16_t nb_codes = 0;
-        struct huff_table *table = *itable;
-
-        /* Set all code sizes to 0 */
-        memset(code_sizes, 0, sizeof(code_sizes));
-
-        /* Count how many codes of each size there are. */
-        count_code_sizes(table, code_sizes);
-
-        /* Count how many codes there are */
-        for (uint8_t i = 0; i < sizeof(code_sizes); ++i)
-                nb_codes += code_sizes[i];
+        uint64_t bits = 0;
 
+        if (table == NULL)
+                return 0;
 
-        /* There must be less than 256 different codes */
-        if (nb_codes > 256) {
-                printf("ERROR : more than 256 codes : %d\n", nb_codes);
-                return;
-        }
-
+        for (uint16_t val = 0; val < 0x100; val++)
+                bits += (uint64_t)freqs[val] * table->sizes[val];
 
-        /* Huffman values to write */
-        uint8_t *values[16];
+        if (nb_values != NULL)
+                *nb_values = table->nb_values;
 
-        /* Code size indexes (for computation) */
-        uint8_t pos[16];
+        return bits;
+}
 
-        /* Set all indexes to 0 */
-        memset(pos, 0, sizeof(pos));
+/* Copies the code size of each value of a table (0 : no code) */
+void table_code_sizes(const struct huff_table *table, uint8_t sizes[0x100])
+{
+        if (table == NULL)
+                memset(sizes, 0, 0x100);
+        else
+                memcpy(sizes, table->sizes, 0x100);
+}
 
-        /* Allocate enough space for each Huffman value */
-        for (uint8_t i = 0; i < sizeof(code_sizes); ++i)
-                values[i] = calloc(1, code_sizes[i]);
+/*
+ * Computes the size in bits of all the values coded with
+ * the Huffman code create_huffman_tree would give them,
+ * without building a whole table.
+ */
+uint64_t huffman_bits(const uint32_t freqs[0x100])
+{
+        uint8_t sizes[0x100];
+        uint16_t nb_codes[16];
+        uint64_t bits = 0;
 
+        compute_code_sizes(freqs, sizes, nb_codes);
 
-        /* Retrieve all Huffman values to write them in the correct order */
-        forge_huffman_values(table, values, pos, code_sizes);
+        for (uint16_t val = 0; val < 0x100; val++)
+                bits += (uint64_t)freqs[val] * sizes[val];
 
-        /*
-         * Free the previous Huffman tree
-         * (the previous generated one's codes are incorrectly ordered)
-         */
-        free_huffman_table(table);
+        return bits;
+}
 
+/*
+ * Writes a Huffman table into the stream.
+ */
+void write_huffman_table(struct bitstream *stream, struct huff_table **itable)
+{
+        if (itable == NULL || *itable == NULL)
+                return;
 
-        /* Rewrite the Huffman tree correctly,
-         * with smallest codes on the left */
-        table = calloc(1, sizeof(struct huff_table));
-        *itable = table;
+        struct huff_table *table = *itable;
 
 
         /* Write the number of Huffman codes per size */
-        for (uint8_t i = 0; i < sizeof(code_sizes); i++)
-                write_byte(stream, code_sizes[i]);
+        for (uint8_t i = 0; i < 16; i++)
+                write_byte(stream, table->nb_codes[i]);
 
 
         /* Write all Huffman values in the right order */
-        for (uint8_t i = 0; i < sizeof(code_sizes); ++i) {
-                for (uint8_t j = 0; j < code_sizes[i]; ++j) {
-                        write_byte(stream, values[i][j]);
-                        add_huffman_code(values[i][j], i, table);
-                }
-        }
-
-        /* Free allocated memory */
-        for (uint8_t i = 0; i < sizeof(code_sizes); ++i)
-                SAFE_FREE(values[i]);
+        for (uint16_t i = 0; i < table->nb_values; ++i)
+                write_byte(stream, table->values[i]);
 }
 
 
 /*
  * Recursive dot export procedure.
  */
-void huffman_export_rec(FILE *file, struct huff_table *table, uint32_t *index)
+void huffman_export_rec(FILE *file, struct huff_table *table,
+                        uint16_t node, uint32_t *index)
 {
-        if (table != NULL && index) {
+        if (node != NO_NODE && index) {
                 uint32_t cur = *index + 1;
+                struct huff_node *current = &table->nodes[node];
 
                 *index = cur;
 
                 fprintf(file, " -- %u", cur);
 
-                if (table->type == LEAF) {
+                if (current->type == LEAF) {
                         fprintf(file, "    %u [label=\"%u : %02X => %2X\"]\n", cur,
-                                table->size, table->code, (uint8_t)table->u.val);
+                                current->size, current->code, (uint8_t)current->u.val);
                 } else {
-                        huffman_export_rec(file, table->u.node.left, index);
-                        fprintf(file, "    %u [label=\"%02X\"]\n", cur, table->code);
+                        huffman_export_rec(file, table, current->u.node.left, index);
+                        fprintf(file, "    %u [label=\"%02X\"]\n", cur, current->code);
                         fprintf(file, "    %u", cur);
-                        huffman_export_rec(file, table->u.node.right, index);
+                        huffman_export_rec(file, table, current->u.node.right, index);
                 }
         } else {
                 fprintf(file, "\n");
@@ -616,25 +786,47 @@ void huffman_export(char *dest, struct huff_table *table)
 
         file = fopen(dest, "w");
 
-        if (table != NULL && file != NULL) {
+        if (table != NULL && table->nb_nodes > 0 && file != NULL) {
+                struct huff_node *root = &table->nodes[0];
+
                 fprintf(file, "\ngraph {\n");
 
-                if (table->type == LEAF) {
+                if (root->type == LEAF) {
                         fprintf(file, "    %u [label=\"%i\"]\n",
-                                cur, table->u.val);
+                                cur, root->u.val);
                 } else {
                         fprintf(file, "    %u \n", cur);
                         fprintf(file, "    %u [label=\"ε\"]\n", cur);
+
+                        fprintf(file, "    %u", cur);
+                        huffman_export_rec(file, table, root->u.node.left, &index);
+                        fprintf(file, "    %u", cur);
+                        huffman_export_rec(file, table, root->u.node.right, &index);
                 }
 
-                fprintf(file, "    %u", cur);
-                huffman_export_rec(file, table->u.node.left, &index);
-                fprintf(file, "    %u", cur);
-                huffman_export_rec(file, table->u.node.right, &index);
                 fprintf(file, "}\n\n");
+        }
 
+        if (file != NULL)
                 fclose(file);
-        }
 }
 
+/*
+ * Approximates the size in bits of all the values from their
+ * frequencies' entropy, without building any Huffman code
+ * (each value being at least 1 bit long).
+ */
+uint64_t entropy_bits(const uint32_t freqs[0x100])
+{
+        uint64_t total = 0;
+        double bits = 0;
 
+        for (uint16_t val = 0; val < 0x100; val++)
+                total += freqs[val];
+
+        for (uint16_t val = 0; val < 0x100; val++)
+                if (freqs[val] > 0)
+                        bits += freqs[val] * fmax(1.0, log2((double)total / freqs[val]));
+
+        return (uint64_t)ceil(bits);
+}
@@ -2,6 +2,7 @@
 #include "library.h"
 #include "decode.h"
 #include "tiff.h"
+#include "pipeline.h"
 #include <unistd.h>
 #include <getopt.h>
 
@@ -182,6 +183,94 @@ static uint8_t affect_mcu(uint32_t val, bool *error)
         return dim;
 }
 
+/*
+ * Removes the name long option from argv, so that getopt
+ * only parses short options. When value is not NULL,
+ * the option's value follows it (NULL if missing).
+ * Returns true if the option was found.
+ */
+static bool extract_option(int *argc, char **argv, const char *name, char **value)
+{
+        for (int i = 1; i < *argc; i++) {
+
+                if (strcmp(argv[i], name) != 0)
+                        continue;
+
+                int nb_args = 1;
+
+                if (value != NULL) {
+                        *value = (i + 1 < *argc) ? argv[i + 1] : NULL;
+
+                        if (*value != NULL)
+                                nb_args++;
+                }
+
+                /* Shift the next arguments */
+                for (int j = i; j + nb_args <= *argc; j++)
+                        argv[j] = argv[j + nb_args];
+
+                *argc -= nb_args;
+
+                return true;
+        }
+
+        return false;
+}
+
+/*
+ * Parses a "x,y,width,height" region into *region.
+ * Returns true on error.
+ */
+static bool parse_region(char *text, struct region *region)
+{
+        uint32_t values[4];
+        char *next = text;
+
+        for (uint8_t i = 0; i < 4; i++) {
+                char *start = next;
+                unsigned long val = strtoul(start, &next, 10);
+
+                if (next == start || val > UINT32_MAX || *next != (i < 3 ? ',' : 0))
+                        return true;
+
+                values[i] = val;
+                next++;
+        }
+
+        region->x = values[0];
+        region->y = values[1];
+        region->width = values[2];
+        region->height = values[3];
+
+        return region->width == 0 || region->height == 0;
+}
+
+/*
+ * Parses a lossless transform name into *transform.
+ * Returns true on error.
+ */
+static bool parse_transform(char *text, enum transform *transform)
+{
+        static const char *names[] = {
+                [FLIP_H] = "flip_h",
+                [FLIP_V] = "flip_v",
+                [TRANSPOSE] = "transpose",
+                [TRANSVERSE] = "transverse",
+                [ROTATE_90] = "rot90",
+                [ROTATE_180] = "rot180",
+                [ROTATE_270] = "rot270"
+        };
+
+        for (uint8_t i = FLIP_H; i <= ROTATE_270; i++) {
+                if (!strcmp(text, names[i])) {
+                        *transform = i;
+                        return false;
+                }
+        }
+
+        return true;
+}
+
 /*
  * Parses arguments given to the program and puts them in *options
  */
@@ -197,18 +286,83 @@ bool parse_args(int argc, char **argv, struct options *options)
         uint8_t mcu_h = DEFAULT_MCU_WIDTH;
         uint8_t mcu_v = DEFAULT_MCU_HEIGHT;
         bool gray = false;
+        bool progressive = false;
 
 
         int opt;
         char *i_comp = NULL;
         char *i_mcu = NULL;
+        char *i_threads = NULL;
+        char *i_restart = NULL;
+        char *i_crop = NULL;
+        char *i_transform = NULL;
+        char *i_max_bytes = NULL;
+        char *i_quality = NULL;
+        char *i_predictor = NULL;
+
+
+        /* Region of interest detection (before getopt, -c being an option) */
+        memset(&options->crop, 0, sizeof(options->crop));
+
+        if (extract_option(&argc, argv, "-crop", &i_crop)
+            && (i_crop == NULL || parse_region(i_crop, &options->crop)))
+                error = true;
+
+        /* Lossless transform detection */
+        options->transform = TRANSFORM_NONE;
+
+        if (extract_option(&argc, argv, "-transform", &i_transform)
+            && (i_transform == NULL || parse_transform(i_transform, &options->transform)))
+                error = true;
+
+        /* Huffman tables optimization detection */
+        options->optimize_only = extract_option(&argc, argv, "--optimize-only", NULL);
+
+        /* DCT domain requantization detection */
+        options->requantize = extract_option(&argc, argv, "--requantize", NULL);
+
+        /* DCT domain downscaling detection */
+        options->half_size = extract_option(&argc, argv, "--half-size", NULL);
+
+        if (options->optimize_only && (options->requantize || options->half_size))
+                error = true;
+
+        /* File size limit detection */
+        options->max_bytes = 0;
+
+        if (extract_option(&argc, argv, "--max-bytes", &i_max_bytes)) {
+                int32_t val = get_value(i_max_bytes, &error);
+
+                if (!error && val > 0)
+                        options->max_bytes = val;
+                else
+                        error = true;
+        }
+
+        /* Size estimation detection */
+        options->estimate = extract_option(&argc, argv, "--estimate", NULL);
+
+        /* Trellis quantification detection */
+        options->trellis = extract_option(&argc, argv, "--trellis", NULL);
+
+        /* Lossless predictor detection */
+        options->predictor = DEFAULT_PREDICTOR;
+
+        if (extract_option(&argc, argv, "--predictor", &i_predictor)) {
+                int32_t val = get_value(i_predictor, &error);
+
+                if (!error && 1 <= val && val <= 7)
+                        options->predictor = val;
+                else
+                        error = true;
+        }
 
 
         /* Disable default warnings */
         opterr = 0;
 
         /* Parse all arguments */
-        while ( (opt = getopt(argc, argv, "o:c:m:ghd")) != -1) {
+        while ( (opt = getopt(argc, argv, "o:c:q:m:t:r:pghd")) != -1) {
 
                 switch (opt) {
                         case 'o':
@@ -219,6 +373,10 @@ bool parse_args(int argc, char **argv, struct options *options)
                                 i_comp = optarg;
                                 break;
 
+                        case 'q':
+                                i_quality = optarg;
+                                break;
+
                         case 'm':
                                 i_mcu = optarg;
                                 break;
@@ -234,6 +392,18 @@ bool parse_args(int argc, char **argv, struct options *options)
                         case 'd':
                                 encode = false;
                                 break;
+
+                        case 't':
+                                i_threads = optarg;
+                                break;
+
+                        case 'r':
+                                i_restart = optarg;
+                                break;
+
+                        case 'p':
+                                progressive = true;
+                                break;
                 }
         }
 
@@ -243,13 +413,55 @@ bool parse_args(int argc, char **argv, struct options *options)
                 int32_t val = get_value(i_comp, &error);
 
                 if (!error) {
-                        if (0 <= val && val <= 25)
+                        if (0 <= val && val <= MAX_COMPRESSION)
                                 compression = val;
                         else
                                 error = true;
                 }
         }
 
+        /* Standard tables quality detection */
+        options->quality = 0;
+
+        if (i_quality != NULL) {
+                int32_t val = get_value(i_quality, &error);
+
+                if (!error) {
+                        if (1 <= val && val <= 100)
+                                options->quality = val;
+                        else
+                                error = true;
+                }
+        }
+
+        /* Number of threads detection */
+        options->nb_threads = default_nb_threads();
+
+        if (i_threads != NULL) {
+                int32_t val = get_value(i_threads, &error);
+
+                if (!error) {
+                        if (val >= 1)
+                                options->nb_threads = val;
+                        else
+                                error = true;
+                }
+        }
+
+        /* Restart interval detection */
+        options->restart_interval = 0;
+
+        if (i_restart != NULL) {
+                int32_t val = get_value(i_restart, &error);
+
+                if (!error) {
+                        if (0 <= val && val <= UINT16_MAX)
+                                options->restart_interval = val;
+                        else
+                                error = true;
+                }
+        }
+
         /* New MCU size detection */
         if (i_mcu != NULL) {
                 uint32_t h_val;
@@ -278,8 +490,51 @@ bool parse_args(int argc, char **argv, struct options *options)
         }
 
 
-        /* If no input / output file, error */
-        if (input == NULL || output == NULL)
+        /* If no input / output file, error (estimations write no file) */
+        if (input == NULL || (output == NULL && !options->estimate))
+                error = true;
+
+        /*
+         * When encoding, crops, transforms, downscaling, requantization and
+         * Huffman tables optimization apply to the coefficients of a JPEG input
+         */
+        const bool transcode = options->optimize_only || options->requantize
+                             || options->half_size
+                             || options->transform != TRANSFORM_NONE
+                             || (encode && options->crop.width > 0);
+
+        if (transcode && (!encode || gray || !is_valid_jpeg(input)))
+                error = true;
+
+        /* Size limits search the compression rate of a decoded image */
+        if (options->max_bytes > 0 && (transcode || !encode || progressive))
+                error = true;
+
+        /* Standard tables apply to the encoding of a decoded image */
+        if (options->quality > 0 && (transcode || !encode || options->max_bytes > 0))
+                error = true;
+
+        /* Estimations predict sequential JPEG sizes */
+        if (options->estimate && (!encode || progressive || options->max_bytes > 0))
+                error = true;
+
+        /*
+         * Lossless frames (compression rate 0) are one sequential
+         * scan of a decoded image, without any quantification
+         */
+        const bool lossless = encode && !transcode && compression == 0;
+
+        if (lossless && (progressive || options->quality > 0 || options->max_bytes > 0
+                         || options->estimate || options->trellis
+                         || options->restart_interval > 0))
+                error = true;
+
+        if (i_predictor != NULL && !lossless)
+                error = true;
+
+        /* Trellis quantification applies to a decoded image's coefficients */
+        if (options->trellis && (transcode || !encode || options->max_bytes > 0
+                                 || options->estimate))
                 error = true;
 
 
@@ -302,22 +557,67 @@ bool parse_args(int argc, char **argv, struct options *options)
 
         options->compression = compression;
         options->gray = gray;
+        options->progressive = progressive;
         options->encode = encode;
 
 
         return error;
 }
 
+/*
+ * Ensures a buffer holds at least size bytes.
+ * The buffer is only reallocated when it must grow,
+ * and freed on allocation failure (NULL is then returned).
+ */
+void *reserve_buffer(void *buffer, uint32_t *capacity, uint32_t size)
+{
+        if (capacity == NULL)
+                return NULL;
+
+        if (buffer == NULL || *capacity < size) {
+                void *bigger = realloc(buffer, size);
+
+                if (bigger == NULL) {
+                        SAFE_FREE(buffer);
+                        *capacity = 0;
+                } else
+                        *capacity = size;
+
+                buffer = bigger;
+        }
+
+        return buffer;
+}
+
+/*
+ * Exchanges the raw_data and spare_data buffers.
+ */
+static void swap_image_buffers(struct jpeg_data *jpeg)
+{
+        uint32_t *data = jpeg->raw_data;
+        uint32_t capacity = jpeg->raw_capacity;
+
+        jpeg->raw_data = jpeg->spare_data;
+        jpeg->raw_capacity = jpeg->spare_capacity;
+
+        jpeg->spare_data = data;
+        jpeg->spare_capacity = capacity;
+}
+
 /*
  * Converts an MCU image to a regular image.
  */
 uint32_t *mcu_to_image(
         uint32_t *data, struct mcu_info *mcu,
-        uint32_t width, uint32_t height)
+        uint32_t width, uint32_t height,
+        uint32_t *image)
 {
         uint32_t index;
         uint32_t pos = 0;
-        uint32_t *image = malloc(width * height * sizeof(uint32_t));
+
+        /* Allocate the output image if none is given */
+        if (image == NULL)
+                image = malloc(width * height * sizeof(uint32_t));
 
         if (image == NULL)
                 return NULL;
@@ -349,11 +649,15 @@ uint32_t *mcu_to_image(
  */
 uint32_t *image_to_mcu(
         uint32_t *image, struct mcu_info *mcu,
-        uint32_t width, uint32_t height)
+        uint32_t width, uint32_t height,
+        uint32_t *data)
 {
         uint32_t index, pixel;
         uint32_t pos = 0;
-        uint32_t *data = malloc(mcu->size * mcu->nb * sizeof(uint32_t));
+
+        /* Allocate the output MCU image if none is given */
+        if (data == NULL)
+                data = malloc(mcu->size * mcu->nb * sizeof(uint32_t));
 
         if (data == NULL)
                 return NULL;
@@ -420,17 +724,22 @@ void process_options(struct options *options, struct jpeg_data *jpeg, bool *erro
                 || jpeg->mcu.v != options->mcu_v
                 || jpeg->is_plain_image) {
 
-                uint32_t *image = jpeg->raw_data;
-
                 /* Convert an MCU image to a regular image */
                 if (!jpeg->is_plain_image) {
-                        image = mcu_to_image(jpeg->raw_data,
-                                                &jpeg->mcu,
-                                                jpeg->width,
-                                                jpeg->height);
+                        jpeg->spare_data = reserve_buffer(jpeg->spare_data,
+                                        &jpeg->spare_capacity,
+                                        jpeg->width * jpeg->height * sizeof(uint32_t));
+
+                        if (jpeg->spare_data == NULL) {
+                                *error = true;
+                                return;
+                        }
 
-                        /* Free the previous image data */
-                        SAFE_FREE(jpeg->raw_data);
+                        mcu_to_image(jpeg->raw_data, &jpeg->mcu,
+                                        jpeg->width, jpeg->height,
+                                        jpeg->spare_data);
+
+                        swap_image_buffers(jpeg);
                 }
 
 
@@ -440,18 +749,103 @@ void process_options(struct options *options, struct jpeg_data *jpeg, bool *erro
 
                 compute_mcu(jpeg, error);
 
+                if (*error)
+                        return;
+
 
                 /* Convert the image to the required MCU representation */
-                uint32_t *data = image_to_mcu(image,
-                                                &jpeg->mcu,
-                                                jpeg->width,
-                                                jpeg->height);
+                jpeg->spare_data = reserve_buffer(jpeg->spare_data,
+                                &jpeg->spare_capacity,
+                                jpeg->mcu.size * jpeg->mcu.nb * sizeof(uint32_t));
+
+                if (jpeg->spare_data == NULL) {
+                        *error = true;
+                        return;
+                }
+
+                image_to_mcu(jpeg->raw_data, &jpeg->mcu,
+                                jpeg->width, jpeg->height,
+                                jpeg->spare_data);
+
+                swap_image_buffers(jpeg);
+                jpeg->is_plain_image = false;
+        }
+}
+
+/*
+ * Clips a region to a width x height image.
+ * Returns false if the region lies outside the image.
+ */
+bool clip_region(struct region *region, uint32_t width, uint32_t height)
+{
+        if (region->x >= width || region->y >= height)
+                return false;
+
+        if (region->width > width - region->x)
+                region->width = width - region->x;
+
+        if (region->height > height - region->y)
+                region->height = height - region->y;
+
+        return true;
+}
+
+/*
+ * Keeps only the crop region of the image, as a plain image.
+ */
+void crop_image(struct jpeg_data *jpeg, bool *error)
+{
+        if (*error || jpeg == NULL) {
+                *error = true;
+                return;
+        }
+
+        struct region *region = &jpeg->crop;
+        struct mcu_info *mcu = &jpeg->mcu;
+
+        /* No crop : keep the whole image */
+        if (region->width == 0 || region->height == 0)
+                return;
+
+        if (!clip_region(region, jpeg->width, jpeg->height)) {
+                printf("ERROR : the crop region is outside the image\n");
+                *error = true;
+                return;
+        }
+
+        jpeg->spare_data = reserve_buffer(jpeg->spare_data, &jpeg->spare_capacity,
+                        region->width * region->height * sizeof(uint32_t));
 
-                /* Free the plain image data */
-                SAFE_FREE(image);
+        if (jpeg->spare_data == NULL) {
+                *error = true;
+                return;
+        }
+
+
+        uint32_t *pixel = jpeg->spare_data;
+        uint32_t x, y, index;
+
+        /* Copy each pixel of the region */
+        for (uint32_t j = 0; j < region->height; j++) {
+                for (uint32_t i = 0; i < region->width; i++) {
+                        x = region->x + i;
+                        y = region->y + j;
 
-                jpeg->raw_data = data;
+                        if (jpeg->is_plain_image)
+                                index = y * jpeg->width + x;
+                        else
+                                index = ((y / mcu->v) * mcu->nb_h + x / mcu->h) * mcu->size
+                                        + (y % mcu->v) * mcu->h + x % mcu->h;
+
+                        *pixel++ = jpeg->raw_data[index];
+                }
         }
+
+        swap_image_buffers(jpeg);
+
+        jpeg->width = region->width;
+        jpeg->height = region->height;
+        jpeg->is_plain_image = true;
 }
 
 /*
@@ -0,0 +1,414 @@
+
+#include "lossless.h"
+#include "huffman.h"
+#include "pack.h"
+#include "unpack.h"
+#include "conv.h"
+#include "library.h"
+#include "pipeline.h"
+
+
+/*
+ * Lossless line encoding state,
+ * shared by all the pipeline stages
+ */
+struct line_encoder {
+        struct jpeg_data *jpeg;
+
+        /* Output stream, NULL when only counting the differences */
+        struct bitstream *stream;
+};
+
+/*
+ * Reads the samples of image line y, the line
+ * of each component following the previous one
+ */
+static void read_samples(const struct jpeg_data *jpeg, uint32_t y, uint8_t *samples)
+{
+        const struct mcu_info *mcu = &jpeg->mcu;
+        const uint32_t width = jpeg->width;
+
+        /* The line's pixels in its MCU row */
+        const uint32_t *pixels = &jpeg->raw_data[(y / mcu->v) * mcu->nb_h * mcu->size
+                                                 + (y % mcu->v) * mcu->h];
+        uint32_t pixel;
+
+        for (uint32_t x = 0; x < width; x++) {
+                pixel = pixels[(x / mcu->h) * mcu->size + x % mcu->h];
+
+                /* RGB samples, coded without any color conversion */
+                if (jpeg->nb_comps == 3) {
+                        samples[x] = RED(pixel);
+                        samples[width + x] = GREEN(pixel);
+                        samples[2 * width + x] = BLUE(pixel);
+                }
+
+                /* Gray samples, as computed by ARGB_to_Y */
+                else
+                        samples[x] = (RED(pixel) + GREEN(pixel) + BLUE(pixel)) / 3;
+        }
+}
+
+/*
+ * Predicts sample x of a line from its left, above and above left
+ * neighbours. The first line (prev NULL) is predicted from the left
+ * samples, and the first column from the above ones.
+ * Samples are shift bits smaller after a point transform.
+ */
+static inline int32_t predict_sample(uint8_t predictor, uint8_t shift, const uint8_t *line,
+                                     const uint8_t *prev, uint32_t x)
+{
+        if (prev == NULL)
+                return (x > 0) ? line[x - 1] : 1 << (LOSSLESS_PRECISION - shift - 1);
+
+        if (x == 0)
+                return prev[0];
+
+        const int32_t a = line[x - 1];
+        const int32_t b = prev[x];
+        const int32_t c = prev[x - 1];
+
+        switch (predictor) {
+        case 1:
+                return a;
+        case 2:
+                return b;
+        case 3:
+                return c;
+        case 4:
+                return a + b - c;
+        case 5:
+                return a + ((b - c) >> 1);
+        case 6:
+                return b + ((a - c) >> 1);
+        default:
+                return (a + b) >> 1;
+        }
+}
+
+/*
+ * Computes the prediction differences of one image line
+ * (parallel stage), and counts their magnitude classes
+ * in the worker's frequency tables when not writing
+ */
+static void process_line(void *data, uint32_t y, void *slot, uint32_t worker)
+{
+        struct line_encoder *encoder = data;
+        struct jpeg_data *jpeg = encoder->jpeg;
+
+        const uint32_t width = jpeg->width;
+        const uint32_t nb_samples = jpeg->nb_comps * width;
+
+        /* Differences, then current and previous line samples */
+        int16_t *diffs = slot;
+        uint8_t *line = (uint8_t*)&diffs[nb_samples];
+        uint8_t *prev = &line[nb_samples];
+
+        read_samples(jpeg, y, line);
+
+        if (y > 0)
+                read_samples(jpeg, y - 1, prev);
+
+        for (uint8_t i_c = 0; i_c < jpeg->nb_comps; i_c++) {
+                const uint8_t *comp_line = &line[i_c * width];
+                const uint8_t *comp_prev = (y > 0) ? &prev[i_c * width] : NULL;
+                int16_t *comp_diffs = &diffs[i_c * width];
+
+                for (uint32_t x = 0; x < width; x++)
+                        comp_diffs[x] = comp_line[x] - predict_sample(jpeg->predictor, 0,
+                                                                      comp_line, comp_prev, x);
+
+                /* Empty pack_difference execution counting frequencies */
+                if (encoder->stream == NULL)
+                        for (uint32_t x = 0; x < width; x++)
+                                pack_difference(NULL, NULL, comp_diffs[x],
+                                                jpeg->workspaces[worker].freqs[i_c]);
+        }
+}
+
+/* Writes one line's differences, interleaving the components (serial stage) */
+static void store_line(void *data, uint32_t y, void *slot)
+{
+        struct line_encoder *encoder = data;
+        struct jpeg_data *jpeg = encoder->jpeg;
+
+        const uint32_t width = jpeg->width;
+        const int16_t *diffs = slot;
+        uint8_t i_c;
+
+        UNUSED(y);
+
+        for (uint32_t x = 0; x < width; x++) {
+                for (uint8_t j = 0; j < jpeg->nb_comps; j++) {
+                        i_c = jpeg->comp_order[j];
+
+                        pack_difference(encoder->stream,
+                                        jpeg->htables[0][jpeg->comps[i_c].i_dc],
+                                        diffs[i_c * width + x], NULL);
+                }
+        }
+}
+
+/*
+ * Predicts all image lines in parallel, writing
+ * their differences in order when stream is not NULL
+ */
+static void encode_lines(struct jpeg_data *jpeg, struct bitstream *stream, bool *error)
+{
+        struct line_encoder encoder;
+        uint32_t nb_threads = jpeg->nb_threads;
+
+        if (nb_threads == 0)
+                nb_threads = 1;
+
+        encoder.jpeg = jpeg;
+        encoder.stream = stream;
+
+
+        /* Allocate the pipeline's lines of differences and samples */
+        const uint32_t nb_slots = pipeline_nb_slots(nb_threads);
+        const size_t line_size = jpeg->nb_comps * jpeg->width
+                               * (sizeof(int16_t) + 2 * sizeof(uint8_t));
+
+        void *slots[nb_slots];
+        uint8_t *memory = aligned_malloc(nb_slots * line_size);
+
+        if (memory == NULL) {
+                *error = true;
+                return;
+        }
+
+        for (uint32_t i = 0; i < nb_slots; i++)
+                slots[i] = &memory[i * line_size];
+
+
+        const struct pipeline_stages stages = {
+                NULL, process_line, (stream != NULL) ? store_line : NULL
+        };
+
+        if (!run_pipeline(jpeg->pool, &stages, &encoder, slots, jpeg->height, nb_threads))
+                *error = true;
+
+        aligned_free(memory);
+}
+
+/*
+ * Predicts every sample of the image (SOF3 lossless frame) from
+ * its neighbours with the jpeg->predictor selection value, and
+ * computes the Huffman tables of the prediction differences
+ */
+void compute_lossless(struct jpeg_data *jpeg, bool *error)
+{
+        if (jpeg == NULL || *error || jpeg->raw_data == NULL
+            || (jpeg->nb_comps != 1 && jpeg->nb_comps != 3)
+            || jpeg->predictor < 1 || jpeg->predictor > 7) {
+                *error = true;
+                return;
+        }
+
+        uint32_t nb_threads = jpeg->nb_threads;
+
+        if (nb_threads == 0)
+                nb_threads = 1;
+
+        /* Size one workspace per worker, for its frequency tables */
+        if (!reserve_workspaces(&jpeg->workspaces, &jpeg->nb_workspaces, nb_threads,
+                                jpeg->mcu.h_dim, jpeg->mcu.v_dim)) {
+                *error = true;
+                return;
+        }
+
+        for (uint32_t t = 0; t < nb_threads; t++)
+                for (uint8_t i = 0; i < MAX_COMPS; i++)
+                        memset(jpeg->workspaces[t].freqs[i][0], 0, 0x100 * sizeof(uint32_t));
+
+        encode_lines(jpeg, NULL, error);
+
+        if (*error)
+                return;
+
+
+        /* Merge all frequency tables into the first worker's ones */
+        uint32_t *(*freqs)[2] = jpeg->workspaces[0].freqs;
+
+        for (uint8_t i = 0; i < jpeg->nb_comps; i++)
+                for (uint32_t t = 1; t < nb_threads; t++)
+                        for (uint16_t v = 0; v < 0x100; v++)
+                                freqs[i][0][v] += jpeg->workspaces[t].freqs[i][0][v];
+
+
+        /* One difference table per component, lossless scans use no AC table */
+        for (uint8_t i = 0; i < MAX_HTABLES; i++) {
+                struct huff_table **table = &jpeg->htables[0][i];
+
+                if (i < jpeg->nb_comps) {
+                        *table = create_huffman_tree(freqs[i][0], *table, error);
+
+                        jpeg->comps[i].i_dc = i;
+                        jpeg->comps[i].i_ac = 0;
+                }
+
+                else {
+                        free_huffman_table(*table);
+                        *table = NULL;
+                }
+
+                free_huffman_table(jpeg->htables[1][i]);
+                jpeg->htables[1][i] = NULL;
+        }
+}
+
+/* Writes the prediction differences of a lossless image, line by line */
+void write_lossless(struct bitstream *stream, struct jpeg_data *jpeg, bool *error)
+{
+        if (stream == NULL || jpeg == NULL || *error) {
+                *error = true;
+                return;
+        }
+
+        encode_lines(jpeg, stream, error);
+
+        /* Enforce last bits into the stream */
+        flush_bitstream(stream);
+}
+
+
+/* Indicates if lossless components are RGB ones, named 'R', 'G' and 'B' */
+static inline bool is_RGB_frame(const struct jpeg_data *jpeg)
+{
+        return jpeg->nb_comps == 3 && jpeg->comps[0].id == 'R'
+               && jpeg->comps[1].id == 'G' && jpeg->comps[2].id == 'B';
+}
+
+/*
+ * Converts one line of decoded samples to ARGB pixels, undoing
+ * the point transform. Each component's plane holds nb_blocks
+ * blocks of samples, as converted by the MCU conversions.
+ */
+static void line_to_ARGB(const struct jpeg_data *jpeg, const uint8_t *line,
+                         uint8_t *planes, uint32_t nb_blocks, uint32_t *pixels)
+{
+        const uint32_t width = jpeg->width;
+        const uint32_t stride = nb_blocks * BLOCK_SIZE;
+        const uint8_t shift = jpeg->read_scan.low;
+
+        for (uint8_t i_c = 0; i_c < jpeg->nb_comps; i_c++)
+                for (uint32_t x = 0; x < width; x++)
+                        planes[i_c * stride + x] = line[i_c * width + x] << shift;
+
+        if (is_RGB_frame(jpeg)) {
+                for (uint32_t x = 0; x < width; x++)
+                        pixels[x] = planes[x] << 16 | planes[stride + x] << 8
+                                  | planes[2 * stride + x];
+        }
+
+        else if (jpeg->nb_comps == 3) {
+                uint8_t *YCbCr[3] = { planes, &planes[stride], &planes[2 * stride] };
+
+                YCbCr_to_ARGB(YCbCr, pixels, nb_blocks, 1);
+        }
+
+        else
+                Y_to_ARGB(planes, pixels, nb_blocks, 1);
+}
+
+/*
+ * Decodes a lossless (SOF3) scan line by line into a plain image,
+ * each sample being predicted from its already decoded neighbours.
+ * Lines after the crop region, if any, are not decoded.
+ */
+void decode_lossless(struct bitstream *stream, struct jpeg_data *jpeg, bool *error)
+{
+        if (stream == NULL || jpeg == NULL || *error)
+                return;
+
+        const struct scan *scan = &jpeg->read_scan;
+        const uint32_t width = jpeg->width;
+        const uint32_t nb_samples = jpeg->nb_comps * width;
+        const uint32_t nb_blocks = (width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+        /* Last line to decode */
+        struct region region = jpeg->crop;
+        uint32_t end = jpeg->height;
+
+        if (region.width > 0 && region.height > 0
+            && clip_region(&region, jpeg->width, jpeg->height))
+                end = region.y + region.height;
+
+        /* All components are interleaved in one scan */
+        if (scan->nb_comps != jpeg->nb_comps)
+                *error = true;
+
+        for (uint8_t i = 0; i < scan->nb_comps; i++)
+                if (jpeg->htables[0][jpeg->comps[scan->comps[i]].i_dc] == NULL)
+                        *error = true;
+
+        /* Restart intervals always start a new line */
+        if (jpeg->restart_interval % width != 0) {
+                printf("ERROR : lossless restart intervals must hold whole lines\n");
+                *error = true;
+        }
+
+        if (*error)
+                return;
+
+
+        /* Plain image, as read from TIFF files */
+        jpeg->raw_data = reserve_buffer(jpeg->raw_data, &jpeg->raw_capacity,
+                                        width * jpeg->height * sizeof(uint32_t));
+
+        /* Current and previous lines of samples */
+        uint8_t *samples = malloc(2 * nb_samples);
+        uint8_t *planes = calloc(jpeg->nb_comps * nb_blocks, BLOCK_SIZE);
+        uint32_t *pixels = malloc(nb_blocks * BLOCK_SIZE * sizeof(uint32_t));
+
+        if (jpeg->raw_data == NULL || samples == NULL || planes == NULL || pixels == NULL)
+                *error = true;
+
+        uint8_t *line = samples;
+        uint8_t *prev = &samples[nb_samples];
+        bool first = true;
+
+        for (uint32_t y = 0; y < end && !*error; y++) {
+
+                /* Each restart interval is predicted as the first line */
+                if (jpeg->restart_interval > 0 && y > 0
+                    && (y * width) % jpeg->restart_interval == 0) {
+                        const uint8_t marker = skip_bitstream_to_marker(stream);
+
+                        if (marker < RST0 || marker >= RST0 + NB_RST) {
+                                *error = true;
+                                break;
+                        }
+
+                        skip_bitstream(stream, 2);
+                        first = true;
+                }
+
+                /* Decode the interleaved samples of each component */
+                for (uint32_t x = 0; x < width; x++) {
+                        for (uint8_t i = 0; i < scan->nb_comps; i++) {
+                                const uint8_t i_c = scan->comps[i];
+                                uint8_t *comp_line = &line[i_c * width];
+
+                                comp_line[x] = predict_sample(scan->start, scan->low, comp_line,
+                                                              first ? NULL : &prev[i_c * width], x)
+                                             + unpack_difference(stream,
+                                                        jpeg->htables[0][jpeg->comps[i_c].i_dc]);
+                        }
+                }
+
+                first = false;
+
+                line_to_ARGB(jpeg, line, planes, nb_blocks, pixels);
+                memcpy(&jpeg->raw_data[y * width], pixels, width * sizeof(uint32_t));
+
+                uint8_t *tmp = line;
+                line = prev;
+                prev = tmp;
+        }
+
+        SAFE_FREE(samples);
+        SAFE_FREE(planes);
+        SAFE_FREE(pixels);
+}
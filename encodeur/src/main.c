@@ -1,8 +1,5 @@
-
 #include "common.h"
-#include "bitstream.h"
-#include "encode.h"
-#include "decode.h"
+#include "codec.h"
 #include "library.h"
 
 
@@ -18,97 +15,46 @@ int main(int argc, char **argv)
 
         int ret = EXIT_SUCCESS;
 
-        /* JPEG Encoding */
-        if (options.encode) {
-                struct bitstream *stream = create_bitstream(options.output, WRONLY);
-
-                if (stream != NULL) {
-
-                        /* Initializes the jpeg structure with 0s */
-                        struct jpeg_data jpeg;
-                        memset(&jpeg, 0, sizeof(jpeg));
-
-                        /* Retrieve options */
-                        jpeg.path = options.input;
-                        jpeg.compression = options.compression;
-                        jpeg.mcu.h = options.mcu_h;
-                        jpeg.mcu.v = options.mcu_v;
-
-
-                        /* Read input image */
-                        read_image(&jpeg, &error);
-
-                        /* Enable specific options */
-                        process_options(&options, &jpeg, &error);
+        /* JPEG size estimation */
+        if (options.estimate) {
+                struct jpeg_encoder *encoder = create_jpeg_encoder();
+                uint32_t size;
 
+                error = estimate_jpeg_size(encoder, &options, &size);
 
-                        /* Compute Huffman tables */
-                        compute_jpeg(&jpeg, &error);
-
-                        /* Free raw image data */
-                        SAFE_FREE(jpeg.raw_data);
-
-
-                        /* Write JPEG header */
-                        write_header(stream, &jpeg, &error);
-
-                        /* Write computed JPEG data */
-                        write_blocks(stream, &jpeg, &error);
-
-                        /* End JPEG file */
-                        write_section(stream, EOI, NULL, &error);
-
-                        /* Close output file */
-                        free_bitstream(stream);
+                if (error) {
+                        printf("JPEG size estimation failed\n");
+                        ret = EXIT_FAILURE;
+                }
 
+                else
+                        printf("Estimated JPEG size : %" PRIu32 " bytes\n", size);
 
-                        if (error) {
-                                printf("JPEG compression failed\n");
-                                ret = EXIT_FAILURE;
+                /* Free all encoder memory */
+                free_jpeg_encoder(encoder);
 
-                                /* Remove the invalid created file */
-                                remove(options.output);
-                        }
+        /* JPEG Encoding */
+        } else if (options.encode) {
+                struct jpeg_encoder *encoder = create_jpeg_encoder();
 
-                        else
-                                printf("JPEG successfully encoded\n");
+                error = encode_jpeg(encoder, &options);
 
+                if (error) {
+                        printf("JPEG compression failed\n");
+                        ret = EXIT_FAILURE;
+                }
 
-                        /* Free compressed JPEG data */
-                        SAFE_FREE(jpeg.mcu_data);
+                else
+                        printf("JPEG successfully encoded\n");
 
-                        /* Free JPEG Huffman trees */
-                        free_jpeg_data(&jpeg);
-                }
+                /* Free all encoder memory */
+                free_jpeg_encoder(encoder);
 
         /* JPEG Decoding / TIFF Reencoding */
         } else {
+                struct jpeg_decoder *decoder = create_jpeg_decoder();
 
-                /* Initializes the jpeg structure with 0s */
-                struct jpeg_data jpeg;
-                memset(&jpeg, 0, sizeof(struct jpeg_data));
-
-                /* Retrieve options */
-                jpeg.path = options.input;
-                jpeg.mcu.h = options.mcu_h;
-                jpeg.mcu.v = options.mcu_v;
-
-                /* Read input image */
-                read_image(&jpeg, &error);
-
-                /* Enable specific options */
-                process_options(&options, &jpeg, &error);
-
-
-                /* Specify output path */
-                jpeg.path = options.output;
-
-                /* Export as TIFF file */
-                export_tiff(&jpeg, &error);
-
-                /* Free raw image data */
-                SAFE_FREE(jpeg.raw_data);
-
+                error = decode_jpeg(decoder, &options);
 
                 if (error)
                         printf("ERROR : unsupported input format\n");
@@ -116,12 +62,10 @@ int main(int argc, char **argv)
                 else
                         printf("Input file successfully decoded\n");
 
-
-                /* Free any allocated JPEG data */
-                free_jpeg_data(&jpeg);
+                /* Free all decoder memory */
+                free_jpeg_decoder(decoder);
         }
 
 
         return ret;
 }
-
@@ -7,28 +7,23 @@
  * Detects the required magnitude
  * to encode a value
  */
-static inline uint8_t magnitude_class(int16_t value)
+uint8_t magnitude_class(int16_t value)
 {
-        uint8_t class = 0;
-
         /*
          * Compute the positive value
          * to encode (simplifies detection)
          */
-        if (value < 0)
-                value *= -1;
+        const uint32_t magnitude = (value < 0) ? -(int32_t)value : value;
 
         /*
          * The required magnitude corresponds
-         * to the number of bits to encode
+         * to the number of bits to encode,
+         * found from the leading zeros
          */
-        while (value) {
-                value >>= 1;
-
-                class++;
-        }
+        if (magnitude == 0)
+                return 0;
 
-        return class;
+        return 32 - __builtin_clz(magnitude);
 }
 
 /*
@@ -73,9 +68,10 @@ void pack_block(struct bitstream *stream,
                 struct huff_table *table_AC,
                 int32_t bloc[64], uint32_t **freqs)
 {
-        uint8_t class, zeros, symbol, i;
+        uint8_t class, zeros, k;
         uint8_t n = 0;
         int16_t diff;
+        uint64_t nonzeros = 0;
 
         /* Error handling */
         if ( ((table_AC == NULL || table_DC == NULL) && freqs == NULL)
@@ -102,45 +98,246 @@ void pack_block(struct bitstream *stream,
                 write_magnitude(stream, diff);
 
 
+        /*
+         * Bit k of nonzeros is set for each nonzero AC coefficient k,
+         * zero runs are then skipped by counting trailing zero bits
+         */
+        for (k = 1; k < BLOCK_SIZE; k++)
+                nonzeros |= (uint64_t)(bloc[k] != 0) << k;
+
         /* Write the 63 AC coefficients */
-        while (n < BLOCK_SIZE) {
+        while (nonzeros) {
 
-                i = n;
-                zeros = 0;
+                k = __builtin_ctzll(nonzeros);
+                zeros = k - n;
 
-                /* Count next zero values */
-                while (i < BLOCK_SIZE && !bloc[i++])
-                        zeros++;
+                /* At least 16 zeros */
+                for (; zeros >= 16; zeros -= 16)
+                        write_huffman_value(ZRL, table_AC, stream, freqs, 1);
+
+                /* 15 zeros or less */
+                class = magnitude_class(bloc[k]);
+
+                write_huffman_value((zeros << 4) | (class & 0xF), table_AC, stream, freqs, 1);
+
+                if (freqs == NULL)
+                        write_magnitude(stream, bloc[k]);
 
+                nonzeros &= nonzeros - 1;
+                n = k + 1;
+        }
+
+        /* Only zeros left */
+        if (n < BLOCK_SIZE)
+                write_huffman_value(EOB, table_AC, stream, freqs, 1);
+}
+
+/*
+ * Packs a lossless prediction difference.
+ * If freqs is not NULL, only counts its magnitude class.
+ */
+void pack_difference(struct bitstream *stream, struct huff_table *table,
+                int32_t diff, uint32_t **freqs)
+{
+        if (table == NULL && freqs == NULL)
+                return;
 
-                /* Only zeros left */
-                if (zeros >= (BLOCK_SIZE - n)) {
-                        symbol = EOB;
-                        n = BLOCK_SIZE;
+        write_huffman_value(magnitude_class(diff), table, stream, freqs, 0);
 
-                        write_huffman_value(symbol, table_AC, stream, freqs, 1);
+        if (freqs == NULL)
+                write_magnitude(stream, diff);
+}
+
+
+/*
+ * Writes the nb_bits lowest bits of value
+ */
+static void write_bits(struct bitstream *stream, uint32_t value, uint8_t nb_bits)
+{
+        for (uint8_t k = 0; k < nb_bits; k++)
+                write_bit(stream, (value >> (nb_bits - 1 - k)) & 1, true);
+}
+
+/*
+ * Packs the first bits of a DC coefficient
+ * (progressive DC first scan)
+ */
+void pack_DC_first(struct bitstream *stream, struct huff_table *table_DC,
+                int32_t *pred_DC, uint8_t low, int32_t bloc[64], uint32_t **freqs)
+{
+        int16_t diff;
+
+        if ((table_DC == NULL && freqs == NULL) || pred_DC == NULL)
+                return;
+
+        /* Predictions are made on the shifted values */
+        const int32_t value = bloc[0] >> low;
+
+        diff = value - *pred_DC;
+        *pred_DC = value;
+
+        write_huffman_value(magnitude_class(diff), table_DC, stream, freqs, 0);
+
+        if (freqs == NULL)
+                write_magnitude(stream, diff);
+}
+
+/*
+ * Packs the next bit of a DC coefficient
+ * (progressive DC refinement scan)
+ */
+void pack_DC_refine(struct bitstream *stream, uint8_t low, int32_t bloc[64],
+                uint32_t **freqs)
+{
+        if (freqs == NULL)
+                write_bit(stream, (bloc[0] >> low) & 1, true);
+}
+
+/*
+ * Writes the pending EOB run, if any
+ */
+void flush_eob_run(struct bitstream *stream, struct huff_table *table_AC,
+                struct eob_run *run, uint32_t **freqs)
+{
+        if (run == NULL || run->length == 0)
+                return;
+
+        /* EOBn : the run length's bits below its highest one follow */
+        const uint8_t nb_bits = magnitude_class(run->length) - 1;
+
+        write_huffman_value(nb_bits << 4, table_AC, stream, freqs, 1);
+
+        if (freqs == NULL) {
+                write_bits(stream, run->length, nb_bits);
+
+                for (uint16_t k = 0; k < run->nb_bits; k++)
+                        write_bit(stream, run->bits[k], true);
+        }
+
+        run->length = 0;
+        run->nb_bits = 0;
+}
+
+/*
+ * Packs the first bits of the start to end AC coefficients
+ * (progressive AC first scan)
+ */
+void pack_AC_first(struct bitstream *stream, struct huff_table *table_AC,
+                uint8_t start, uint8_t end, uint8_t low, struct eob_run *run,
+                int32_t bloc[64], uint32_t **freqs)
+{
+        uint8_t class, zeros = 0;
+        int32_t value;
+
+        if ((table_AC == NULL && freqs == NULL) || run == NULL)
+                return;
+
+        for (uint8_t n = start; n <= end; n++) {
+
+                /* Magnitude of the coefficient's first bits */
+                value = abs(bloc[n]) >> low;
+
+                if (value == 0) {
+                        zeros++;
+                        continue;
+                }
+
+                flush_eob_run(stream, table_AC, run, freqs);
 
                 /* At least 16 zeros */
-                } else if (zeros >= 16) {
-                        symbol = ZRL;
-                        n += 16;
+                for (; zeros >= 16; zeros -= 16)
+                        write_huffman_value(ZRL, table_AC, stream, freqs, 1);
 
-                        write_huffman_value(symbol, table_AC, stream, freqs, 1);
+                class = magnitude_class(value);
 
-                /* 15 zeros or less */
-                } else {
-                        n += zeros;
+                write_huffman_value((zeros << 4) | class, table_AC, stream, freqs, 1);
+
+                if (freqs == NULL)
+                        write_magnitude(stream, (bloc[n] < 0) ? -value : value);
+
+                zeros = 0;
+        }
+
+        /* Only zeros left : the block joins the EOB run */
+        if (zeros > 0 && ++run->length == MAX_EOB_RUN)
+                flush_eob_run(stream, table_AC, run, freqs);
+}
+
+/*
+ * Packs the next bit of the start to end AC coefficients
+ * (progressive AC refinement scan)
+ */
+void pack_AC_refine(struct bitstream *stream, struct huff_table *table_AC,
+                uint8_t start, uint8_t end, uint8_t low, struct eob_run *run,
+                int32_t bloc[64], uint32_t **freqs)
+{
+        int32_t values[BLOCK_SIZE];
+        uint8_t bits[BLOCK_SIZE];
+        uint8_t nb_bits = 0;
+        uint8_t zeros = 0;
+        uint8_t last_new = 0;
+
+        if ((table_AC == NULL && freqs == NULL) || run == NULL)
+                return;
+
+        /* Find the last coefficient becoming non-zero in this scan */
+        for (uint8_t n = start; n <= end; n++) {
+                values[n] = abs(bloc[n]) >> low;
+
+                if (values[n] == 1)
+                        last_new = n;
+        }
 
-                        class = magnitude_class(bloc[n]);
-                        symbol = (zeros << 4) | (class & 0xF);
+        for (uint8_t n = start; n <= end; n++) {
+
+                if (values[n] == 0) {
+                        zeros++;
+                        continue;
+                }
 
-                        write_huffman_value(symbol, table_AC, stream, freqs, 1);
+                /* Zero runs are only coded before a new coefficient */
+                while (zeros >= 16 && n <= last_new) {
+                        flush_eob_run(stream, table_AC, run, freqs);
+                        write_huffman_value(ZRL, table_AC, stream, freqs, 1);
+                        zeros -= 16;
 
                         if (freqs == NULL)
-                                write_magnitude(stream, bloc[n]);
+                                for (uint8_t k = 0; k < nb_bits; k++)
+                                        write_bit(stream, bits[k], true);
 
-                        n++;
+                        nb_bits = 0;
                 }
+
+                /* Coefficient already non-zero : buffer its next bit */
+                if (values[n] > 1) {
+                        bits[nb_bits++] = values[n] & 1;
+                        continue;
+                }
+
+                /* New coefficient of magnitude 1, followed by its sign */
+                flush_eob_run(stream, table_AC, run, freqs);
+                write_huffman_value((zeros << 4) | 1, table_AC, stream, freqs, 1);
+
+                if (freqs == NULL) {
+                        write_bit(stream, bloc[n] >= 0, true);
+
+                        for (uint8_t k = 0; k < nb_bits; k++)
+                                write_bit(stream, bits[k], true);
+                }
+
+                nb_bits = 0;
+                zeros = 0;
         }
-}
 
+        /* The block joins the EOB run, with its remaining bits */
+        if (zeros > 0 || nb_bits > 0) {
+                run->length++;
+
+                for (uint8_t k = 0; k < nb_bits; k++)
+                        run->bits[run->nb_bits++] = bits[k];
+
+                if (run->length == MAX_EOB_RUN
+                    || run->nb_bits > MAX_EOB_BITS - BLOCK_SIZE)
+                        flush_eob_run(stream, table_AC, run, freqs);
+        }
+}
@@ -0,0 +1,442 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include "pipeline.h"
+#include <pthread.h>
+#include <unistd.h>
+
+
+/* Maximum number of processing workers */
+#define MAX_THREADS 64
+
+/* Slot states */
+enum slot_state {
+        SLOT_FREE,
+        SLOT_LOADED,
+        SLOT_PROCESSED
+};
+
+/*
+ * Shared pipeline state
+ */
+struct pipeline {
+
+        /* Stages and their data */
+        const struct pipeline_stages *stages;
+        void *data;
+
+        /* Row slots */
+        void **slots;
+        enum slot_state *states;
+        uint32_t nb_slots;
+
+        /* Number of processing workers */
+        uint32_t nb_workers;
+
+        /* Number of loaded rows, next row to process */
+        uint32_t nb_loaded;
+        uint32_t next_row;
+
+        /* Indicates that no more rows will be loaded */
+        bool loaded;
+
+        /* State protection, signaled on any slot state change */
+        pthread_mutex_t mutex;
+        pthread_cond_t changed;
+};
+
+/*
+ * Worker threads kept from one pipeline run to another.
+ * Each run hands out nb_tasks task indices to the idle threads.
+ */
+struct thread_pool {
+
+        /* Started threads (processing workers plus the store worker) */
+        pthread_t threads[MAX_THREADS + 1];
+        uint32_t nb_threads;
+
+        /* Current run's task and its argument */
+        void (*task)(void *arg, uint32_t index);
+        void *arg;
+
+        /* Number of tasks, next one to start, and unfinished ones */
+        uint32_t nb_tasks;
+        uint32_t next_task;
+        uint32_t nb_running;
+
+        /* Indicates that threads must exit */
+        bool stop;
+
+        /* State protection, signaled when tasks start or all are done */
+        pthread_mutex_t mutex;
+        pthread_cond_t start;
+        pthread_cond_t done;
+};
+
+
+/* Number of threads to use by default (online processors) */
+uint32_t default_nb_threads(void)
+{
+        long nb = sysconf(_SC_NPROCESSORS_ONLN);
+
+        if (nb < 1)
+                nb = 1;
+
+        else if (nb > MAX_THREADS)
+                nb = MAX_THREADS;
+
+        return nb;
+}
+
+/* Number of slots needed to keep nb_threads workers busy */
+uint32_t pipeline_nb_slots(uint32_t nb_threads)
+{
+        if (nb_threads <= 1)
+                return 1;
+
+        if (nb_threads > MAX_THREADS)
+                nb_threads = MAX_THREADS;
+
+        return 2 * nb_threads + 2;
+}
+
+/*
+ * Pool thread : runs the tasks of each run
+ * until the pool is stopped.
+ */
+static void *pool_thread(void *arg)
+{
+        struct thread_pool *pool = arg;
+        uint32_t index;
+
+        pthread_mutex_lock(&pool->mutex);
+
+        while (true) {
+                while (pool->next_task >= pool->nb_tasks && !pool->stop)
+                        pthread_cond_wait(&pool->start, &pool->mutex);
+
+                if (pool->stop)
+                        break;
+
+                index = pool->next_task++;
+                pthread_mutex_unlock(&pool->mutex);
+
+
+                pool->task(pool->arg, index);
+
+
+                pthread_mutex_lock(&pool->mutex);
+
+                if (--pool->nb_running == 0)
+                        pthread_cond_signal(&pool->done);
+        }
+
+        pthread_mutex_unlock(&pool->mutex);
+
+        return NULL;
+}
+
+/* Creates a thread pool, whose threads are started on demand */
+struct thread_pool *create_thread_pool(void)
+{
+        struct thread_pool *pool = calloc(1, sizeof(struct thread_pool));
+
+        if (pool == NULL)
+                return NULL;
+
+        pthread_mutex_init(&pool->mutex, NULL);
+        pthread_cond_init(&pool->start, NULL);
+        pthread_cond_init(&pool->done, NULL);
+
+        return pool;
+}
+
+/* Stops a thread pool's threads and frees it */
+void free_thread_pool(struct thread_pool *pool)
+{
+        if (pool == NULL)
+                return;
+
+        pthread_mutex_lock(&pool->mutex);
+
+        pool->stop = true;
+        pthread_cond_broadcast(&pool->start);
+
+        pthread_mutex_unlock(&pool->mutex);
+
+        for (uint32_t i = 0; i < pool->nb_threads; i++)
+                pthread_join(pool->threads[i], NULL);
+
+
+        pthread_cond_destroy(&pool->done);
+        pthread_cond_destroy(&pool->start);
+        pthread_mutex_destroy(&pool->mutex);
+
+        free(pool);
+}
+
+/*
+ * Starts at least nb_threads pool threads if needed,
+ * returns the number of available threads.
+ */
+static uint32_t start_threads(struct thread_pool *pool, uint32_t nb_threads)
+{
+        while (pool->nb_threads < nb_threads
+               && !pthread_create(&pool->threads[pool->nb_threads], NULL, pool_thread, pool))
+                pool->nb_threads++;
+
+        return pool->nb_threads;
+}
+
+/* Hands out task indices 0 to nb_tasks - 1 to the pool threads */
+static void start_tasks(struct thread_pool *pool, void (*task)(void *arg, uint32_t index),
+                        void *arg, uint32_t nb_tasks)
+{
+        pthread_mutex_lock(&pool->mutex);
+
+        pool->task = task;
+        pool->arg = arg;
+        pool->nb_tasks = nb_tasks;
+        pool->next_task = 0;
+        pool->nb_running = nb_tasks;
+        pthread_cond_broadcast(&pool->start);
+
+        pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Waits for all the started tasks to be done */
+static void wait_tasks(struct thread_pool *pool)
+{
+        pthread_mutex_lock(&pool->mutex);
+
+        while (pool->nb_running > 0)
+                pthread_cond_wait(&pool->done, &pool->mutex);
+
+        pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Changes a slot's state and wakes up waiting threads */
+static void set_state(struct pipeline *pipeline, uint32_t slot, enum slot_state state)
+{
+        pthread_mutex_lock(&pipeline->mutex);
+
+        pipeline->states[slot] = state;
+        pthread_cond_broadcast(&pipeline->changed);
+
+        pthread_mutex_unlock(&pipeline->mutex);
+}
+
+/*
+ * Processing worker : processes loaded rows
+ * as soon as they are available.
+ */
+static void process_rows(struct pipeline *pipeline, uint32_t worker)
+{
+        const struct pipeline_stages *stages = pipeline->stages;
+        uint32_t row, slot;
+
+        while (true) {
+                pthread_mutex_lock(&pipeline->mutex);
+
+                while (pipeline->next_row >= pipeline->nb_loaded && !pipeline->loaded)
+                        pthread_cond_wait(&pipeline->changed, &pipeline->mutex);
+
+                /* Every row has been processed */
+                if (pipeline->next_row >= pipeline->nb_loaded) {
+                        pthread_mutex_unlock(&pipeline->mutex);
+                        break;
+                }
+
+                row = pipeline->next_row++;
+                pthread_mutex_unlock(&pipeline->mutex);
+
+
+                slot = row % pipeline->nb_slots;
+                stages->process(pipeline->data, row, pipeline->slots[slot], worker);
+
+                /* Without store stage, the slot is directly reusable */
+                if (stages->store != NULL)
+                        set_state(pipeline, slot, SLOT_PROCESSED);
+                else
+                        set_state(pipeline, slot, SLOT_FREE);
+        }
+}
+
+/*
+ * Store worker : stores processed rows in order.
+ */
+static void store_rows(struct pipeline *pipeline)
+{
+        uint32_t slot;
+
+        for (uint32_t row = 0; ; row++) {
+                slot = row % pipeline->nb_slots;
+
+                pthread_mutex_lock(&pipeline->mutex);
+
+                while (pipeline->states[slot] != SLOT_PROCESSED
+                       && (row < pipeline->nb_loaded || !pipeline->loaded))
+                        pthread_cond_wait(&pipeline->changed, &pipeline->mutex);
+
+                /* Every row has been stored */
+                if (pipeline->states[slot] != SLOT_PROCESSED) {
+                        pthread_mutex_unlock(&pipeline->mutex);
+                        break;
+                }
+
+                pthread_mutex_unlock(&pipeline->mutex);
+
+
+                pipeline->stages->store(pipeline->data, row, pipeline->slots[slot]);
+                set_state(pipeline, slot, SLOT_FREE);
+        }
+}
+
+/*
+ * Pipeline pool task : the first tasks are processing
+ * workers, the last one is the store worker if any.
+ */
+static void pipeline_task(void *arg, uint32_t index)
+{
+        struct pipeline *pipeline = arg;
+
+        if (index < pipeline->nb_workers)
+                process_rows(pipeline, index);
+
+        else
+                store_rows(pipeline);
+}
+
+/* Runs all stages inline, row after row */
+static bool run_serial(const struct pipeline_stages *stages, void *data,
+                       void *slot, uint32_t nb_rows)
+{
+        for (uint32_t row = 0; row < nb_rows; row++) {
+
+                if (stages->load != NULL && !stages->load(data, row, slot))
+                        return false;
+
+                stages->process(data, row, slot, 0);
+
+                if (stages->store != NULL)
+                        stages->store(data, row, slot);
+        }
+
+        return true;
+}
+
+/*
+ * Runs nb_rows rows through the pipeline stages, with nb_threads
+ * processing workers (everything is done inline for 1 thread).
+ * The workers are pool threads, kept started for the next runs
+ * (a temporary pool is used if pool is NULL).
+ * slots must hold pipeline_nb_slots(nb_threads) slot pointers.
+ * Returns false if a load stage failed or threads could not start.
+ */
+bool run_pipeline(struct thread_pool *pool, const struct pipeline_stages *stages,
+                  void *data, void **slots, uint32_t nb_rows, uint32_t nb_threads)
+{
+        if (stages == NULL || slots == NULL)
+                return false;
+
+        if (nb_threads > MAX_THREADS)
+                nb_threads = MAX_THREADS;
+
+        if (nb_threads <= 1 || nb_rows <= 1)
+                return run_serial(stages, data, slots[0], nb_rows);
+
+
+        /* Without a context pool, threads only live for this run */
+        if (pool == NULL) {
+                struct thread_pool *run_pool = create_thread_pool();
+
+                if (run_pool == NULL)
+                        return false;
+
+                const bool success = run_pipeline(run_pool, stages, data, slots,
+                                                  nb_rows, nb_threads);
+
+                free_thread_pool(run_pool);
+
+                return success;
+        }
+
+
+        struct pipeline pipeline;
+        enum slot_state states[pipeline_nb_slots(MAX_THREADS)];
+
+        const uint32_t nb_stores = (stages->store != NULL) ? 1 : 0;
+        const uint32_t nb_available = start_threads(pool, nb_threads + nb_stores);
+        bool success = true;
+
+        /* At least one processing worker, plus the store worker */
+        if (nb_available <= nb_stores)
+                return false;
+
+
+        pipeline.stages = stages;
+        pipeline.data = data;
+        pipeline.slots = slots;
+        pipeline.states = states;
+        pipeline.nb_slots = pipeline_nb_slots(nb_threads);
+        pipeline.nb_workers = nb_available - nb_stores;
+        pipeline.nb_loaded = 0;
+        pipeline.next_row = 0;
+        pipeline.loaded = false;
+
+        if (pipeline.nb_workers > nb_threads)
+                pipeline.nb_workers = nb_threads;
+
+        for (uint32_t i = 0; i < pipeline.nb_slots; i++)
+                states[i] = SLOT_FREE;
+
+        pthread_mutex_init(&pipeline.mutex, NULL);
+        pthread_cond_init(&pipeline.changed, NULL);
+
+
+        /* Start processing and store workers */
+        start_tasks(pool, pipeline_task, &pipeline, pipeline.nb_workers + nb_stores);
+
+
+        /* Load all rows in order */
+        for (uint32_t row = 0; row < nb_rows && success; row++) {
+                uint32_t slot = row % pipeline.nb_slots;
+
+                pthread_mutex_lock(&pipeline.mutex);
+
+                while (states[slot] != SLOT_FREE)
+                        pthread_cond_wait(&pipeline.changed, &pipeline.mutex);
+
+                pthread_mutex_unlock(&pipeline.mutex);
+
+
+                success = stages->load == NULL
+                       || stages->load(data, row, slots[slot]);
+
+                if (success) {
+                        pthread_mutex_lock(&pipeline.mutex);
+
+                        states[slot] = SLOT_LOADED;
+                        pipeline.nb_loaded++;
+                        pthread_cond_broadcast(&pipeline.changed);
+
+                        pthread_mutex_unlock(&pipeline.mutex);
+                }
+        }
+
+
+        /* No more rows : let the workers finish */
+        pthread_mutex_lock(&pipeline.mutex);
+
+        pipeline.loaded = true;
+        pthread_cond_broadcast(&pipeline.changed);
+
+        pthread_mutex_unlock(&pipeline.mutex);
+
+        wait_tasks(pool);
+
+
+        pthread_cond_destroy(&pipeline.changed);
+        pthread_mutex_destroy(&pipeline.mutex);
+
+        return success;
+}
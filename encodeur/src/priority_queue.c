@@ -10,8 +10,8 @@ struct element {
         /* Priority */
         uint32_t priority;
 
-        /* Huffman data */
-        struct huff_table *table;
+        /* Huffman tree node index */
+        uint16_t node;
 };
 
 /*
@@ -55,7 +55,7 @@ struct priority_queue *create_queue(uint32_t max_size)
 /*
  * Inserts an element with the given priority.
  */
-bool insert_queue(struct priority_queue *queue, uint32_t priority, struct huff_table *table)
+bool insert_queue(struct priority_queue *queue, uint32_t priority, uint16_t node)
 {
         struct element elem;
         uint32_t i_cur, i_parent;
@@ -67,7 +67,7 @@ bool insert_queue(struct priority_queue *queue, uint32_t priority, struct huff_t
 
                 /* We add the element at the next position */
                 i_cur = ++queue->size;
-                heap[i_cur - 1] = (struct element){ priority, table };
+                heap[i_cur - 1] = (struct element){ priority, node };
 
                 /*
                  * Place the new element in the tree :
@@ -94,15 +94,15 @@ bool insert_queue(struct priority_queue *queue, uint32_t priority, struct huff_t
  * Retrieves the best priority element (leaves it in the queue).
  * Returns false if the queue is empty.
  */
-bool best_queue(struct priority_queue *queue, uint32_t *priority, struct huff_table **table)
+bool best_queue(struct priority_queue *queue, uint32_t *priority, uint16_t *node)
 {
         /*
          * If there's an element in the queue,
          * return the first one (and so the best)
          */
-        if (queue != NULL && queue->size > 0 && priority && table) {
+        if (queue != NULL && queue->size > 0 && priority && node) {
                 *priority = queue->heap[0].priority;
-                *table = queue->heap[0].table;
+                *node = queue->heap[0].node;
 
                 return true;
         }
@@ -2,6 +2,7 @@
 #include "qzz.h"
 #include "common.h"
 #include "library.h"
+#include "pack.h"
 
 /*
  * Used to optimize zigzag navigation in 8x8 blocks
@@ -42,6 +43,115 @@ void qzz_block (int32_t in[64], int32_t out[64], uint8_t quantif[64])
         }
 }
 
+/*
+ * Code size of a Huffman value for trellis quantification,
+ * values without code being as costly as the longest codes
+ */
+static inline uint8_t trellis_bits(const uint8_t code_sizes[0x100], uint8_t value)
+{
+        return (code_sizes[value] > 0) ? code_sizes[value] : 16;
+}
+
+/*
+ * Computes a zigzag quantification minimizing, for the AC
+ * coefficients, their squared error plus lambda times their
+ * number of bits, given the AC Huffman code sizes.
+ * lambda is relative to the mean squared AC quantifier.
+ */
+void trellis_qzz_block(int32_t in[64], int32_t out[64], uint8_t quantif[64],
+                       const uint8_t code_sizes[0x100], double lambda)
+{
+        int32_t coeffs[64];
+
+        /* Best cost of the AC coefficients up to each nonzero one */
+        double best[64];
+        uint8_t prev[64];
+        int32_t val[64];
+
+        /* Squared errors of the coefficients set to zero up to each one */
+        double zeros[64];
+
+        double scale = 0;
+
+        for(uint8_t i = 0; i < 64; ++i)
+                coeffs[zz[i]] = in[i];
+
+        for(uint8_t k = 1; k < 64; ++k)
+                scale += quantif[k] * quantif[k];
+
+        lambda *= scale / 63;
+
+
+        /* The DC coefficient is rounded */
+        out[0] = (coeffs[0] >= 0) ? (coeffs[0] + quantif[0] / 2) / quantif[0]
+                                  : -((quantif[0] / 2 - coeffs[0]) / quantif[0]);
+
+        best[0] = 0;
+        zeros[0] = 0;
+
+        for(uint8_t k = 1; k < 64; ++k) {
+                const int32_t c = abs(coeffs[k]);
+                const int32_t q = quantif[k];
+                const int32_t rounded = (c + q / 2) / q;
+
+                zeros[k] = zeros[k - 1] + (double)c * c;
+                best[k] = -1;
+                out[k] = 0;
+
+                /* Try the rounded value and the smaller one */
+                for (int32_t v = rounded; v >= 1 && v >= rounded - 1; v--) {
+                        const double error = (double)(c - v * q) * (c - v * q);
+                        const uint8_t class = magnitude_class(v);
+
+                        /* Try each previous nonzero coefficient */
+                        for (uint8_t j = 0; j < k; j++) {
+                                if (best[j] < 0)
+                                        continue;
+
+                                const uint8_t run = k - j - 1;
+                                const uint32_t bits = (run / 16) * trellis_bits(code_sizes, ZRL)
+                                        + trellis_bits(code_sizes, ((run % 16) << 4) | class)
+                                        + class;
+
+                                const double cost = best[j] + zeros[k - 1] - zeros[j]
+                                                  + error + lambda * bits;
+
+                                if (best[k] < 0 || cost < best[k]) {
+                                        best[k] = cost;
+                                        prev[k] = j;
+                                        val[k] = v;
+                                }
+                        }
+                }
+        }
+
+
+        /* Choose the last nonzero coefficient, followed by an EOB */
+        uint8_t last = 0;
+        double best_cost = -1;
+
+        for(uint8_t k = 0; k < 64; ++k) {
+                if (best[k] < 0)
+                        continue;
+
+                double cost = best[k] + zeros[63] - zeros[k];
+
+                if (k < 63)
+                        cost += lambda * trellis_bits(code_sizes, EOB);
+
+                if (best_cost < 0 || cost < best_cost) {
+                        best_cost = cost;
+                        last = k;
+                }
+        }
+
+        /* Set the chosen values */
+        while (last > 0) {
+                out[last] = (coeffs[last] < 0) ? -val[last] : val[last];
+                last = prev[last];
+        }
+}
+
 /*
  * Adjusts a quantification table's compression quality.
  *
@@ -63,4 +173,29 @@ void quantify_qtable(uint8_t out[64], const uint8_t in[64], uint8_t quality)
         }
 }
 
+/*
+ * Scales a quantification table given in natural order
+ * to an IJG quality, and stores it in zigzag order.
+ *
+ * Quality range : 1 - 100
+ *
+ * 50  : Unchanged table
+ * 100 : No compression
+ */
+void scale_qtable(uint8_t out[64], const uint8_t in[64], uint8_t quality)
+{
+        int32_t q_value;
+
+        const int32_t scale = (quality < 50) ? 5000 / quality : 200 - 2 * quality;
+
+        for(uint8_t i = 0; i < 64; ++i) {
+                q_value = ((int32_t)in[i] * scale + 50) / 100;
+
+                if (q_value < 1)
+                        q_value = 1;
+
+                out[zz[i]] = TRUNCATE(q_value);
+        }
+}
+
 
@@ -9,19 +9,19 @@ int main()
         if (queue == NULL)
                 printf("create_queue error\n");
 
-        insert_queue(queue, 10, (struct huff_table*)10);
-        insert_queue(queue, 11, (struct huff_table*)11);
-        insert_queue(queue, 8, (struct huff_table*)8);
-        insert_queue(queue, 3, (struct huff_table*)3);
-        insert_queue(queue, 7, (struct huff_table*)7);
-        insert_queue(queue, 15, (struct huff_table*)15);
+        insert_queue(queue, 10, 10);
+        insert_queue(queue, 11, 11);
+        insert_queue(queue, 8, 8);
+        insert_queue(queue, 3, 3);
+        insert_queue(queue, 7, 7);
+        insert_queue(queue, 15, 15);
 
         uint32_t priority = 0;
-        struct huff_table *table = NULL;
+        uint16_t node = 0;
 
-        while (best_queue(queue, &priority, &table)) {
+        while (best_queue(queue, &priority, &node)) {
 
-                printf("Table = %ld\n", (uint64_t)table);
+                printf("Node = %u\n", node);
                 delete_queue(queue);
         }
 
@@ -62,7 +62,7 @@ int main()
 
 
                 uint32_t *mcu_RGB;
-                uint32_t *mcu_data = image_to_mcu(raw_data, &mcu, width, height);
+                uint32_t *mcu_data = image_to_mcu(raw_data, &mcu, width, height, NULL);
 
                 for (uint32_t i = 0; i < mcu.nb; i++) {
                         mcu_RGB = &(mcu_data[i * mcu.size]);
@@ -0,0 +1,582 @@
+
+#include "transform.h"
+#include "library.h"
+#include "pipeline.h"
+
+
+/* Zigzag index of each coefficient, in natural order */
+static const uint8_t zz[64] =
+{
+         0,  1,  5,  6, 14, 15, 27, 28,
+         2,  4,  7, 13, 16, 26, 29, 42,
+         3,  8, 12, 17, 25, 30, 41, 43,
+         9, 11, 18, 24, 31, 40, 44, 53,
+        10, 19, 23, 32, 39, 45, 52, 54,
+        20, 22, 33, 38, 46, 51, 55, 60,
+        21, 34, 37, 47, 50, 56, 59, 61,
+        35, 36, 48, 49, 57, 58, 62, 63
+};
+
+/*
+ * Every transform mirrors the image horizontally and / or
+ * vertically, and then transposes it : rot90 is a vertical
+ * mirror followed by a transposition.
+ */
+struct geometry {
+        bool mirror_h, mirror_v, transpose;
+};
+
+static const struct geometry geometries[] = {
+        [TRANSFORM_NONE] = { false, false, false },
+        [FLIP_H]         = { true,  false, false },
+        [FLIP_V]         = { false, true,  false },
+        [TRANSPOSE]      = { false, false, true  },
+        [TRANSVERSE]     = { true,  true,  true  },
+        [ROTATE_90]      = { false, true,  true  },
+        [ROTATE_180]     = { true,  true,  false },
+        [ROTATE_270]     = { true,  false, true  }
+};
+
+/*
+ * Coefficients of a transformed block : each output
+ * zigzag coefficient is a source one, maybe negated
+ */
+struct block_transform {
+        uint8_t index[BLOCK_SIZE];
+        int8_t sign[BLOCK_SIZE];
+};
+
+
+/*
+ * Computes how a geometry moves the coefficients of a block.
+ * Mirroring a block negates its odd frequencies,
+ * transposing it transposes its frequencies.
+ */
+static void init_block_transform(const struct geometry *geometry,
+                                 struct block_transform *transform)
+{
+        uint8_t v_in, u_in, out;
+
+        for (uint8_t v = 0; v < BLOCK_DIM; v++) {
+                for (uint8_t u = 0; u < BLOCK_DIM; u++) {
+
+                        v_in = geometry->transpose ? u : v;
+                        u_in = geometry->transpose ? v : u;
+                        out = zz[v * BLOCK_DIM + u];
+
+                        transform->index[out] = zz[v_in * BLOCK_DIM + u_in];
+                        transform->sign[out] = 1;
+
+                        if (geometry->mirror_h && (u_in & 1))
+                                transform->sign[out] = -transform->sign[out];
+
+                        if (geometry->mirror_v && (v_in & 1))
+                                transform->sign[out] = -transform->sign[out];
+                }
+        }
+}
+
+/* Computes the position in mcu_data of a component's block */
+static inline uint32_t block_index(const struct mcu_info *mcu, const struct comp *comp,
+                                   uint32_t nb_mcu_blocks, uint32_t first_block,
+                                   uint32_t x, uint32_t y)
+{
+        const uint32_t i_mcu = (y / comp->nb_blocks_v) * mcu->nb_h + x / comp->nb_blocks_h;
+        const uint32_t n = (y % comp->nb_blocks_v) * comp->nb_blocks_h
+                         + x % comp->nb_blocks_h;
+
+        return (i_mcu * nb_mcu_blocks + first_block + n) * BLOCK_SIZE;
+}
+
+/*
+ * Losslessly transforms the quantified coefficients of a JPEG
+ * input (see read_coefficients) : the crop region, whose origin
+ * is moved to an MCU boundary, is flipped, transposed or rotated.
+ * Partial edge MCUs that would be mirrored are trimmed.
+ */
+void transform_jpeg(struct jpeg_data *jpeg, enum transform transform, bool *error)
+{
+        if (jpeg == NULL || *error || !jpeg->transcoded
+            || transform > ROTATE_270) {
+                *error = true;
+                return;
+        }
+
+        const struct geometry *geometry = &geometries[transform];
+        const struct mcu_info in = jpeg->mcu;
+        struct comp in_comps[MAX_COMPS];
+        uint32_t first_block[MAX_COMPS];
+        uint32_t nb_mcu_blocks = 0;
+        uint8_t i_c;
+
+        memcpy(in_comps, jpeg->comps, sizeof(in_comps));
+
+        for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
+                i_c = jpeg->comp_order[i];
+
+                first_block[i_c] = nb_mcu_blocks;
+                nb_mcu_blocks += in_comps[i_c].nb_blocks_h * in_comps[i_c].nb_blocks_v;
+        }
+
+
+        /* Source region : the crop region, starting on an MCU boundary */
+        struct region region = { 0, 0, jpeg->width, jpeg->height };
+
+        if (jpeg->crop.width > 0 && jpeg->crop.height > 0) {
+                region = jpeg->crop;
+
+                if (!clip_region(&region, jpeg->width, jpeg->height)) {
+                        printf("ERROR : the crop region is outside the image\n");
+                        *error = true;
+                        return;
+                }
+
+                region.width += region.x % in.h;
+                region.height += region.y % in.v;
+                region.x -= region.x % in.h;
+                region.y -= region.y % in.v;
+        }
+
+        /* Nothing to move : the coefficients are kept as is */
+        if (transform == TRANSFORM_NONE && region.width == jpeg->width
+            && region.height == jpeg->height)
+                return;
+
+        /* Mirrored partial MCUs would end up inside the image */
+        if (geometry->mirror_h)
+                region.width -= region.width % in.h;
+
+        if (geometry->mirror_v)
+                region.height -= region.height % in.v;
+
+        if (region.width == 0 || region.height == 0) {
+                printf("ERROR : the image is smaller than one MCU\n");
+                *error = true;
+                return;
+        }
+
+
+        /* Output image informations, transposed if needed */
+        jpeg->width = geometry->transpose ? region.height : region.width;
+        jpeg->height = geometry->transpose ? region.width : region.height;
+        jpeg->mcu.h = geometry->transpose ? in.v : in.h;
+        jpeg->mcu.v = geometry->transpose ? in.h : in.v;
+
+        compute_mcu(jpeg, error);
+
+        const uint32_t size = jpeg->mcu.nb * nb_mcu_blocks * BLOCK_SIZE * sizeof(int32_t);
+        int32_t *blocks = (*error) ? NULL : malloc(size);
+
+        if (blocks == NULL) {
+                *error = true;
+                return;
+        }
+
+
+        struct block_transform coeffs;
+        init_block_transform(geometry, &coeffs);
+
+        /* Move each output block's coefficients from the source block */
+        for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
+                i_c = jpeg->comp_order[i];
+
+                const struct comp *in_comp = &in_comps[i_c];
+                const struct comp *out_comp = &jpeg->comps[i_c];
+
+                /* Source region's first block and size, in blocks */
+                const uint32_t x0 = region.x / in.h * in_comp->nb_blocks_h;
+                const uint32_t y0 = region.y / in.v * in_comp->nb_blocks_v;
+                const uint32_t nb_x = (region.width + in.h - 1) / in.h * in_comp->nb_blocks_h;
+                const uint32_t nb_y = (region.height + in.v - 1) / in.v * in_comp->nb_blocks_v;
+
+                const uint32_t nb_out_h = jpeg->mcu.nb_h * out_comp->nb_blocks_h;
+                const uint32_t nb_out_v = jpeg->mcu.nb_v * out_comp->nb_blocks_v;
+
+                for (uint32_t y = 0; y < nb_out_v; y++) {
+                        for (uint32_t x = 0; x < nb_out_h; x++) {
+
+                                uint32_t x_in = geometry->transpose ? y : x;
+                                uint32_t y_in = geometry->transpose ? x : y;
+
+                                if (geometry->mirror_h)
+                                        x_in = nb_x - 1 - x_in;
+
+                                if (geometry->mirror_v)
+                                        y_in = nb_y - 1 - y_in;
+
+                                const int32_t *block_in = &jpeg->mcu_data[
+                                        block_index(&in, in_comp, nb_mcu_blocks,
+                                                    first_block[i_c], x0 + x_in, y0 + y_in)];
+
+                                int32_t *block_out = &blocks[
+                                        block_index(&jpeg->mcu, out_comp, nb_mcu_blocks,
+                                                    first_block[i_c], x, y)];
+
+                                for (uint8_t k = 0; k < BLOCK_SIZE; k++)
+                                        block_out[k] = coeffs.sign[k]
+                                                     * block_in[coeffs.index[k]];
+                        }
+                }
+        }
+
+        /* Quantification tables follow their coefficients */
+        uint8_t qtable[BLOCK_SIZE];
+
+        for (uint8_t t = 0; t < MAX_QTABLES; t++) {
+                memcpy(qtable, jpeg->qtables[t], sizeof(qtable));
+
+                for (uint8_t k = 0; k < BLOCK_SIZE; k++)
+                        jpeg->qtables[t][k] = qtable[coeffs.index[k]];
+        }
+
+        SAFE_FREE(jpeg->mcu_data);
+
+        jpeg->mcu_data = blocks;
+        jpeg->mcu_capacity = size;
+}
+
+
+/*
+ * Downscaling state, shared by all the pipeline stages
+ */
+struct downscaler {
+        struct jpeg_data *jpeg;
+
+        /* Source MCU informations and image coefficients */
+        struct mcu_info in;
+        const int32_t *in_blocks;
+
+        /* Downscaled image coefficients */
+        int32_t *blocks;
+
+        /* Number of blocks per MCU, and index of each component's first one */
+        uint32_t nb_mcu_blocks;
+        uint32_t first_block[MAX_COMPS];
+
+        /*
+         * 1-D composition matrices : the low frequencies of a pair
+         * of blocks (first or second) give the averaged block's ones
+         */
+        double merge[2][BLOCK_DIM][BLOCK_DIM / 2];
+};
+
+/*
+ * Computes the 1-D composition matrices of a 2x downscale.
+ * The first half of the averaged samples comes from the first
+ * block, the second half from the second one : each matrix
+ * is the DCT of the averaged IDCT of one block's low frequencies.
+ */
+static void init_merge_matrices(double merge[2][BLOCK_DIM][BLOCK_DIM / 2])
+{
+        const double scale[2] = { sqrt(1. / BLOCK_DIM), sqrt(2. / BLOCK_DIM) };
+
+        for (uint8_t b = 0; b < 2; b++) {
+                for (uint8_t k = 0; k < BLOCK_DIM; k++) {
+                        for (uint8_t u = 0; u < BLOCK_DIM / 2; u++) {
+
+                                double sum = 0;
+
+                                for (uint8_t n = 0; n < BLOCK_DIM / 2; n++) {
+                                        const uint8_t y = n + b * BLOCK_DIM / 2;
+
+                                        const double average =
+                                                (cos((4 * n + 1) * u * M_PI / 16)
+                                                 + cos((4 * n + 3) * u * M_PI / 16)) / 2;
+
+                                        sum += cos((2 * y + 1) * k * M_PI / 16) * average;
+                                }
+
+                                merge[b][k][u] = scale[k > 0] * scale[u > 0] * sum;
+                        }
+                }
+        }
+}
+
+/*
+ * Merges four blocks (rows then columns, NULL outside the image)
+ * into their quantified 2x downscaled block
+ */
+static void merge_blocks(const struct downscaler *downscaler, const int32_t *blocks[2][2],
+                         const uint8_t qtable[BLOCK_SIZE], int32_t *out)
+{
+        double coeffs[BLOCK_DIM][BLOCK_DIM];
+        double rows[BLOCK_DIM / 2][BLOCK_DIM];
+
+        memset(coeffs, 0, sizeof(coeffs));
+
+        for (uint8_t a = 0; a < 2; a++) {
+                for (uint8_t b = 0; b < 2; b++) {
+
+                        const int32_t *block = blocks[a][b];
+
+                        if (block == NULL)
+                                continue;
+
+                        /* Horizontal composition of the low frequencies */
+                        for (uint8_t v = 0; v < BLOCK_DIM / 2; v++) {
+                                for (uint8_t l = 0; l < BLOCK_DIM; l++) {
+                                        double sum = 0;
+
+                                        for (uint8_t u = 0; u < BLOCK_DIM / 2; u++) {
+                                                const uint8_t z = zz[v * BLOCK_DIM + u];
+
+                                                sum += downscaler->merge[b][l][u]
+                                                     * block[z] * qtable[z];
+                                        }
+
+                                        rows[v][l] = sum;
+                                }
+                        }
+
+                        /* Vertical composition */
+                        for (uint8_t k = 0; k < BLOCK_DIM; k++)
+                                for (uint8_t l = 0; l < BLOCK_DIM; l++)
+                                        for (uint8_t v = 0; v < BLOCK_DIM / 2; v++)
+                                                coeffs[k][l] += downscaler->merge[a][k][v]
+                                                              * rows[v][l];
+                }
+        }
+
+        /* Quantify to the nearest values */
+        for (uint8_t k = 0; k < BLOCK_DIM; k++) {
+                for (uint8_t l = 0; l < BLOCK_DIM; l++) {
+                        const uint8_t z = zz[k * BLOCK_DIM + l];
+
+                        out[z] = lround(coeffs[k][l] / qtable[z]);
+                }
+        }
+}
+
+/* Downscales the blocks of one output MCU row (parallel stage) */
+static void downscale_row(void *data, uint32_t row, void *slot, uint32_t worker)
+{
+        struct downscaler *downscaler = data;
+        struct jpeg_data *jpeg = downscaler->jpeg;
+        const struct mcu_info *in = &downscaler->in;
+
+        const int32_t *blocks[2][2];
+        uint8_t i_c;
+
+        UNUSED(slot);
+        UNUSED(worker);
+
+        for (uint32_t m = 0; m < jpeg->mcu.nb_h; m++) {
+                for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
+
+                        i_c = jpeg->comp_order[i];
+
+                        const struct comp *comp = &jpeg->comps[i_c];
+                        const uint8_t *qtable = jpeg->qtables[comp->i_q];
+                        const uint32_t nb_h = in->nb_h * comp->nb_blocks_h;
+                        const uint32_t nb_v = in->nb_v * comp->nb_blocks_v;
+
+                        for (uint8_t v = 0; v < comp->nb_blocks_v; v++) {
+                                for (uint8_t h = 0; h < comp->nb_blocks_h; h++) {
+
+                                        const uint32_t x = m * comp->nb_blocks_h + h;
+                                        const uint32_t y = row * comp->nb_blocks_v + v;
+
+                                        /* Source blocks, none outside the image */
+                                        for (uint8_t a = 0; a < 2; a++) {
+                                                for (uint8_t b = 0; b < 2; b++) {
+                                                        const uint32_t x_in = 2 * x + b;
+                                                        const uint32_t y_in = 2 * y + a;
+
+                                                        blocks[a][b] = (x_in < nb_h && y_in < nb_v)
+                                                                ? &downscaler->in_blocks[
+                                                                        block_index(in, comp,
+                                                                        downscaler->nb_mcu_blocks,
+                                                                        downscaler->first_block[i_c],
+                                                                        x_in, y_in)]
+                                                                : NULL;
+                                                }
+                                        }
+
+                                        merge_blocks(downscaler, blocks, qtable,
+                                                     &downscaler->blocks[block_index(
+                                                        &jpeg->mcu, comp,
+                                                        downscaler->nb_mcu_blocks,
+                                                        downscaler->first_block[i_c], x, y)]);
+                                }
+                        }
+                }
+        }
+}
+
+/*
+ * Downscales by 2 the quantified coefficients of a JPEG input
+ * (see read_coefficients) : the low frequencies of each 2x2 blocks
+ * are merged into one block, quantified with the same table
+ */
+void downscale_jpeg(struct jpeg_data *jpeg, bool *error)
+{
+        if (jpeg == NULL || *error || !jpeg->transcoded) {
+                *error = true;
+                return;
+        }
+
+        struct downscaler downscaler;
+        uint32_t nb_threads = jpeg->nb_threads;
+        uint8_t i_c;
+
+        if (nb_threads == 0)
+                nb_threads = 1;
+
+        downscaler.jpeg = jpeg;
+        downscaler.in = jpeg->mcu;
+        downscaler.in_blocks = jpeg->mcu_data;
+        downscaler.nb_mcu_blocks = 0;
+
+        for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
+                i_c = jpeg->comp_order[i];
+
+                downscaler.first_block[i_c] = downscaler.nb_mcu_blocks;
+                downscaler.nb_mcu_blocks += jpeg->comps[i_c].nb_blocks_h
+                                          * jpeg->comps[i_c].nb_blocks_v;
+        }
+
+        init_merge_matrices(downscaler.merge);
+
+
+        /* Half size image, with the same sampling */
+        jpeg->width = (jpeg->width + 1) / 2;
+        jpeg->height = (jpeg->height + 1) / 2;
+
+        compute_mcu(jpeg, error);
+
+        const uint32_t size = jpeg->mcu.nb * downscaler.nb_mcu_blocks
+                            * BLOCK_SIZE * sizeof(int32_t);
+
+        downscaler.blocks = (*error) ? NULL : malloc(size);
+
+        if (downscaler.blocks == NULL) {
+                *error = true;
+                return;
+        }
+
+
+        /* Downscale all output MCU rows in parallel */
+        const struct pipeline_stages stages = { NULL, downscale_row, NULL };
+        void *slots[pipeline_nb_slots(nb_threads)];
+
+        memset(slots, 0, sizeof(slots));
+
+        if (!run_pipeline(jpeg->pool, &stages, &downscaler, slots, jpeg->mcu.nb_v, nb_threads))
+                *error = true;
+
+        SAFE_FREE(jpeg->mcu_data);
+
+        jpeg->mcu_data = downscaler.blocks;
+        jpeg->mcu_capacity = size;
+}
+
+
+/*
+ * Requantization state, shared by all the pipeline stages
+ */
+struct requantizer {
+        struct jpeg_data *jpeg;
+
+        /* Number of blocks per MCU */
+        uint32_t nb_mcu_blocks;
+
+        /* Source and target quantification tables of each component */
+        const uint8_t *in_qtables[MAX_COMPS];
+        uint8_t out_qtable[BLOCK_SIZE];
+};
+
+/*
+ * Requantizes one coefficient, rounding to the nearest
+ * target value (halves away from zero)
+ */
+static inline int32_t requantize(int32_t value, uint8_t in_q, uint8_t out_q)
+{
+        const int32_t scaled = value * in_q;
+
+        if (scaled < 0)
+                return -((out_q / 2 - scaled) / out_q);
+
+        return (scaled + out_q / 2) / out_q;
+}
+
+/* Requantizes the blocks of one MCU row (parallel stage) */
+static void requantize_row(void *data, uint32_t row, void *slot, uint32_t worker)
+{
+        struct requantizer *requantizer = data;
+        struct jpeg_data *jpeg = requantizer->jpeg;
+
+        uint8_t i_c, nb_blocks;
+        const uint8_t *in_qtable;
+        const uint8_t *out_qtable = requantizer->out_qtable;
+
+        int32_t *block = &jpeg->mcu_data[row * jpeg->mcu.nb_h
+                                         * requantizer->nb_mcu_blocks * BLOCK_SIZE];
+
+        UNUSED(slot);
+        UNUSED(worker);
+
+        for (uint32_t m = 0; m < jpeg->mcu.nb_h; m++) {
+                for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
+
+                        i_c = jpeg->comp_order[i];
+                        in_qtable = requantizer->in_qtables[i_c];
+                        nb_blocks = jpeg->comps[i_c].nb_blocks_h
+                                  * jpeg->comps[i_c].nb_blocks_v;
+
+                        for (uint8_t n = 0; n < nb_blocks; n++) {
+                                for (uint8_t k = 0; k < BLOCK_SIZE; k++)
+                                        block[k] = requantize(block[k], in_qtable[k],
+                                                              out_qtable[k]);
+
+                                block += BLOCK_SIZE;
+                        }
+                }
+        }
+}
+
+/*
+ * Requantizes the quantified coefficients of a JPEG input
+ * (see read_coefficients) with the encoder's quantification
+ * table for jpeg->compression, without leaving the DCT domain
+ */
+void requantize_jpeg(struct jpeg_data *jpeg, bool *error)
+{
+        if (jpeg == NULL || *error || !jpeg->transcoded) {
+                *error = true;
+                return;
+        }
+
+        struct requantizer requantizer;
+        uint8_t in_qtables[MAX_COMPS][BLOCK_SIZE];
+        uint32_t nb_threads = jpeg->nb_threads;
+
+        if (nb_threads == 0)
+                nb_threads = 1;
+
+        requantizer.jpeg = jpeg;
+        requantizer.nb_mcu_blocks = 0;
+
+        default_qtable(requantizer.out_qtable, jpeg->compression);
+
+        /* Keep each component's source table, all of them then use the target one */
+        for (uint8_t i = 0; i < jpeg->nb_comps; i++) {
+                memcpy(in_qtables[i], jpeg->qtables[jpeg->comps[i].i_q], BLOCK_SIZE);
+
+                requantizer.in_qtables[i] = in_qtables[i];
+                requantizer.nb_mcu_blocks += jpeg->comps[i].nb_blocks_h
+                                           * jpeg->comps[i].nb_blocks_v;
+                jpeg->comps[i].i_q = 0;
+        }
+
+        memcpy(jpeg->qtables[0], requantizer.out_qtable, BLOCK_SIZE);
+
+
+        /* Requantize all MCU rows in parallel */
+        const struct pipeline_stages stages = { NULL, requantize_row, NULL };
+        void *slots[pipeline_nb_slots(nb_threads)];
+
+        memset(slots, 0, sizeof(slots));
+
+        if (!run_pipeline(jpeg->pool, &stages, &requantizer, slots, jpeg->mcu.nb_v, nb_threads))
+                *error = true;
+}
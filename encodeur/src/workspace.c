@@ -0,0 +1,155 @@
+
+#include "workspace.h"
+
+
+/* Rounds a size up to a whole number of cache lines */
+static inline size_t pad_size(size_t size)
+{
+        return (size + WORKSPACE_ALIGN - 1) & ~(size_t)(WORKSPACE_ALIGN - 1);
+}
+
+/*
+ * Allocates size bytes aligned on WORKSPACE_ALIGN.
+ * The raw pointer itself is stored just before the aligned address.
+ */
+void *aligned_malloc(size_t size)
+{
+        void *raw = malloc(size + WORKSPACE_ALIGN + sizeof(void*));
+
+        if (raw == NULL)
+                return NULL;
+
+        uintptr_t address = (uintptr_t)raw + sizeof(void*);
+
+        address = (address + WORKSPACE_ALIGN - 1) & ~(uintptr_t)(WORKSPACE_ALIGN - 1);
+        ((void**)address)[-1] = raw;
+
+        return (void*)address;
+}
+
+/* Frees memory allocated by aligned_malloc */
+void aligned_free(void *memory)
+{
+        if (memory != NULL)
+                free(((void**)memory)[-1]);
+}
+
+/* Frees a workspace's memory */
+void free_workspace(struct workspace *ws)
+{
+        if (ws == NULL)
+                return;
+
+        aligned_free(ws->memory);
+        memset(ws, 0, sizeof(struct workspace));
+}
+
+/*
+ * Sizes a workspace for MCUs of mcu_h_dim x mcu_v_dim blocks.
+ * Memory is only reallocated when growing.
+ * Returns false on allocation failure.
+ */
+bool reserve_workspace(struct workspace *ws,
+                       uint8_t mcu_h_dim, uint8_t mcu_v_dim)
+{
+        if (ws == NULL)
+                return false;
+
+        const size_t nb_blocks = mcu_h_dim * mcu_v_dim;
+        const size_t nb_pixels = nb_blocks * BLOCK_SIZE;
+
+        /* Plane sizes */
+        const size_t block_size = pad_size(BLOCK_SIZE * sizeof(int32_t));
+        const size_t blocks_size = pad_size(nb_pixels);
+        const size_t plane_size = pad_size(nb_pixels);
+        const size_t freqs_size = pad_size(0x100 * sizeof(uint32_t));
+
+        const size_t size = 2 * block_size + blocks_size
+                          + 3 * plane_size + 3 * 2 * freqs_size;
+
+
+        /* Allocate more memory only when required */
+        if (size > ws->capacity) {
+                void *memory = aligned_malloc(size);
+
+                if (memory == NULL)
+                        return false;
+
+                free_workspace(ws);
+
+                ws->memory = memory;
+                ws->capacity = size;
+        }
+
+        /* Split the memory into planes */
+        uint8_t *next = ws->memory;
+
+        ws->block = (int32_t*)next;
+        next += block_size;
+
+        ws->coeffs = (int32_t*)next;
+        next += block_size;
+
+        ws->blocks = next;
+        next += blocks_size;
+
+        for (uint8_t i = 0; i < 3; i++) {
+                ws->YCbCr[i] = next;
+                next += plane_size;
+        }
+
+        for (uint8_t i = 0; i < 3; i++) {
+                for (uint8_t j = 0; j < 2; j++) {
+                        ws->freqs[i][j] = (uint32_t*)next;
+                        next += freqs_size;
+                }
+        }
+
+        ws->mcu_h_dim = mcu_h_dim;
+        ws->mcu_v_dim = mcu_v_dim;
+
+        return true;
+}
+
+/*
+ * Sizes nb workspaces (one per worker thread), growing
+ * the *ws array of *nb_ws workspaces when required.
+ * Returns false on allocation failure.
+ */
+bool reserve_workspaces(struct workspace **ws, uint32_t *nb_ws, uint32_t nb,
+                        uint8_t mcu_h_dim, uint8_t mcu_v_dim)
+{
+        if (ws == NULL || nb_ws == NULL)
+                return false;
+
+        if (nb > *nb_ws) {
+                struct workspace *array = realloc(*ws, nb * sizeof(struct workspace));
+
+                if (array == NULL)
+                        return false;
+
+                memset(&array[*nb_ws], 0, (nb - *nb_ws) * sizeof(struct workspace));
+
+                *ws = array;
+                *nb_ws = nb;
+        }
+
+        for (uint32_t i = 0; i < nb; i++)
+                if (!reserve_workspace(&(*ws)[i], mcu_h_dim, mcu_v_dim))
+                        return false;
+
+        return true;
+}
+
+/* Frees an array of *nb_ws workspaces */
+void free_workspaces(struct workspace **ws, uint32_t *nb_ws)
+{
+        if (ws == NULL || nb_ws == NULL)
+                return;
+
+        for (uint32_t i = 0; i < *nb_ws; i++)
+                free_workspace(&(*ws)[i]);
+
+        SAFE_FREE(*ws);
+        *nb_ws = 0;
+}